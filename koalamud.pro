@@ -1,4 +1,4 @@
-SUBDIRS = koalamud
+SUBDIRS = koalamud tools
 TEMPLATE = subdirs 
 CONFIG += release \
           warn_on \
@@ -10,12 +10,14 @@
 * Description:
 * 	Ring buffer class primarily for usage in descriptor classes.
 * 	Requested buffer size is rounded up to the nearest multiple
-* 		of the shared memory page size.
+* 		of the page size.
 * 	IMPORTANT:
-* 		This buffer class requires shared memory to be available
-* 			for its operations
+* 		This buffer class requires memfd_create (Linux 3.17+) for
+* 			its mirrored mappings
 * Classes:
 * 	Buffer
+* 	BufferChain
+* 	RingPool
 \***************************************************************/
 
 #define KOALA_BUFFER_CXX "%A%"
@@ -27,130 +29,232 @@
 
 namespace koalamud {
 
-/** Prepare a ring buffer.
- * This sets up the memory mappings and initializes a ring buffer for usage.
+/** Build a new mirrored ring mapping
+ * Reserve twice the ring size of address space, then map the same memfd
+ * over both halves.
+ * @return Base of the mapping, or NULL on failure
  */
-Buffer::Buffer(unsigned int size = 4096)
+char *RingPool::map(int size)
 {
-	/* Round requested size up to the nearest page */
-	int req = getpagesize();
-	req += (size - 1) - ((size - 1) % req);
+	int fd = memfd_create("koalamud-ring", MFD_CLOEXEC);
+	if (fd < 0)
+	{
+		cerr << "Failed to create memfd for new buffer" << endl;
+		return NULL;
+	}
 
-	/* Set buffer size */
-	_size = req;
+	if (ftruncate(fd, size) < 0)
+	{
+		cerr << "Failed to size memfd for new buffer" << endl;
+		close(fd);
+		return NULL;
+	}
 
 	/* Find a place in virtual memory for the mapping */
-	if ((_lower_segment = (char *)mmap(NULL, 2*req,
-									PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
-									-1, 0)) == (char *)MAP_FAILED)
+	char *ring = (char *)mmap(NULL, 2*size, PROT_NONE,
+									MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == (char *)MAP_FAILED)
 	{
-		valid = false;
 		cerr << "Failed to locate memory segment for mapping new buffer" << endl;
-		return;
+		close(fd);
+		return NULL;
 	}
-	_upper_segment = _lower_segment + req;
 
-	/* Now that we have a location to map into, acquire a shared memory segment
-	 */
-	if ((_shmhandle = shmget(IPC_PRIVATE, req, IPC_CREAT | 0700)) == -1) {
-		valid = false;
-		cerr << "Failed to get shared memory segment for new buffer" << endl;
-		return;
+	/* Map the memfd over both halves of the reservation */
+	if (mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+					 fd, 0) == MAP_FAILED ||
+			mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+					 fd, 0) == MAP_FAILED)
+	{
+		cerr << "Failed to mirror memfd while creating new buffer" << endl;
+		munmap(ring, 2*size);
+		close(fd);
+		return NULL;
 	}
 
-	/* We have a shared memory segment, unmap our pointers and attached our
-	 * shared memory in place */
-	munmap(_lower_segment, req);
-	char *shmaddr = (char *)shmat(_shmhandle, _lower_segment, 0);
-	if (shmaddr != _lower_segment) {
-		valid = false;
-		cerr<<"SHM attached in wrong location while creating new buffer" << endl;
+	/* The mappings keep the memory alive */
+	close(fd);
+	return ring;
+}
+
+/** Tear down a mirrored ring mapping */
+void RingPool::unmap(char *ring, int size)
+{
+	munmap(ring, 2*size);
+}
+
+/** Get a mirrored ring of @a size bytes
+ * @param size Ring size, must be a multiple of the page size
+ * @return Base of the ring, or NULL if a new one could not be mapped
+ */
+char *RingPool::acquire(int size)
+{
+	poollock.acquire();
+	QMap<int, QValueList<char *> >::Iterator it = freerings.find(size);
+	if (it != freerings.end() && !it.data().isEmpty())
+	{
+		char *ring = it.data().first();
+		it.data().pop_front();
+		poollock.release();
+		return ring;
+	}
+	poollock.release();
+
+	return map(size);
+}
+
+/** Hand a ring back for reuse */
+void RingPool::release(char *ring, int size)
+{
+	poollock.acquire();
+	QValueList<char *> &rings = freerings[size];
+	if (rings.count() < maxpooled)
+	{
+		rings.push_front(ring);
+		poollock.release();
 		return;
 	}
+	poollock.release();
+
+	unmap(ring, size);
+}
+
+/** Prepare a ring buffer.
+ * This gets a mirrored mapping from the RingPool and initializes a ring buffer
+ * for usage.
+ * @param size Requested size in bytes
+ * @param spsc Build the buffer without a lock.  Only safe when exactly one
+ * 						 thread reads and one thread writes.
+ */
+Buffer::Buffer(unsigned int size = 4096, bool spsc = false)
+	: _rpos(0), _wpos(0), _spsc(spsc)
+{
+	/* Round requested size up to the nearest page */
+	int req = getpagesize();
+	req += (size - 1) - ((size - 1) % req);
 
-	munmap(_upper_segment, req);
-	shmaddr = (char *)shmat(_shmhandle, _upper_segment, 0);
-	if (shmaddr != _upper_segment) {
+	/* Set buffer size */
+	_size = req;
+
+	if ((_lower_segment = RingPool::instance()->acquire(req)) == NULL)
+	{
 		valid = false;
-		cerr<<"SHM attached in wrong location while creating new buffer" << endl;
 		return;
 	}
+	_upper_segment = _lower_segment + req;
 
-	shmctl(_shmhandle, IPC_RMID, NULL);
-
-	_head = _tail = _lower_segment;
+	_scanned = _linesize = 0;
 	
 	valid = true;
 }
 
-/** Destroy a ring buffer */
+/** Destroy a ring buffer and return its mapping to the pool */
 Buffer::~Buffer(void)
 {
+	if (valid)
+		RingPool::instance()->release(_lower_segment, _size);
 	valid=false;
-	shmdt(_lower_segment);
-	shmdt(_upper_segment);
 }
 
-/** Return a pointer to a line of input or NULL if a full line of input is not
- * available.  Line will have \r and \n stripped off of it.
+/** Return a copy of a line of input or NULL if a full line of input is not
+ * available.  Line will have \r and \n stripped off of it.  The caller must
+ * free() the line.
  *
  * NOTE:  To prevent a buffer lock condition where the buffer is full, but no
  * newline exists, the entire buffer will be returned when the buffer is full
+ * @see peekLine for a version that doesn't copy
  */
 char *Buffer::getLine(void)
+{
+	int len;
+	const char *start = peekLine(len);
+	if (start == NULL)
+		return NULL;
+
+	char *line = strndup(start, len);
+	releaseLine();
+	return line;
+}
+
+/** Find the next line of input without copying it
+ * Stripping rules match getLine, including returning the whole buffer when it
+ * is full and has no newline.  The returned pointer stays valid until
+ * releaseLine() is called, which frees the space the line uses.
+ * @param len Set to the length of the line, without any \r or \n
+ * @return Pointer to the start of the line in the buffer, or NULL if there
+ * 				 isn't a full line yet.  The line is not null terminated.
+ * @note There may only be one reader pulling lines from a buffer.  Writers
+ * 			 only touch the free space, so the line is safe without the lock held.
+ */
+const char *Buffer::peekLine(int &len)
 {
 	lock();
-	/* Since there isn't a version of strchr or index that will use a length
-	 * flag, we'll roll our own. */
-	char *pos = _head;
-	while (pos != _tail) {
-		if (*pos == '\n')
-			break;
-		++pos;
-	}
-	if (*pos != '\n')
+	char *pos = findEol();
+	char *head = headptr();
+	if (pos == NULL)
 	{
 		/* We don't have a full line available */
-		if (isFull())
+		if (!isFull())
 		{
-			/* Buffer is full, return the whole thing and reset */
-			char *line = strndup(_head, _size);
-			_head = _tail = _lower_segment;
 			unlock();
-			return line;
+			return NULL;
 		}
+
+		/* Buffer is full, return the whole thing */
+		_linesize = len = _size;
 		unlock();
-		return NULL;
+		return head;
 	}
 
-	/* We found the end of the line, null terminate at pos and check for a \r */
-	*pos = '\0';
-	if (*(pos-1) == '\r') *(pos-1) = '\0';
-	if (*(pos+1) == '\r')
-	{
-		++pos;
-		*pos = '\0';
-	}
+	/* Strip a \r before the newline, and swallow one after it for clients
+	 * that send \n\r */
+	len = pos - head;
+	if (len > 0 && head[len-1] == '\r')
+		--len;
+	_linesize = pos + 1 - head;
+	if (_linesize < getUsed() && *(pos+1) == '\r')
+		++_linesize;
 
-	/* duplicate the line of text */
-	char *line = strdup(_head);
+	unlock();
+	return head;
+}
 
-	/* Move head pointer to pos+1 */
-	_head = pos + 1;
+/** Free the space used by the line returned from the last peekLine() */
+void Buffer::releaseLine(void)
+{
+	lock();
+	consume(_linesize);
+	_linesize = 0;
+	unlock();
+}
 
-	/* Adjust head and tail pointers if empty or in upper segment */
-	if (_head == _tail)
-	{
-		_head = _tail = _lower_segment;
-	}
-	else if (_head > _upper_segment)
+/** Find the first newline in the buffer
+ * The search starts where the last one gave up.
+ * @return Pointer to the newline, or NULL if there isn't one yet
+ * @note The buffer must be locked by the caller
+ */
+char *Buffer::findEol(void)
+{
+	char *head = headptr();
+	int used = getUsed();
+	char *pos = (char *)memchr(head + _scanned, '\n', used - _scanned);
+	if (pos == NULL)
 	{
-		_head -= _size;
-		_tail -= _size;
+		_scanned = used;
+		return NULL;
 	}
+	_scanned = pos - head;
+	return pos;
+}
 
-	unlock();
-	return line;
+/** Release @a amt bytes from the head of the buffer
+ * Only the read position moves, so this never races the writer.
+ * @note The buffer must be locked by the caller
+ */
+void Buffer::consume(int amt)
+{
+	_scanned = (amt < _scanned) ? _scanned - amt : 0;
+	storepos(&_rpos, _rpos + amt);
 }
 
 /** Get some data out of the buffer.
@@ -166,52 +270,103 @@ int Buffer::getData(char *buf, int max)
 	if (max < getthis)
 		getthis = max;
 
-	strncpy(buf, _head, getthis);
+	memcpy(buf, headptr(), getthis);
 
-	/* Move head pointer to pos+1 */
-	_head += getthis;
-
-	/* Adjust head and tail pointers if empty or in upper segment */
-	if (_head == _tail)
-	{
-		_head = _tail = _lower_segment;
-	}
-	else if (_head > _upper_segment)
-	{
-		_head -= _size;
-		_tail -= _size;
-	}
+	/* Move head pointer past what we copied */
+	consume(getthis);
 
 	unlock();
 	return getthis;
 }
 
-/** Return true if getData would return anything other than NULL */
+/** Return true if getLine would return anything other than NULL */
 bool Buffer::canReadLine(void)
 {
 	lock();
-	/* Since there isn't a version of strchr or index that will use a length
-	 * flag, we'll roll our own. */
-	char *pos = _head;
-	while (pos != _tail) {
-		if (*pos == '\n')
-			break;
-		++pos;
+	bool ready = (findEol() != NULL || isFull());
+	unlock();
+	return ready;
+}
+
+/** Free every segment in the chain */
+BufferChain::~BufferChain(void)
+{
+	clear();
+}
+
+/** Copy @a len bytes onto the end of the chain, adding segments as needed */
+void BufferChain::append(const char *data, unsigned int len)
+{
+	while (len > 0)
+	{
+		if (_last == NULL || _last->end == segmentsize)
+		{
+			segment_t *seg = (segment_t *)PoolAllocator::alloc(sizeof(segment_t),
+																												 MEMTAG_BUFFER);
+			seg->next = NULL;
+			seg->start = seg->end = 0;
+			if (_last)
+				_last->next = seg;
+			else
+				_first = seg;
+			_last = seg;
+		}
+
+		unsigned int chunk = segmentsize - _last->end;
+		if (chunk > len)
+			chunk = len;
+		memcpy(_last->data + _last->end, data, chunk);
+		_last->end += chunk;
+		_used += chunk;
+		data += chunk;
+		len -= chunk;
 	}
-	if (*pos != '\n')
+}
+
+/** Describe queued data for writev
+ * @param iov Array to fill in
+ * @param max Number of entries available in @a iov
+ * @return Number of entries filled in
+ */
+int BufferChain::fillIov(struct iovec *iov, int max)
+{
+	int count = 0;
+	for (segment_t *seg = _first; seg && count < max; seg = seg->next)
 	{
-		/* We don't have a full line available */
-		if (isFull())
+		iov[count].iov_base = seg->data + seg->start;
+		iov[count].iov_len = seg->end - seg->start;
+		++count;
+	}
+	return count;
+}
+
+/** Drop @a amt bytes from the front of the chain and free empty segments */
+void BufferChain::consume(unsigned int amt)
+{
+	while (amt > 0 && _first)
+	{
+		unsigned int avail = _first->end - _first->start;
+		if (amt < avail)
 		{
-			unlock();
-			return true;
+			_first->start += amt;
+			_used -= amt;
+			return;
 		}
-		unlock();
-		return false;
+
+		amt -= avail;
+		_used -= avail;
+		segment_t *seg = _first;
+		_first = seg->next;
+		if (_first == NULL)
+			_last = NULL;
+		PoolAllocator::free(seg, MEMTAG_BUFFER);
 	}
+}
 
-	unlock();
-	return true;
+/** Throw away everything in the chain */
+void BufferChain::clear(void)
+{
+	consume(_used);
 }
 
 }; /* end koalamud namespace */
@@ -10,12 +10,14 @@
 * Description:
 * 	Ring buffer class primarily for usage in descriptor classes.
 * 	Requested buffer size is rounded up to the nearest multiple
-* 		of the shared memory page size.
+* 		of the page size.
 * 	IMPORTANT:
-* 		This buffer class requires shared memory to be available
-* 			for its operations
+* 		This buffer class requires memfd_create (Linux 3.17+) for
+* 			its mirrored mappings
 * Classes:
 * 	Buffer
+* 	BufferChain
+* 	RingPool
 \***************************************************************/
 
 #ifndef KOALA_BUFFER_HXX
@@ -23,33 +25,89 @@
 
 #include <zthread/FastRecursiveMutex.h>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <qmap.h>
+#include <qvaluelist.h>
 
 #include "memory.hxx"
 
 namespace koalamud
 {
 
+/** Mirrored ring mapping pool
+ * A ring is one memfd mapped twice, back to back, so data that wraps off the
+ * end of the ring is still contiguous in memory.  Building one costs several
+ * syscalls, and every descriptor needs two, so released rings are kept here
+ * and handed back out instead of being unmapped.  Up to maxpooled rings of
+ * each size are kept; anything past that is unmapped.
+ */
+class RingPool
+{
+	public:
+		/** Most free rings kept for any one size */
+		static const unsigned int maxpooled = 1024;
+
+	protected:
+		RingPool(void) {}
+
+	public:
+		char *acquire(int size);
+		void release(char *ring, int size);
+
+		/** Get a pointer to the singleton instance */
+		static RingPool *instance(void)
+			{
+				static RingPool *_instance = NULL;
+				if (_instance == NULL)
+					_instance = new RingPool;
+				return _instance;
+			}
+
+	protected:
+		char *map(int size);
+		void unmap(char *ring, int size);
+
+	protected:
+		/** Free rings, keyed by ring size */
+		QMap<int, QValueList<char *> > freerings;
+		/** Protects freerings */
+		ZThread::FastRecursiveMutex poollock;
+};
+
 /** Ring buffer class
- * This uses shared memory and mmap to provide an easy to manage ring buffer
+ * This uses a mirrored mapping from RingPool to provide an easy to manage
+ * ring buffer.
+ *
+ * Head and tail are kept as free running byte counts.  The reader only ever
+ * moves _rpos and the writer only ever moves _wpos, with release stores and
+ * acquire loads between them.  That lets a buffer with exactly one reader
+ * thread and one writer thread be built in SPSC mode, where lock() and
+ * unlock() do nothing and neither side ever blocks the other.  Buffers with
+ * more than one writer (or reader) must use the default locked mode.
  */
 class Buffer
 {
 	protected:
-		/** Shared memory handle */
-		int _shmhandle;
 		/** Size of buffer in bytes */
 		int _size;
 		/** Pointer to beginning of lower memory segment */
 		char *_lower_segment;
 		/** Pointer to beginning of upper memory segment */
 		char *_upper_segment;
-		/** Pointer to head of ring buffer */
-		char *_head;
-		/** Pointer to tail of ring buffer */
-		char *_tail;
+		/** Total bytes ever read.  Only the reader moves this. */
+		unsigned long _rpos;
+		/** Total bytes ever written.  Only the writer moves this. */
+		unsigned long _wpos;
+		/** True if the buffer has a single reader and single writer and
+		 * skips its mutex */
+		bool _spsc;
+		/** Bytes past the head already searched for a newline without finding
+		 * one, so line scans never look at the same byte twice */
+		int _scanned;
+		/** Bytes the line returned by peekLine() takes up, terminators
+		 * included */
+		int _linesize;
 		/** Mark whether or not the buffer is valid */
 		bool valid;
 		/** Buffer lock */
@@ -57,7 +115,7 @@ class Buffer
 
 	public:
 		/* Build and destroy it */
-		Buffer(unsigned int size=4096);
+		Buffer(unsigned int size=4096, bool spsc=false);
 		~Buffer(void);
 
 		/** Is this buffer valid (fully constructed ready to use) */
@@ -65,35 +123,115 @@ class Buffer
 
 		/* Status */
 		/** Get amount of free space in buffer */
-		int getFree(void) { return (_head + _size - _tail); }
+		int getFree(void) { return (_size - getUsed()); }
 		/** Get the amount of buffer space used */
-		int getUsed(void) { return (_tail - _head); }
+		int getUsed(void) { return (int)(loadpos(&_wpos) - loadpos(&_rpos)); }
 		/** Is the buffer full */
 		bool isFull(void) { return (getFree() == 0); }
 		/** Is the buffer empty */
-		bool isEmpty(void) { return (_head == _tail); }
+		bool isEmpty(void) { return (getUsed() == 0); }
 		bool canReadLine(void);
 
 		/* Put data in */
-		/** Lock the buffer and return the tail of the buffer */
-		char *getTail(void) { lock(); return _tail;}
+		/** Lock the buffer and return the tail of the buffer.  All getFree()
+		 * bytes from here are contiguous. */
+		char *getTail(void) { lock(); return tailptr();}
 		/** Update the buffer tail and unlock buffer */
-		void externDatain(int amt) { _tail += amt; unlock(); }
+		void externDatain(int amt)
+			{ storepos(&_wpos, _wpos + amt); unlock(); }
+
+		/* Take data out */
+		/** Lock the buffer and return the head of the buffer.  Thanks to the
+		 * mirrored mapping, all getUsed() bytes from here are contiguous. */
+		char *getHead(void) { lock(); return headptr();}
+		/** Release @a amt bytes from the head and unlock buffer */
+		void externDataout(int amt) { consume(amt); unlock(); }
 		int getData(char *buf, int max);
 
 		char *getLine(void);
+		const char *peekLine(int &len);
+		void releaseLine(void);
+
+		/** Lock buffer mutex.  Does nothing in SPSC mode. */
+		void lock(void) { if (!_spsc) _lock.acquire(); }
+		/** Unlock buffer mutex.  Does nothing in SPSC mode. */
+		void unlock(void) { if (!_spsc) _lock.release(); }
 
-		/** Lock buffer mutex */
-		void lock(void) { _lock.acquire(); }
-		/** Unlock buffer mutex */
-		void unlock(void) { _lock.release(); }
+	protected:
+		void consume(int amt);
+		char *findEol(void);
+
+		/** Head of the ring */
+		char *headptr(void) { return _lower_segment + (_rpos % _size); }
+		/** Tail of the ring */
+		char *tailptr(void) { return _lower_segment + (_wpos % _size); }
 
+		/** Read the other side's position.  The acquire pairs with storepos
+		 * so the data behind the position is visible too. */
+		static unsigned long loadpos(unsigned long *pos)
+			{ return __atomic_load_n(pos, __ATOMIC_ACQUIRE); }
+		/** Publish our position after the data behind it is in place */
+		static void storepos(unsigned long *pos, unsigned long val)
+			{ __atomic_store_n(pos, val, __ATOMIC_RELEASE); }
+
+	public:
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_BUFFER); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_BUFFER); }
+};
+
+/** Growable chain of fixed size segments
+ * This backs up a ring Buffer when more is queued than the ring can hold.
+ * Segments come from the PoolAllocator, are added on demand and are freed as
+ * soon as they have been consumed, so an idle chain costs nothing.
+ *
+ * @note There is no internal locking.  The owner serializes access (the
+ * Descriptor output path uses the lock of the ring this chain backs up).
+ */
+class BufferChain
+{
+	public:
+		/** Bytes of payload in each segment.  Sized so a whole segment fits
+		 * in one PoolAllocator block. */
+		static const unsigned int segmentsize = 4064;
+
+	protected:
+		/** One segment of the chain */
+		typedef struct TAG_segment {
+			/** Next segment in the chain */
+			struct TAG_segment *next;
+			/** Offset of first unconsumed byte */
+			unsigned int start;
+			/** Offset one past the last byte written */
+			unsigned int end;
+			/** Payload */
+			char data[segmentsize];
+		} segment_t;
+
+		/** First segment (oldest data) */
+		segment_t *_first;
+		/** Last segment (where appends go) */
+		segment_t *_last;
+		/** Total bytes queued in the chain */
+		unsigned int _used;
+
+	public:
+		/** Build an empty chain */
+		BufferChain(void) : _first(NULL), _last(NULL), _used(0) {}
+		~BufferChain(void);
+
+		/** Get the number of bytes queued */
+		unsigned int getUsed(void) const { return _used; }
+		/** Is the chain empty */
+		bool isEmpty(void) const { return (_used == 0); }
+
+		void append(const char *data, unsigned int len);
+		int fillIov(struct iovec *iov, int max);
+		void consume(unsigned int amt);
+		void clear(void);
 };
 
 }; /* end koalamud namespace */
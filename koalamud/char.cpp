@@ -231,9 +231,12 @@ bool Char::setSkillLevel(QString id, int level)
 		}
 		skrec = new SkillRecord(id, level, 0, newskill);
 		skills.insert(id, skrec);
-	} else {
+	} else if (skrec->getKnow() != level) {
 		skrec->setKnow(level);
+	} else {
+		return true;
 	}
+	skillChanged(id, level);
 	return true;
 }
 
@@ -63,6 +63,9 @@ class Char : public QObject
 		/** Is this a player char
 		 * Return true if this is a player character, false otherwise */
 		virtual bool isPC(void) { return false;}
+		/** Return the database id of a player character, 0 for anything that
+		 * isn't in the players table */
+		virtual int getDBID(void) const { return 0; }
 		/** Return true if this descriptor is disconnecting */
 		virtual bool isDisconnecting(void) {return _disconnecting; }
 		/** Return a pointer to the room we are in */
@@ -70,7 +73,7 @@ class Char : public QObject
 		/** Update the room we are in
 		 * Assume that calling function handles the player lists for the room pair
 		 */
-		void setRoom(Room *newroom) { _inroom = newroom; }
+		void setRoom(Room *newroom) { _inroom = newroom; roomChanged(); }
 		QString languageMorph(QString langid, QString msg, bool spoken = false);
 		/** Should we show a compass in room descriptions */
 		bool showCompass(void) const { return true; }
@@ -106,13 +109,19 @@ class Char : public QObject
 		virtual QDictIterator<SkillRecord> getSkrecIter(void)
 			{ QDictIterator<SkillRecord> skcur(skills); return skcur; }
 
+	protected: /* Change notification */
+		/** Called after the character moves to another room */
+		virtual void roomChanged(void) {}
+		/** Called after a skill's know level is set to a new value */
+		virtual void skillChanged(QString, int) {}
+
 	public: /* Operators */
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_CHAR); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_CHAR); }
 
 	protected:
 		/** Character name */
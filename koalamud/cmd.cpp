@@ -14,12 +14,18 @@
 
 #define KOALA_CMD_CXX "%A%"
 
+#include <time.h>
+#include <unistd.h>
+#include <qdir.h>
+
 #include "main.hxx"
 #include "exception.hxx"
 #include "logging.hxx"
 #include "cmd.hxx"
 #include "cmdtree.hxx"
+#include "cmdperm.hxx"
 #include "playerchar.hxx"
+#include "playercache.hxx"
 #include "room.hxx"
 
 /* New Command Stuff */
@@ -31,13 +37,18 @@ class Memstat : public Command
 	public:
 		/** Pass through constructor */
 		Memstat(Char *ch) : Command(ch) {}
-		/** Run memstat command */
+		/** Run memstat command
+		 * 'memstat tags' shows memory by subsystem instead of by size class.
+		 */
 		virtual unsigned int run(QString args)
 		{
 			QString str;
 			QTextOStream os(&str);
 
-			os << *koalamud::PoolAllocator::instance() << endl;;
+			if (args.stripWhiteSpace().lower() == "tags")
+				koalamud::PoolAllocator::instance()->tagreport(os);
+			else
+				os << *koalamud::PoolAllocator::instance() << endl;;
 
 			_ch->sendtochar(str);
 			return 0;
@@ -59,6 +70,71 @@ class Memstat : public Command
 
 };
 
+/** Heap profile dump command class */
+class Heapdump : public Command
+{
+	public:
+		/** Pass through constructor */
+		Heapdump(Char *ch) : Command(ch) {}
+		/** Run heapdump command
+		 * heapdump [file]
+		 * Writes the allocator's live heap profile samples for pprof into
+		 * dumpdir() under the server's directory.  The file must be a bare
+		 * name; it defaults to koalamud.<pid>.<time>.heap.
+		 */
+		virtual unsigned int run(QString args)
+		{
+			QString str;
+			QTextOStream os(&str);
+
+			QString file = args.stripWhiteSpace();
+			if (file.isEmpty())
+				file.sprintf("koalamud.%d.%ld.heap", (int)getpid(), (long)time(NULL));
+
+			if (file.contains('/') || file.contains(".."))
+			{
+				os << "The heap profile file must be a plain file name." << endl;
+				_ch->sendtochar(str);
+				return 1;
+			}
+
+			QDir dir(dumpdir());
+			if (!dir.exists() && !dir.mkdir(dir.path()))
+			{
+				os << "Unable to create the " << dumpdir() << " directory." << endl;
+				_ch->sendtochar(str);
+				return 1;
+			}
+
+			file = dir.filePath(file);
+			if (koalamud::PoolAllocator::instance()->heapprofile(file))
+				os << "Heap profile written to " << file << endl;
+			else
+				os << "Unable to write heap profile to " << file << endl;
+
+			_ch->sendtochar(str);
+			return 0;
+		}
+
+		/** Directory heap profiles are written to */
+		static QString dumpdir(void) { return QString("heapdumps"); }
+
+		/** Restricted access command. */
+		virtual bool isRestricted(void) const { return true;}
+
+		/** Command Groups */
+		virtual QStringList getCmdGroups(void) const
+		{
+			QStringList gl;
+			gl << "Implementor" << "Coder";
+			return gl;
+		}
+
+		/** Get command name for individual granting */
+		virtual QString getCmdName(void) const { return QString("heapdump"); }
+
+};
+
 /** Who command class */
 class Who : public Command
 {
@@ -320,6 +396,14 @@ class Grant : public Command
 					break;
 			}
 
+			/* Their cached permissions are stale now, and so is any prefetched
+			 * record from a login in progress.  Group grants also pick up any
+			 * groups added to the database since the names were loaded. */
+			CmdPermCache::instance()->invalidate(playerid);
+			PlayerCache::instance()->discard(player);
+			if (act == act_groupadd)
+				CmdPermCache::instance()->invalidateGroups();
+
 			_ch->sendtochar(str);
 
 			return 0;
@@ -412,6 +496,7 @@ class Cmd_CPP_CommandFactory : public CommandFactory
 			maincmdtree->addcmd("look", this, 6);
 			immcmdtree->addcmd("cmdlist", this, 7);
 			maincmdtree->addcmd("save", this, 8);
+			immcmdtree->addcmd("heapdump", this, 9);
 		}
 
 		/** Handle command object creations */
@@ -435,6 +520,8 @@ class Cmd_CPP_CommandFactory : public CommandFactory
 					return new koalamud::commands::CommandList(ch);
 				case 8:
 					return new koalamud::commands::Save(ch);
+				case 9:
+					return new koalamud::commands::Heapdump(ch);
 			}
 			return NULL;
 		}
@@ -450,8 +537,6 @@ Cmd_CPP_CommandFactory Cmd_CPP_CommandFactoryInstance;
 unsigned int Command::runCmd(QString args)
 	throw (koalamud::exceptions::cmdpermdenied)
 {
-	QSqlQuery q;
-
 	if (_overrideperms)
 		return run(args);
 	
@@ -459,56 +544,13 @@ unsigned int Command::runCmd(QString args)
 	if (!isRestricted())
 		return run(args);
 
-	/* We need to verify that ch has permission to run this command.
-	 * First we need to check if they have explicitly been granted or denied
-	 * permission to a command.  If that check turns up negative, we check to
-	 * see if they are in one of the command groups this command is available
-	 * to. */
-	QString cmdname = getCmdName();
-	if (cmdname.length() > 1)
-	{
-		/* Do a db lookup */
-		QString query;
-		QTextOStream qos(&query);
-
-		qos << "Select cp.allowed from cmdperm as cp, players as p" << endl;
-		qos << "where cp.playerid = p.playerid and" << endl;
-		qos << "p.name = '" << _ch->getName() << "' and " << endl;
-		qos << "cp.cmdname = '" << cmdname << "';";
-		if (q.exec(query))
-		{
-			if (q.numRowsAffected())
-			{
-				q.next();
-				if (q.value(0).toString() == "yes")
-				{
-					return run(args);
-				} else if (q.value(0).toString() == "no")
-				{
-					throw koalamud::exceptions::cmdpermdenied();
-				}
-			}
-		}
-	}
-
-	/* Check group permission */
-	QStringList gl = getCmdGroups();
-	QString grpwhere = gl.join("' or g.gname = '");
-	if (grpwhere.length() > 1)
-	{
-		QString query;
-		QTextOStream qos(&query);
-		qos << "select gm.playerid, gm.groupid" << endl;
-		qos << "from commandgroup as g, players as p, groupmem as gm" << endl;
-		qos << "where gm.playerid = p.playerid and" << endl;
-		qos << "p.name = '" << _ch->getName() << "' and" << endl;
-		qos << "gm.groupid = g.gid and" << endl;
-		qos << "(g.gname = '" << grpwhere << "');";
-
-		if (q.exec(query))
-			if (q.numRowsAffected())
-				return run(args);
-	}
+	/* We need to verify that ch has permission to run this command.  An
+	 * explicit grant or block on the command wins, otherwise they need to be
+	 * in one of the command groups this command is available to.  This is
+	 * answered from the permission cache. */
+	if (CmdPermCache::instance()->check(_ch->getDBID(), getCmdName(),
+																			getCmdGroups()))
+		return run(args);
 
 	/* Add any additional permissions checks here. */
 	
@@ -82,10 +82,10 @@ class Command
 
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_COMMAND); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_COMMAND); }
 };
 
 /** Command class factory base class
@@ -0,0 +1,246 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CMD/Permissions
+* Description:
+* 	In memory cache of command permissions.  Player grants and
+* 	group memberships are loaded once at login and restricted
+* 	commands are checked against the cache instead of the database.
+* Classes:
+* 	CmdPermCache
+\***************************************************************/
+
+#define KOALA_CMDPERM_CXX "%A%"
+
+#include <qsqlquery.h>
+#include <zthread/Guard.h>
+
+#include "cmdperm.hxx"
+#include "logging.hxx"
+
+namespace koalamud {
+
+/** Build an empty cache */
+CmdPermCache::CmdPermCache(void)
+	: players(101), groupsloaded(false)
+{
+	players.setAutoDelete(true);
+}
+
+/** Check whether a player may run a restricted command
+ * An explicit grant or block on the command wins.  Otherwise the player needs
+ * to be in one of the command's groups.
+ * @param playerid Player database id.  0 (not a player) is always denied.
+ * @param cmdname Name used for individual grants, may be empty
+ * @param groups Command groups the command belongs to
+ */
+bool CmdPermCache::check(int playerid, QString cmdname, QStringList groups)
+{
+	if (playerid == 0)
+		return false;
+
+	cachelock.acquire();
+	PlayerPerms *perms = players.find(playerid);
+	PlayerPerms *owned = NULL;
+	if (perms == NULL)
+	{
+		/* Read them without holding cachelock.  If they are invalidated while
+		 * we read, they still answer this check, they just aren't kept. */
+		cachelock.release();
+		owned = perms = fetch(playerid);
+		cachelock.acquire();
+	}
+
+	bool decided = false, allowed = false;
+	if (cmdname.length() > 1)
+	{
+		QMap<int, bool>::Iterator grant = perms->grants.find(cmdId(cmdname));
+		if (grant != perms->grants.end())
+		{
+			decided = true;
+			allowed = grant.data();
+		}
+	}
+
+	QStringList::Iterator it;
+	for (it = groups.begin(); !decided && it != groups.end(); ++it)
+	{
+		int gid = groupId(*it);
+		if (gid && perms->groups.contains(gid))
+			decided = allowed = true;
+	}
+
+	cachelock.release();
+	delete owned;
+	return allowed;
+}
+
+/** Load (or reload) a player's grants and group memberships */
+void CmdPermCache::load(int playerid)
+{
+	if (playerid == 0)
+		return;
+
+	delete fetch(playerid);
+}
+
+/** Read a player's grants and group memberships
+ * The queries run without cachelock held.  The result is cached unless the
+ * player is invalidated while they run, since the rows may be stale then.
+ * @return A copy of what was read, which the caller owns
+ */
+CmdPermCache::PlayerPerms *CmdPermCache::fetch(int playerid)
+{
+	cachelock.acquire();
+	loadstate_t &state = loading[playerid];
+	state.loads++;
+	unsigned long seen = state.invalidations;
+	cachelock.release();
+
+	QMap<QString, bool> grants;
+	QValueList<int> groups;
+	QSqlQuery q;
+
+	{
+		QString query;
+		QTextOStream qos(&query);
+		qos << "select cmdname, allowed from cmdperm" << endl
+				<< "where playerid = " << playerid << ";";
+		if (q.exec(query))
+		{
+			while (q.next())
+				grants.insert(q.value(0).toString(), q.value(1).toString() == "yes");
+		}
+	}
+
+	{
+		QString query;
+		QTextOStream qos(&query);
+		qos << "select groupid from groupmem" << endl
+				<< "where playerid = " << playerid << ";";
+		if (q.exec(query))
+		{
+			while (q.next())
+				groups.append(q.value(0).toInt());
+		}
+	}
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+
+	QMap<int, loadstate_t>::Iterator it = loading.find(playerid);
+	bool fresh = (it.data().invalidations == seen);
+	if (--it.data().loads == 0)
+		loading.remove(it);
+
+	PlayerPerms *perms = new PlayerPerms;
+	QMap<QString, bool>::Iterator grant;
+	for (grant = grants.begin(); grant != grants.end(); ++grant)
+		perms->grants.insert(cmdId(grant.key()), grant.data());
+	perms->groups = groups;
+
+	if (fresh)
+		players.replace(playerid, new PlayerPerms(*perms));
+	return perms;
+}
+
+/** Cache permissions for a player that were read somewhere else
+ * Used at login when the player was prefetched, so load() doesn't have to go
+ * to the database.
+ * @param grants Explicit grants keyed by command name
+ * @param groups Group ids the player is a member of
+ */
+void CmdPermCache::prime(int playerid, const QMap<QString, bool> &grants,
+												 const QValueList<int> &groups)
+{
+	if (playerid == 0)
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+	PlayerPerms *perms = new PlayerPerms;
+
+	QMap<QString, bool>::ConstIterator grant;
+	for (grant = grants.begin(); grant != grants.end(); ++grant)
+		perms->grants.insert(cmdId(grant.key()), grant.data());
+	perms->groups = groups;
+
+	players.replace(playerid, perms);
+}
+
+/** Forget a player's cached permissions
+ * Call this whenever cmdperm or groupmem rows for the player change, and when
+ * the player logs out.  The next check reloads them.
+ */
+void CmdPermCache::invalidate(int playerid)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+	players.remove(playerid);
+
+	/* Loads already reading this player mustn't cache what they read */
+	QMap<int, loadstate_t>::Iterator it = loading.find(playerid);
+	if (it != loading.end())
+		it.data().invalidations++;
+}
+
+/** Forget the command group name table
+ * Call this if rows are added to or removed from commandgroup. */
+void CmdPermCache::invalidateGroups(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+	groupids.clear();
+	groupsloaded = false;
+}
+
+/** Map a command name to its id, assigning a new id the first time
+ * @note cachelock must be held by the caller
+ */
+int CmdPermCache::cmdId(QString cmdname)
+{
+	QMap<QString, int>::Iterator it = cmdids.find(cmdname);
+	if (it != cmdids.end())
+		return it.data();
+
+	int id = cmdids.count() + 1;
+	cmdids.insert(cmdname, id);
+	return id;
+}
+
+/** Map a command group name to its commandgroup id
+ * @return The group id, or 0 if there is no such group
+ * @note cachelock must be held by the caller
+ */
+int CmdPermCache::groupId(QString gname)
+{
+	if (!groupsloaded)
+		loadGroups();
+
+	QMap<QString, int>::Iterator it = groupids.find(gname);
+	if (it == groupids.end())
+		return 0;
+	return it.data();
+}
+
+/** Load the command group name table
+ * @note cachelock must be held by the caller
+ */
+void CmdPermCache::loadGroups(void)
+{
+	QSqlQuery q;
+	groupids.clear();
+
+	if (!q.exec("select gid, gname from commandgroup;"))
+	{
+		Logger::msg("Unable to load command groups", Logger::LOG_ERROR);
+		return;
+	}
+
+	while (q.next())
+		groupids.insert(q.value(1).toString(), q.value(0).toInt());
+	groupsloaded = true;
+}
+
+}; /* end koalamud namespace */
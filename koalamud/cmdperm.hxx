@@ -0,0 +1,110 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CMD/Permissions
+* Description:
+* 	In memory cache of command permissions.  Player grants and
+* 	group memberships are loaded once at login and restricted
+* 	commands are checked against the cache instead of the database.
+* Classes:
+* 	CmdPermCache
+\***************************************************************/
+
+#ifndef KOALA_CMDPERM_HXX
+#define KOALA_CMDPERM_HXX "%A%"
+
+#include <qintdict.h>
+#include <qmap.h>
+#include <qstringlist.h>
+#include <qvaluelist.h>
+#include <zthread/FastRecursiveMutex.h>
+
+#include "memory.hxx"
+
+namespace koalamud {
+
+/** Command permission cache
+ * Each player's cmdperm grants and groupmem memberships are loaded the first
+ * time they are needed (normally at login) and kept until the player logs
+ * out or Grant changes them.  Command names and group names are mapped to
+ * integer ids once, so a check is a couple of integer lookups.
+ *
+ * Anything that changes cmdperm or groupmem for a player must call
+ * invalidate() for that player.
+ */
+class CmdPermCache
+{
+	protected:
+		/** Cached permissions for one player */
+		class PlayerPerms
+		{
+			public:
+				/** Explicit grants keyed by command id */
+				QMap<int, bool> grants;
+				/** Group ids the player is a member of */
+				QValueList<int> groups;
+
+			public:
+				/** Operator new overload */
+				void * operator new(size_t obj_size)
+					{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_COMMAND); }
+				/** Operator delete overload */
+				void operator delete(void *ptr)
+					{ koalamud::PoolAllocator::free(ptr, MEMTAG_COMMAND); }
+		};
+
+		/** fetch() calls in progress for one player */
+		typedef struct {
+			unsigned int loads; /**< fetch() calls reading the player */
+			unsigned long invalidations; /**< invalidate() calls while they run */
+		} loadstate_t;
+
+	protected:
+		CmdPermCache(void);
+
+	public:
+		bool check(int playerid, QString cmdname, QStringList groups);
+		void load(int playerid);
+		void prime(int playerid, const QMap<QString, bool> &grants,
+							 const QValueList<int> &groups);
+		void invalidate(int playerid);
+		void invalidateGroups(void);
+
+		/** Get a pointer to the singleton instance */
+		static CmdPermCache *instance(void)
+			{
+				static CmdPermCache *_instance = NULL;
+				if (_instance == NULL)
+					_instance = new CmdPermCache;
+				return _instance;
+			}
+
+	protected:
+		PlayerPerms *fetch(int playerid);
+		int cmdId(QString cmdname);
+		int groupId(QString gname);
+		void loadGroups(void);
+
+	protected:
+		/** Cached players keyed by player id */
+		QIntDict<PlayerPerms> players;
+		/** Command name to command id */
+		QMap<QString, int> cmdids;
+		/** Command group name to group id (commandgroup.gid) */
+		QMap<QString, int> groupids;
+		/** True once groupids has been loaded */
+		bool groupsloaded;
+		/** Players being read by fetch() */
+		QMap<int, loadstate_t> loading;
+		/** Protects everything above */
+		ZThread::FastRecursiveMutex cachelock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_CMDPERM_HXX
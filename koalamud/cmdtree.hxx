@@ -73,10 +73,10 @@ class CommandTree {
 			public:
 				/** Operator new overload */
 				void * operator new(size_t obj_size)
-					{ return koalamud::PoolAllocator::alloc(obj_size); }
+					{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_COMMAND); }
 				/** Operator delete overload */
 				void operator delete(void *ptr)
-					{ koalamud::PoolAllocator::free(ptr); }
+					{ koalamud::PoolAllocator::free(ptr, MEMTAG_COMMAND); }
 
 				/** Make sure that CommandTree can manipulate our data (for traversal
 				 * and adding nodes */
@@ -88,10 +88,10 @@ class CommandTree {
 		~CommandTree(void);
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_COMMAND); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_COMMAND); }
 
 		bool addcmd(QString name, CommandFactory *fact, unsigned int id);
 		QString displayBranch();
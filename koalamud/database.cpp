@@ -14,6 +14,9 @@
 
 #define KOALA_DATABASE_CXX "%A%"
 
+#include <zthread/Exceptions.h>
+
+#include "main.hxx"
 #include "database.hxx"
 #include "logging.hxx"
 
@@ -32,7 +35,7 @@ namespace koalamud {
 Database::Database(QString user="koalamud", QString pass="k23hjdsav",
 							 QString db="koalamud", QString server="localhost",
 							 QString driver="QMYSQL3")
-			: dbonline(false), defaultDB(NULL)
+			: dbonline(false), defaultDB(NULL), _pool(NULL)
 {
 	defaultDB = QSqlDatabase::addDatabase( driver );
 	if (!defaultDB)
@@ -52,9 +55,60 @@ Database::Database(QString user="koalamud", QString pass="k23hjdsav",
 /** Shutdown database connections */
 Database::~Database(void)
 {
+	delete _pool;
 	defaultDB->close();
 }
 
+/** Start the asynchronous query workers
+ * @param count Number of worker threads, each with its own connection.  With
+ * 							0 workers every query runs inline in submit().
+ */
+void Database::startWorkers(unsigned int count)
+{
+	if (_pool || count == 0)
+		return;
+
+	_pool = new DBPool(defaultDB, count);
+
+	QString str;
+	QTextOStream os(&str);
+	os << "Started " << _pool->workerCount() << " database worker threads";
+	Logger::msg(str, Logger::LOG_NOTICE);
+}
+
+/** Stop the asynchronous query workers
+ * Queries already running finish first; queued ones are thrown away.  Later
+ * requests run their queries inline in submit().
+ */
+void Database::stopWorkers(void)
+{
+	delete _pool;
+	_pool = NULL;
+}
+
+/** Run a database request asynchronously
+ * The request is queued to the worker pool, which takes ownership of it.  If
+ * the pool isn't running, the query runs on the calling thread with the
+ * default connection instead.  complete() is still left to the game
+ * executor either way, so callers never see it run inside submit().
+ */
+void Database::submit(DBRequest *req)
+{
+	if (_pool && _pool->workerCount() > 0)
+	{
+		_pool->submit(req);
+		return;
+	}
+
+	req->query(defaultDB);
+	try {
+		srv->executor()->execute(req);
+	} catch (ZThread::Cancellation_Exception &) {
+		/* Server is shutting down */
+		delete req;
+	}
+}
+
 /** Get listen ports from database
  * Return a value list with the ports we should listen on.
  * @note  Eventually we will need to add the type of listen port along with
@@ -82,6 +136,149 @@ QValueList<int> Database::getListenPorts(QString profile)
 	return pl;
 }
 
+/** Get the number of network I/O threads from the database
+ * This reads the '<profile>-iothreads' config value.  0 (the default when
+ * the value is missing) runs all socket I/O on the main server thread.
+ */
+unsigned int Database::getIOThreadCount(QString profile)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname = '" << profile << "-iothreads';";
+	if (q.exec(query) && q.next())
+	{
+		return q.value(0).toUInt();
+	}
+
+	return 0;
+}
+
+/** Get the number of database worker threads from the database
+ * This reads the '<profile>-dbthreads' config value and defaults to
+ * defaultdbthreads when it is missing.
+ */
+unsigned int Database::getDBThreadCount(QString profile)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname = '" << profile << "-dbthreads';";
+	if (q.exec(query) && q.next())
+	{
+		return q.value(0).toUInt();
+	}
+
+	return defaultdbthreads;
+}
+
+/** Get the accept backlog for a listen port from the database
+ * '<profile>-backlog-<port>' sets the backlog for one port, and
+ * '<profile>-backlog' sets it for every other port.
+ * @param defbacklog Value to use if neither is set
+ */
+int Database::getListenBacklog(QString profile, int port, int defbacklog)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname in ('" << profile << "-backlog-" << port << "', '"
+			<< profile << "-backlog')" << endl
+			<< "order by length(vname) desc limit 1;";
+	if (q.exec(query) && q.next())
+	{
+		int backlog = q.value(0).toInt();
+		if (backlog > 0)
+			return backlog;
+	}
+
+	return defbacklog;
+}
+
+/** Get the world snapshot file name from the database
+ * This reads the '<profile>-worldsnap' config value and defaults to
+ * koalamud-<profile>.world in the current directory.
+ */
+QString Database::getWorldSnapshotFile(QString profile)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname = '" << profile << "-worldsnap';";
+	if (q.exec(query) && q.next() && !q.value(0).toString().isEmpty())
+	{
+		return q.value(0).toString();
+	}
+
+	return QString("koalamud-") + profile + ".world";
+}
+
+/** Find out whether zones are paged in on demand
+ * '<profile>-zonepaging' set to 'yes' turns paging on.  The default is to load
+ * the whole world at boot.
+ */
+bool Database::getZonePaging(QString profile)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname = '" << profile << "-zonepaging';";
+	if (q.exec(query) && q.next())
+	{
+		return (q.value(0).toString().lower() == "yes");
+	}
+
+	return false;
+}
+
+/** Get the seconds an unoccupied zone stays resident from the database
+ * Reads '<profile>-zonettl'.  0 means use ZoneManager's default.
+ */
+unsigned int Database::getZoneTTL(QString profile)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname = '" << profile << "-zonettl';";
+	if (q.exec(query) && q.next())
+	{
+		return q.value(0).toUInt();
+	}
+
+	return 0;
+}
+
+/** Get the resident zone memory budget in kilobytes from the database
+ * Reads '<profile>-zonememory'.  0 means no limit.
+ */
+unsigned long Database::getZoneMemory(QString profile)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	qos << "select vval from config" << endl
+			<< "where vname = '" << profile << "-zonememory';";
+	if (q.exec(query) && q.next())
+	{
+		return q.value(0).toULong();
+	}
+
+	return 0;
+}
+
 /** Validate and upgrade database schema
 	 * 
 	 * @note  There are *NO* break statements between cases.
@@ -817,6 +1014,38 @@ void Database::checkschema(void)
 				}
 			}
 		} /* }}} */
+		case 19: /* {{{ db at version 19, Add world content version */
+		{
+			cout << "Database schema at version " << schemaversion
+					 << ", upgrading to version " << schemaversion+1 << endl;
+			{
+				QString q;
+				QTextOStream qos(&q);
+				qos << "insert into config (vname, vval) values" << endl
+						<< "('WorldVersion', '1');";
+				if (!query.exec(q))
+				{
+					cout << "FATAL: error upgrading schema to version "
+							 << schemaversion+1 << endl;
+					cout << "Query: " << q << endl;
+					return;
+				}
+			}
+			{
+				QString q;
+				QTextOStream qos(&q);
+				qos << "update config" << endl;
+				qos << "set vval = '" << ++schemaversion << "'" << endl;
+				qos << "where vname='SchemaVersion';";
+				if (!query.exec(q))
+				{
+					cout << "FATAL: error upgrading schema to version "
+							 << schemaversion << endl;
+					cout << "Query: " << q << endl;
+					return;
+				}
+			}
+		} /* }}} */
 		default:  /* {{{ Schema version is current */
 		{
 			cout << "Database schema at version " << schemaversion 
@@ -17,6 +17,8 @@
 
 #include <qsqldatabase.h>
 
+#include "dbpool.hxx"
+
 namespace koalamud {
 
 	/** Database interface module
@@ -27,6 +29,10 @@ namespace koalamud {
 	 */
 	class Database
 	{
+		public:
+			/** Database worker threads when the config doesn't say */
+			static const unsigned int defaultdbthreads = 4;
+
 		public:
 			Database(QString user="koalamud", QString pass="k23hjdsav",
 							 QString db="koalamud", QString server="localhost",
@@ -36,12 +42,29 @@ namespace koalamud {
 			/** Return database status */
 			bool isonline(void) { return dbonline; }
 			QValueList<int> getListenPorts(QString profile);
+			unsigned int getIOThreadCount(QString profile);
+			unsigned int getDBThreadCount(QString profile);
+			int getListenBacklog(QString profile, int port, int defbacklog);
+			QString getWorldSnapshotFile(QString profile);
+			bool getZonePaging(QString profile);
+			unsigned int getZoneTTL(QString profile);
+			unsigned long getZoneMemory(QString profile);
+
+			void startWorkers(unsigned int count);
+			void stopWorkers(void);
+			/** Open another connection to our database under @a name
+			 * @see DBPool::openConnection */
+			QSqlDatabase *openConnection(QString name)
+				{ return DBPool::openConnection(defaultDB, name); }
+			void submit(DBRequest *req);
 
 		protected:
 			/** Flag to track db status during startup */
 			bool dbonline;
 			/** Pointer to our database */
 			QSqlDatabase *defaultDB;
+			/** Asynchronous query workers, NULL until startWorkers */
+			DBPool *_pool;
 
 			void checkschema(void);
 	};
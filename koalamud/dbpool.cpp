@@ -0,0 +1,176 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CORE/DBPool
+* Description:
+* 	Asynchronous database access.  Queries are queued to a pool of
+* 	worker threads, each with its own database connection, and
+* 	results are delivered back on the game executor so a slow
+* 	query only holds up whoever asked for it.
+* Classes:
+* 	DBRequest
+* 	DBPool
+\***************************************************************/
+
+#define KOALA_DBPOOL_CXX "%A%"
+
+#include <qptrlist.h>
+#include <zthread/Exceptions.h>
+
+#include "main.hxx"
+#include "dbpool.hxx"
+#include "logging.hxx"
+
+namespace koalamud {
+
+/** Open the worker connections and start the workers
+ * @param model Open connection whose settings the workers copy
+ * @param workers Number of worker threads to start
+ */
+DBPool::DBPool(QSqlDatabase *model, unsigned int workers)
+	: _workers(NULL)
+{
+	QPtrList<QSqlDatabase> dbs;
+
+	for (unsigned int i = 0; i < workers; i++)
+	{
+		QString name;
+		name.sprintf("koalamud-db-%u", i);
+
+		QSqlDatabase *db = openConnection(model, name);
+		if (!db)
+			break;
+
+		connections << name;
+		dbs.append(db);
+	}
+
+	if (dbs.isEmpty())
+		return;
+
+	_workers = new ZThread::PoolExecutor<ZThread::FastMutex>(dbs.count(),
+																													 dbs.count());
+	QPtrListIterator<QSqlDatabase> db(dbs);
+	for (; *db; ++db)
+	{
+		_workers->execute(new Worker(this, *db));
+	}
+}
+
+/** Open a named connection with the same settings as another
+ * @param model Connection to copy the settings from
+ * @param name Name for the new connection.  Remove it with
+ * 						 QSqlDatabase::removeDatabase when done.
+ * @return The open connection, or NULL if it couldn't be opened
+ */
+QSqlDatabase *DBPool::openConnection(QSqlDatabase *model, QString name)
+{
+	QSqlDatabase *db = QSqlDatabase::addDatabase(model->driverName(), name);
+	if (!db)
+		return NULL;
+
+	db->setDatabaseName(model->databaseName());
+	db->setUserName(model->userName());
+	db->setPassword(model->password());
+	db->setHostName(model->hostName());
+
+	if (!db->open())
+	{
+		QSqlDatabase::removeDatabase(name);
+		QString str;
+		QTextOStream os(&str);
+		os << "Unable to open database connection " << name;
+		Logger::msg(str, Logger::LOG_ERROR);
+		return NULL;
+	}
+
+	return db;
+}
+
+/** Stop the workers and close their connections
+ * Requests the workers haven't started yet are thrown away without being
+ * run; the workers only finish the ones already in progress. */
+DBPool::~DBPool(void)
+{
+	DBRequest *req;
+
+	/* A cancelled queue still hands out what it holds, so empty it first */
+	for (;;)
+	{
+		try {
+			req = requests.next(0);
+		} catch (ZThread::Timeout_Exception &) {
+			break;
+		}
+		delete req;
+	}
+	requests.cancel();
+
+	if (_workers)
+	{
+		_workers->cancel();
+		_workers->wait();
+		delete _workers;
+	}
+
+	for (QStringList::Iterator it = connections.begin();
+			 it != connections.end(); ++it)
+	{
+		QSqlDatabase::removeDatabase(*it);
+	}
+
+	/* Anything the workers left behind when they stopped */
+	while (!requests.empty())
+	{
+		req = requests.next();
+		delete req;
+	}
+}
+
+/** Queue a request for the workers
+ * The pool takes ownership of @a req.
+ * @return false if the pool is shutting down, in which case the request has
+ * 				 been deleted
+ */
+bool DBPool::submit(DBRequest *req)
+{
+	try {
+		requests.add(req);
+	} catch (ZThread::Cancellation_Exception &) {
+		delete req;
+		return false;
+	}
+	return true;
+}
+
+/** Run requests until the pool is cancelled
+ * Finished requests are handed to the game executor, which calls complete()
+ * and then deletes them. */
+void DBPool::Worker::run(void)
+{
+	for (;;)
+	{
+		DBRequest *req;
+		try {
+			req = _pool->requests.next();
+		} catch (ZThread::Cancellation_Exception &) {
+			return;
+		}
+
+		req->query(_db);
+		try {
+			srv->executor()->execute(req);
+		} catch (ZThread::Cancellation_Exception &) {
+			/* Server is shutting down */
+			delete req;
+			return;
+		}
+	}
+}
+
+}; /* end koalamud namespace */
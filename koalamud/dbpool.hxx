@@ -0,0 +1,117 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CORE/DBPool
+* Description:
+* 	Asynchronous database access.  Queries are queued to a pool of
+* 	worker threads, each with its own database connection, and
+* 	results are delivered back on the game executor so a slow
+* 	query only holds up whoever asked for it.
+* Classes:
+* 	DBRequest
+* 	DBPool
+\***************************************************************/
+
+#ifndef KOALA_DBPOOL_HXX
+#define KOALA_DBPOOL_HXX "%A%"
+
+#include <qsqldatabase.h>
+#include <qstringlist.h>
+#include <zthread/BlockingQueue.h>
+#include <zthread/FastMutex.h>
+#include <zthread/PoolExecutor.h>
+#include <zthread/Runnable.h>
+
+#include "memory.hxx"
+
+namespace koalamud {
+
+/** Asynchronous database request
+ * Subclasses do their SQL in query(), which runs on a database worker thread
+ * with that worker's own connection, and keep whatever they need from the
+ * result in member variables.  complete() is then run on the game executor,
+ * so it is free to touch game state and send output.  The request is deleted
+ * after complete() returns.
+ *
+ * query() must not touch game state.  Requests issued on behalf of a player
+ * normally hold the player's input (ParseDescriptor::holdInput) until
+ * complete() so later commands can't overtake the query.
+ */
+class DBRequest : public ZThread::Runnable
+{
+	public:
+		/** Empty constructor */
+		DBRequest(void) {}
+		/** Empty virtual destructor */
+		virtual ~DBRequest(void) {}
+
+		/** Run the SQL for this request on a database worker thread
+		 * @param db Connection owned by the worker running the request */
+		virtual void query(QSqlDatabase *db) = 0;
+		/** Deliver the results.  Runs on the game executor. */
+		virtual void complete(void) {}
+
+		/** Executor entry point - just calls complete() */
+		virtual void run(void) { complete(); }
+
+	public:
+		/** Operator new overload */
+		void * operator new(size_t obj_size)
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_DATABASE); }
+		/** Operator delete overload */
+		void operator delete(void *ptr)
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_DATABASE); }
+};
+
+/** Database worker pool
+ * Each worker opens a named connection (koalamud-db-<n>) with the same
+ * settings as the main connection and takes requests off a shared queue
+ * until the pool is destroyed.
+ */
+class DBPool
+{
+	protected:
+		/** Worker thread task */
+		class Worker : public ZThread::Runnable
+		{
+			public:
+				/** Build a worker for @a pool using connection @a db */
+				Worker(DBPool *pool, QSqlDatabase *db) : _pool(pool), _db(db) {}
+				/** Empty virtual destructor */
+				virtual ~Worker(void) {}
+				virtual void run(void);
+
+			protected:
+				/** Pool we take requests from */
+				DBPool *_pool;
+				/** Connection owned by this worker */
+				QSqlDatabase *_db;
+		};
+
+	public:
+		DBPool(QSqlDatabase *model, unsigned int workers);
+		~DBPool(void);
+
+		/** Return the number of workers with an open connection */
+		unsigned int workerCount(void) const { return connections.count(); }
+		bool submit(DBRequest *req);
+
+		static QSqlDatabase *openConnection(QSqlDatabase *model, QString name);
+
+	protected:
+		/** Queued requests */
+		ZThread::BlockingQueue<DBRequest *, ZThread::FastMutex> requests;
+		/** Executor running the workers */
+		ZThread::Executor *_workers;
+		/** Names of the connections opened for the workers */
+		QStringList connections;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_DBPOOL_HXX
@@ -5,7 +5,7 @@ UI_DIR = .uic
 MOC_DIR = .moc
 OBJECTS_DIR = .obj
 TEMPLATE = app 
-LIBS += -lZThread
+LIBS += -lZThread -lrt
 CONFIG += debug \
           warn_on \
           qt \
@@ -15,9 +15,9 @@ CONFIG += debug \
 core {
 	CONFIG += world cmd gui char olc
 	SOURCES += main.cpp network.cpp database.cpp memory.cpp logging.cpp
-	SOURCES += buffer.cpp
+	SOURCES += buffer.cpp reactor.cpp dbpool.cpp
 	HEADERS += main.hxx network.hxx database.hxx event.hxx memory.hxx
-	HEADERS += logging.hxx exception.hxx buffer.hxx
+	HEADERS += logging.hxx exception.hxx buffer.hxx reactor.hxx dbpool.hxx
 }
 
 olc {
@@ -26,19 +26,23 @@ olc {
 }
 
 world {
-	SOURCES += room.cpp language.cpp
-	HEADERS += room.hxx language.hxx roomedit.hxx
+	SOURCES += room.cpp language.cpp worldsnap.cpp roomindex.cpp
+	SOURCES += roomgrid.cpp zonemgr.cpp
+	HEADERS += room.hxx language.hxx roomedit.hxx worldsnap.hxx roomindex.hxx
+	HEADERS += roomgrid.hxx zonemgr.hxx
 }
 
 char {
-	SOURCES += char.cpp playerchar.cpp skill.cpp
-	HEADERS += char.hxx playerchar.hxx skill.hxx
+	SOURCES += char.cpp playerchar.cpp skill.cpp playersave.cpp
+	SOURCES += playercache.cpp
+	HEADERS += char.hxx playerchar.hxx skill.hxx playersave.hxx
+	HEADERS += playercache.hxx
 }
 
 cmd {
 	SOURCES += cmd.cpp cmdtree.cpp comm.cpp
-	SOURCES += help.cpp parser.cpp
-	HEADERS += cmd.hxx cmdtree.hxx comm.hxx help.hxx parser.hxx
+	SOURCES += help.cpp parser.cpp cmdperm.cpp
+	HEADERS += cmd.hxx cmdtree.hxx comm.hxx help.hxx parser.hxx cmdperm.hxx
 }
 
 gui {
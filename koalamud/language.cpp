@@ -17,6 +17,7 @@
 #include <stdlib.h>
 
 #include "logging.hxx"
+#include "worldsnap.hxx"
 #include "language.hxx"
 #include "cmd.hxx"
 #include "cmdtree.hxx"
@@ -169,6 +170,8 @@ void LanguageOLC::save(void)
 	/* Reload language */
 	delete Language::getLanguage(langid);
 	new Language(langid, name, parentlang, charset, difficulty, shortname);
+
+	WorldSnapshot::instance()->changed();
 }
 
 /** Load language from database for editing */
@@ -99,10 +99,10 @@ class Language : public Skill
 	public:
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_SKILL); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_SKILL); }
 
 	public:  /* Property gets */
 		/** Get language difficulty */
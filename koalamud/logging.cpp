@@ -17,51 +17,146 @@
 #include <qsqlquery.h>
 #include <qsqlerror.h>
 #include <qdatetime.h>
+#include <qdeepcopy.h>
+#include <qfile.h>
 #include <qregexp.h>
+#include <zthread/Exceptions.h>
+#include <zthread/PoolExecutor.h>
 
+#include "main.hxx"
 #include "logging.hxx"
+#include "reactor.hxx"
 #include "cmd.hxx"
 #include "cmdtree.hxx"
 
 namespace koalamud {
 
-/** Log a message to the database
- * This does the actual work of logging a message into the database and
- * sending the appropriate signal to send the message back out to listening
- * players, and logging to the console if we are not running in the
- * background.
+/** Build an empty ring.  Slot i is ready for push number i. */
+LogRing::LogRing(void)
+	: _pushpos(0), _poppos(0)
+{
+	for (unsigned int i = 0; i < ringsize; i++)
+	{
+		slots[i].seq = i;
+		slots[i].ent = NULL;
+	}
+}
+
+/** Queue an entry.  Safe to call from any thread.
+ * @return false if the ring is full
+ */
+bool LogRing::push(LogEntry *ent)
+{
+	unsigned long pos = __atomic_load_n(&_pushpos, __ATOMIC_RELAXED);
+	slot_t *slot;
+
+	for (;;)
+	{
+		slot = &slots[pos & (ringsize - 1)];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)seq - (long)pos;
+
+		if (diff == 0)
+		{
+			/* Slot is free - claim the position */
+			if (__atomic_compare_exchange_n(&_pushpos, &pos, pos + 1, true,
+																			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Flusher hasn't emptied this slot from the last lap */
+			return false;
+		} else {
+			/* Another thread got here first */
+			pos = __atomic_load_n(&_pushpos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->ent = ent;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/** Take the oldest entry off the ring.  Only the flusher may call this.
+ * @return The entry, or NULL if the ring is empty
+ */
+LogEntry *LogRing::pop(void)
+{
+	slot_t *slot = &slots[_poppos & (ringsize - 1)];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != _poppos + 1)
+		return NULL;
+
+	LogEntry *ent = slot->ent;
+	__atomic_store_n(&slot->seq, _poppos + ringsize, __ATOMIC_RELEASE);
+	++_poppos;
+	return ent;
+}
+
+/** Return true if there is nothing to pop.  Only the flusher may call this.
+ * An entry whose push hasn't finished yet doesn't count. */
+bool LogRing::isEmpty(void)
+{
+	slot_t *slot = &slots[_poppos & (ringsize - 1)];
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != _poppos + 1;
+}
+
+/** Build a log entry stamped with the current time */
+LogEntry::LogEntry(Logger::log_lev sev, QString msg)
+	: sev(sev), when(time(NULL)), msg(QDeepCopy<QString>(msg))
+{
+}
+
+/** Log a message
+ * Once the flusher is running this only queues the message; the console
+ * copy, the signals to listening players and the database insert all happen
+ * on the flusher thread.  If the queue is full the message is counted and
+ * dropped rather than making the caller wait.  Before the flusher starts (and
+ * after it stops) messages are handled immediately on the calling thread.
  * @param lm message to log
  * @param sev message severity
  */
 void Logger::imsg(QString lm, log_lev sev = LOG_INFO)
 {
-	QSqlQuery q;
-	/* Get severity text */
-	QString sevstring;
-	switch (sev)
+	LogEntry *ent = new LogEntry(sev, lm);
+
+	if (__atomic_load_n(&_flushing, __ATOMIC_ACQUIRE))
 	{
-		case LOG_FATAL: sevstring = "FATAL"; break;
-		case LOG_SEVERE: sevstring = "Severe"; break;
-		case LOG_CRITICAL: sevstring = "Critical"; break;
-		case LOG_ERROR: sevstring = "Error"; break;
-		case LOG_WARNING: sevstring = "Warning"; break;
-		case LOG_NOTICE: sevstring = "Notice"; break;
-		case LOG_INFO: sevstring = "Info"; break;
-		case LOG_DEBUG: sevstring = "Debug"; break;
+		if (!ring.push(ent))
+		{
+			delete ent;
+			__atomic_add_fetch(&_dropped, 1, __ATOMIC_RELAXED);
+		}
+		wakeFlusher();
+		return;
 	}
 
-	/* Only log to the database if we are above our minimum severity level */
-	if (sev <= _minsev)
+	QPtrList<LogEntry> batch;
+	batch.setAutoDelete(true);
+	deliver(ent);
+	batch.append(ent);
+	store(batch, NULL);
+}
+
+/** Get severity text */
+QString Logger::sevString(log_lev sev)
+{
+	switch (sev)
 	{
-		/* Construct a query to insert the log record */
-		QString query;
-		QTextOStream qos(&query);
-		qos << "insert into logging (severity, profile,msgtime, message) values" 
-				<< endl
-				<< "('" << sevstring << "', '" << profile << "', NOW(),"
-				<< "'" << escapeString(lm) << "');";
-		q.exec(query);
+		case LOG_FATAL: return "FATAL";
+		case LOG_SEVERE: return "Severe";
+		case LOG_CRITICAL: return "Critical";
+		case LOG_ERROR: return "Error";
+		case LOG_WARNING: return "Warning";
+		case LOG_NOTICE: return "Notice";
+		case LOG_INFO: return "Info";
+		case LOG_DEBUG: return "Debug";
 	}
+	return QString::null;
+}
+
+/** Copy a message to the console and to listening players */
+void Logger::deliver(LogEntry *ent)
+{
+	QString sevstring = sevString(ent->sev);
 
 	/* If we are not detached, construct a string and send to the console.  use
 	 * cerr for anything below LOG_WARNING, cout for everything else.  These
@@ -70,10 +165,12 @@ void Logger::imsg(QString lm, log_lev sev = LOG_INFO)
 	{
 		QString tm;
 		QTextOStream os(&tm);
+		QDateTime when;
+		when.setTime_t(ent->when);
 
-		os << "[" << sevstring << "] " <<
-			QDateTime::currentDateTime().toString() << ": " << lm << endl;
-		if (sev < LOG_WARNING)
+		os << "[" << sevstring << "] " << when.toString() << ": " << ent->msg
+			 << endl;
+		if (ent->sev < LOG_WARNING)
 		{
 			cerr << tm;
 		} else {
@@ -86,8 +183,8 @@ void Logger::imsg(QString lm, log_lev sev = LOG_INFO)
 		QString gm;
 		QTextOStream os(&gm);
 
-		os << "[" << sevstring << "]: " << lm << endl;
-		switch (sev)
+		os << "[" << sevstring << "]: " << ent->msg << endl;
+		switch (ent->sev)
 		{
 			case LOG_FATAL: emit logfatalsent(gm); break;
 			case LOG_SEVERE: emit logseveresent(gm); break;
@@ -101,6 +198,220 @@ void Logger::imsg(QString lm, log_lev sev = LOG_INFO)
 	}
 }
 
+/** Write a batch of messages to the database with a single insert
+ * Only messages at or above our minimum severity are stored.  If the insert
+ * fails the batch goes to the fallback file instead, and if the insert fails
+ * or is slow, batches keep going to the file for fallbacktime.
+ * @param db Connection to use, NULL for the default connection
+ */
+void Logger::store(QPtrList<LogEntry> &batch, QSqlDatabase *db)
+{
+	QString query;
+	QTextOStream qos(&query);
+	unsigned int rows = 0;
+
+	qos << "insert into logging (severity, profile,msgtime, message) values"
+			<< endl;
+	QPtrListIterator<LogEntry> it(batch);
+	for (; *it; ++it)
+	{
+		if ((*it)->sev > _minsev)
+			continue;
+		qos << (rows++ ? ",\n" : "")
+				<< "('" << sevString((*it)->sev) << "', '" << profile << "', "
+				<< "FROM_UNIXTIME(" << (unsigned long)(*it)->when << "),"
+				<< "'" << escapeString((*it)->msg) << "')";
+	}
+	if (rows == 0)
+		return;
+	qos << ";";
+
+	unsigned long long start = Reactor::now();
+	if (start < _fallbackuntil)
+	{
+		storeFile(batch);
+		return;
+	}
+
+	QSqlQuery q(QString::null, db);
+	if (!q.exec(query))
+	{
+		storeFile(batch);
+		_fallbackuntil = Reactor::now() + fallbacktime;
+	} else if (Reactor::now() - start > lagthreshold) {
+		_fallbackuntil = Reactor::now() + fallbacktime;
+	}
+}
+
+/** Append a batch of messages to the local fallback log file
+ * This is used while the database is failing or lagging.  The file is
+ * koalamud-<profile>.log in the working directory.
+ */
+void Logger::storeFile(QPtrList<LogEntry> &batch)
+{
+	QFile f(QString("koalamud-") + profile + ".log");
+	if (!f.open(IO_WriteOnly | IO_Append))
+		return;
+
+	QTextStream os(&f);
+	QPtrListIterator<LogEntry> it(batch);
+	for (; *it; ++it)
+	{
+		if ((*it)->sev > _minsev)
+			continue;
+		QDateTime when;
+		when.setTime_t((*it)->when);
+		os << "[" << sevString((*it)->sev) << "] " << when.toString() << ": "
+			 << (*it)->msg << endl;
+	}
+	f.close();
+}
+
+/** Start the background log flusher
+ * From here on messages are queued instead of being written by the thread
+ * that logs them.  The flusher gets its own database connection.
+ */
+void Logger::startFlusher(void)
+{
+	if (_flusher)
+		return;
+
+	_db = srv->db()->openConnection("koalamud-log");
+	_flusher = new ZThread::PoolExecutor<ZThread::FastMutex>(1, 1);
+	__atomic_store_n(&_flushing, true, __ATOMIC_RELEASE);
+	_flusher->execute(new FlushTask);
+}
+
+/** Stop the flusher after it writes out everything queued
+ * Messages logged after this are handled on the calling thread again.
+ */
+void Logger::stopFlusher(void)
+{
+	if (!_flusher)
+		return;
+
+	__atomic_store_n(&_flushing, false, __ATOMIC_SEQ_CST);
+	wakeFlusher();
+	_flusher->wait();
+	delete _flusher;
+	_flusher = NULL;
+
+	/* Catch anything pushed while we were shutting the flusher down */
+	QPtrList<LogEntry> batch;
+	batch.setAutoDelete(true);
+	LogEntry *ent;
+	while ((ent = ring.pop()) != NULL)
+	{
+		deliver(ent);
+		batch.append(ent);
+	}
+	if (!batch.isEmpty())
+		store(batch, _db);
+
+	if (_db)
+	{
+		_db = NULL;
+		QSqlDatabase::removeDatabase("koalamud-log");
+	}
+}
+
+/** Wake the flusher if it is waiting for messages
+ * The fence pairs with the one in FlushTask::run: either we see it waiting
+ * or it sees what we just pushed (or that it should stop).
+ */
+void Logger::wakeFlusher(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_sleeping, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&_sleeping, false, __ATOMIC_ACQ_REL))
+		_wakeup.post();
+}
+
+/** Drain the log ring until the logger is stopped
+ * Messages are delivered as soon as they are popped.  Database rows are
+ * collected and written when a batch fills or has waited flushinterval.
+ * Between drains we wait for a push to wake us, or for the pending batch to
+ * come due.
+ */
+void Logger::FlushTask::run(void)
+{
+	Logger *log = Logger::instance();
+	QPtrList<LogEntry> batch;
+	batch.setAutoDelete(true);
+	unsigned long long batchstart = 0;
+
+	for (;;)
+	{
+		/* Check before draining so nothing queued before the stop is missed */
+		bool stopping = !__atomic_load_n(&log->_flushing, __ATOMIC_ACQUIRE);
+
+		LogEntry *ent;
+		while ((ent = log->ring.pop()) != NULL)
+		{
+			log->deliver(ent);
+			if (batch.isEmpty())
+				batchstart = Reactor::now();
+			batch.append(ent);
+			if (batch.count() >= maxbatch)
+			{
+				log->store(batch, log->_db);
+				batch.clear();
+			}
+		}
+
+		unsigned long dropped = __atomic_exchange_n(&log->_dropped, 0,
+																								__ATOMIC_RELAXED);
+		if (dropped)
+		{
+			QString str;
+			QTextOStream os(&str);
+			os << "Log queue overflowed, " << dropped << " messages dropped";
+			ent = new LogEntry(LOG_WARNING, str);
+			log->deliver(ent);
+			batch.append(ent);
+		}
+
+		if (!batch.isEmpty() &&
+				(stopping || Reactor::now() - batchstart >= flushinterval))
+		{
+			log->store(batch, log->_db);
+			batch.clear();
+		}
+
+		if (stopping)
+			return;
+
+		unsigned long wait = flushinterval;
+		if (!batch.isEmpty())
+		{
+			unsigned long long age = Reactor::now() - batchstart;
+			wait = (age < flushinterval) ? flushinterval - age : 1;
+		}
+
+		__atomic_store_n(&log->_sleeping, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		bool woken = false;
+		if (log->ring.isEmpty() &&
+				__atomic_load_n(&log->_flushing, __ATOMIC_RELAXED))
+		{
+			try {
+				woken = log->_wakeup.tryAcquire(wait);
+			} catch (ZThread::Interrupted_Exception &) {
+			}
+		}
+		/* If a pusher cleared _sleeping its post is on the way; take it so
+		 * stale posts don't pile up */
+		if (!woken && !__atomic_exchange_n(&log->_sleeping, false,
+																			 __ATOMIC_ACQ_REL))
+		{
+			try {
+				log->_wakeup.acquire();
+			} catch (ZThread::Interrupted_Exception &) {
+			}
+		}
+	}
+}
+
 /** Escape special characters in strings
  * This is primarily to escape special strings before inserting a string into
  * the database.
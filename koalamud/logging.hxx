@@ -15,11 +15,59 @@
 #ifndef KOALA_LOGGING_HXX
 #define KOALA_LOGGING_HXX "%A%"
 
+#include <time.h>
 #include <qobject.h>
+#include <qptrlist.h>
+#include <qsqldatabase.h>
 #include <qstring.h>
+#include <zthread/CountingSemaphore.h>
+#include <zthread/Executor.h>
+#include <zthread/Runnable.h>
+
+#include "memory.hxx"
 
 namespace koalamud {
 
+/* Predefine log entry */
+class LogEntry;
+
+/** Lock free log message queue
+ * A fixed size ring of LogEntry pointers that any number of threads can push
+ * into and the log flusher pops from.  Each slot carries a sequence number
+ * that says whose turn it is, so producers only contend on a single compare
+ * and swap and never wait on each other or the flusher.  push() fails
+ * instead of blocking when the ring is full.
+ */
+class LogRing
+{
+	public:
+		/** Number of slots.  Must be a power of two. */
+		static const unsigned int ringsize = 4096;
+
+	protected:
+		/** One ring slot */
+		typedef struct {
+			/** Position this slot is ready for */
+			unsigned long seq;
+			/** Entry stored in the slot */
+			LogEntry *ent;
+		} slot_t;
+
+		/** The ring */
+		slot_t slots[ringsize];
+		/** Next position to push to */
+		unsigned long _pushpos;
+		/** Next position to pop from.  Only the flusher touches this. */
+		unsigned long _poppos;
+
+	public:
+		LogRing(void);
+
+		bool push(LogEntry *ent);
+		LogEntry *pop(void);
+		bool isEmpty(void);
+};
+
 /** Database logger class
  * This class provides database logging functionality to the server.  It is a
  * singleton class and the static methods will automatically call into the
@@ -28,6 +76,11 @@ namespace koalamud {
  * We will automatically pick up the execution profile from the MainServer
  * object while logging.  We will also copy all logging messages to the
  * terminal if we are not running in the background.
+ *
+ * Once startFlusher() has been called, logging a message only pushes it onto
+ * a lock free ring.  A background flusher does the console output, the
+ * signals and the database work, writing rows in batches.  When the database
+ * fails or lags, batches go to a local file for a while instead.
  */
 class Logger : public QObject
 {
@@ -45,6 +98,28 @@ class Logger : public QObject
 			LOG_DEBUG, /**< Debugging information */
 		} log_lev; /**< Logging severity levels */
 
+		/** Longest a message waits in a partial batch, in milliseconds */
+		static const unsigned int flushinterval = 250;
+		/** Most rows written by one insert */
+		static const unsigned int maxbatch = 128;
+		/** An insert slower than this (milliseconds) means the database is
+		 * lagging */
+		static const unsigned int lagthreshold = 1000;
+		/** How long to log to the fallback file after the database failed or
+		 * lagged, in milliseconds */
+		static const unsigned int fallbacktime = 30000;
+
+	protected:
+		/** Background flusher task */
+		class FlushTask : public ZThread::Runnable
+		{
+			public:
+				/** Empty virtual destructor */
+				virtual ~FlushTask(void) {}
+				virtual void run(void);
+		};
+		friend class FlushTask;
+
 	protected:
 		/** Lowest level we are logging to the database.
 		 * All messages are logged to the console and all messages are sent via
@@ -53,13 +128,40 @@ class Logger : public QObject
 		log_lev _minsev;
 		/** Server profile to log.  Should be set before logging stuff */
 		QString profile;
+		/** Messages waiting for the flusher */
+		LogRing ring;
+		/** True while the flusher is running and messages go through the ring.
+		 * Accessed atomically. */
+		bool _flushing;
+		/** True while the flusher may be waiting on _wakeup.  Accessed
+		 * atomically; whoever clears it posts _wakeup. */
+		bool _sleeping;
+		/** Posted to wake the flusher early */
+		ZThread::CountingSemaphore _wakeup;
+		/** Executor running the flusher */
+		ZThread::Executor *_flusher;
+		/** Flusher database connection */
+		QSqlDatabase *_db;
+		/** Messages dropped because the ring was full */
+		unsigned long _dropped;
+		/** Monotonic time until which batches go to the fallback file */
+		unsigned long long _fallbackuntil;
 
 		/** Force usage as a singleton.  Only instance() can instantiate us */
-		Logger(void) : _minsev(LOG_INFO), profile("Default") {}
+		Logger(void) : _minsev(LOG_INFO), profile("Default"), _flushing(false),
+			_sleeping(false), _flusher(NULL), _db(NULL), _dropped(0), _fallbackuntil(0) {}
+
+		static QString sevString(log_lev sev);
+		void deliver(LogEntry *ent);
+		void store(QPtrList<LogEntry> &batch, QSqlDatabase *db);
+		void storeFile(QPtrList<LogEntry> &batch);
+		void wakeFlusher(void);
 
 	public:
 		static QString escapeString(QString str);
 		void imsg(QString lm, log_lev sev = LOG_INFO);
+		void startFlusher(void);
+		void stopFlusher(void);
 		/** Log a message to the database */
 		static void msg(QString lm, log_lev sev = LOG_INFO)
 		{ instance()->imsg(lm, sev); }
@@ -113,6 +215,29 @@ class Logger : public QObject
 		void logfatalsent(QString message);
 };
 
+/** One queued log message */
+class LogEntry
+{
+	public:
+		/** Build an entry, deep copying @a msg so it can cross threads */
+		LogEntry(Logger::log_lev sev, QString msg);
+
+		/** Message severity */
+		Logger::log_lev sev;
+		/** When the message was logged */
+		time_t when;
+		/** Message text */
+		QString msg;
+
+	public:
+		/** Operator new overload */
+		void * operator new(size_t obj_size)
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_LOG); }
+		/** Operator delete overload */
+		void operator delete(void *ptr)
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_LOG); }
+};
+
 }; /* end koalamud namespace */
 
 /* Extract Logger class into main namespace for convienence. */
@@ -15,6 +15,7 @@
 
 #include <qapplication.h>
 #include <qstatusbar.h>
+#include <qmap.h>
 
 #include <getopt.h>
 #include <unistd.h>
@@ -30,6 +31,8 @@
 #include "cmdtree.hxx"
 #include "language.hxx"
 #include "room.hxx"
+#include "worldsnap.hxx"
+#include "playersave.hxx"
 
 namespace koalamud {
 
@@ -39,11 +42,18 @@ namespace koalamud {
  */
 MainServer::MainServer( int argc, char **argv ) throw(koalaexception)
 	: _executor(NULL), _guiactive(false), _background(false),
-		_profile("default"), shutdown(false)
+		_profile("default"), shutdown(false), _reactor(NULL), _ioexecutor(NULL)
 {
 	/* Initialize our task pool executor */
 	_executor = new ZThread::PoolExecutor<ZThread::FastMutex>(threadpoolmin, threadpoolmax);
 
+	/* Socket reactor has to exist before the first socket is created */
+	if ((_reactor = Reactor::create()) == NULL)
+	{
+		cerr << "FATAL:  Unable to create socket reactor!" << endl;
+		throw koalaexception();
+	}
+
 	/* Call to process arguments here */
 	parseargs(argc, argv);
 
@@ -70,8 +80,29 @@ MainServer::MainServer( int argc, char **argv ) throw(koalaexception)
 		return;
 	}
 
-	Language::loadLanguages();
-	Room::loadWorldRooms();
+	_kmdb->startWorkers(_kmdb->getDBThreadCount(_profile));
+	Logger::instance()->startFlusher();
+
+	ZoneManager::instance()->configure(_kmdb->getZonePaging(_profile),
+					_kmdb->getZoneTTL(_profile), _kmdb->getZoneMemory(_profile));
+	if (ZoneManager::instance()->isPaging())
+	{
+		/* Rooms come in a zone at a time as they are needed */
+		Logger::msg("Zone paging enabled", Logger::LOG_NOTICE);
+		Room::initializeMaps();
+		RoomExit::initializeMaps();
+		Language::loadLanguages();
+		return;
+	}
+
+	/* Rebuild the world from the snapshot if it is current, otherwise go to
+	 * the database.  run() writes a fresh snapshot in that case. */
+	WorldSnapshot::instance()->setFile(_kmdb->getWorldSnapshotFile(_profile));
+	if (!WorldSnapshot::instance()->load())
+	{
+		Language::loadLanguages();
+		Room::loadWorldRooms();
+	}
 }
 
 /** Start everything running
@@ -85,98 +116,120 @@ void MainServer::run(void)
 
 	Logger::msg("Starting listeners", Logger::LOG_NOTICE);
 
-	/* Start listeners from database */
-	{
-		QValueList<int> portlist = _kmdb->getListenPorts(_profile);
-		QValueList<int>::iterator cur;
-		for (cur = portlist.begin(); cur != portlist.end(); ++cur)
-		{
-			new koalamud::Listener(*cur);
-		}
-	}
+	startListeners();
+	PlayerSaver::instance()->start();
+	PoolAllocator::instance()->start();
+
+	if (ZoneManager::instance()->isPaging())
+		ZoneManager::instance()->start();
+	else if (!WorldSnapshot::instance()->isCurrent())
+		WorldSnapshot::instance()->regenerate();
 
 	/* Update status bar */
 	if (_guiactive) {
      _statwin->statusBar()->message("online");
    }
 
-	/* Main game loop.  Process Qt events and do our own socket handling for all
-	 * descriptors except the MySQL stuff */
+	/* Main game loop.  Process Qt events and let the reactor do our own socket
+	 * handling for all descriptors except the MySQL stuff.  Sockets register
+	 * themselves with the reactor when they are created, so there is no
+	 * per-pass descriptor list to build.
+	 *
+	 * The reactor blocks until there is a socket event, a timer comes due or
+	 * another thread wakes us.  Without the GUI nothing else needs the loop,
+	 * so we sleep for as long as it takes.  With the GUI up we come back
+	 * every guipollinterval to service X events. */
+	while (!shutdown)
+	{
+		int maxwait = _guiactive ? guipollinterval : -1;
+		if (_app->hasPendingEvents())
+			maxwait = 0;
+
+		if (_reactor->poll(maxwait) < 0)
+			break;
+
+		/* Process Qt Events - only when there is something to process */
+		if (_guiactive || _app->hasPendingEvents())
+			_app->processEvents();
+	}
+
+	/* Write out unsaved players while the database is still up.  The workers
+	 * go first so a batch they still hold can't land on top of newer values
+	 * written here. */
+	_kmdb->stopWorkers();
+	PlayerSaver::instance()->shutdown();
+}
+
+/** Start listeners from database
+ * With no I/O threads configured, the listeners are serviced by the main
+ * loop.  Otherwise each I/O thread gets a reactor and its own listener on
+ * every port.
+ */
+void MainServer::startListeners(void)
+{
+	QValueList<int> portlist = _kmdb->getListenPorts(_profile);
+	QValueList<int>::iterator cur;
+	unsigned int iothreads = _kmdb->getIOThreadCount(_profile);
+
+	QMap<int, int> backlogs;
+	for (cur = portlist.begin(); cur != portlist.end(); ++cur)
 	{
-		fd_set insockets, outsockets, errsockets;
-		struct timeval waitcycle;
-		int descriptorcount = 0;
-		int maxfd = 0;
-		QPtrListIterator<Socket> desc(socklist);
-		int selectreturn;
-		while (!shutdown)
+		backlogs[*cur] = _kmdb->getListenBacklog(_profile, *cur,
+																						 Listener::defaultbacklog);
+	}
+
+	if (iothreads == 0)
+	{
+		for (cur = portlist.begin(); cur != portlist.end(); ++cur)
 		{
-			maxfd = descriptorcount = 0;
-			FD_ZERO(&insockets);
-			FD_ZERO(&outsockets);
-			FD_ZERO(&errsockets);
-
-			/* Loop through the descriptor list and add sockets to approprate lists
-			 */
-			for (desc.toFirst(); desc.current(); ++desc)
-			{
-				/* Everyone gets added to in and error. */
-				FD_SET((*desc)->getSock(), &errsockets);
-				FD_SET((*desc)->getSock(), &insockets);
-
-				if ((*desc)->isDataPending())
-				{
-					FD_SET((*desc)->getSock(), &outsockets);
-				}
-
-				descriptorcount++;
-				if (maxfd < (*desc)->getSock())
-					maxfd = (*desc)->getSock();
-			}
-
-			/* Setup wait timer struct */
-			waitcycle.tv_sec = 0;
-			waitcycle.tv_usec = 50; /* 50 microseconds per loop */
-
-			if ((selectreturn = select(maxfd+1, &insockets, &outsockets,
-																 &errsockets, &waitcycle)) < 0)
-			{
-				if (errno == EINTR)
-				{
-					continue;
-				}
-				return;
-			}
-
-			/* Find activated descriptors */
-			if (selectreturn > 0)
-			{
-				for (desc.toFirst(); desc.current(); ++desc)
-				{
-					/* Check write */
-					if (FD_ISSET((*desc)->getSock(), &outsockets))
-					{
-						(*desc)->doWrite();
-					}
-					
-					/* Check read */
-					if (FD_ISSET((*desc)->getSock(), &insockets))
-					{
-						(*desc)->dispatchRead();
-					}
-
-					/* Check error */
-					if (FD_ISSET((*desc)->getSock(), &errsockets))
-					{
-						/* Close any sockets in error */
-						delete (*desc);
-					}
-				}
-			}
-
-			/* Process Qt Events */
-			_app->processEvents(50);
+			listeners.append(new koalamud::Listener(*cur, Listener::GAMESERVER,
+					NULL, backlogs[*cur]));
 		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < iothreads; i++)
+	{
+		Reactor *reactor = Reactor::create();
+		if (reactor == NULL)
+		{
+			Logger::msg("Unable to create reactor for I/O thread",
+									Logger::LOG_CRITICAL);
+			break;
+		}
+		ioreactors.append(reactor);
+
+		for (cur = portlist.begin(); cur != portlist.end(); ++cur)
+		{
+			listeners.append(new koalamud::Listener(*cur, Listener::GAMESERVER,
+					reactor, backlogs[*cur]));
+		}
+	}
+
+	_ioexecutor = new ZThread::PoolExecutor<ZThread::FastMutex>(
+									ioreactors.count(), ioreactors.count());
+	QPtrListIterator<Reactor> reactor(ioreactors);
+	for (; *reactor; ++reactor)
+	{
+		_ioexecutor->execute(new IOThread(*reactor));
+	}
+
+	QString str;
+	QTextOStream os(&str);
+	os << "Started " << ioreactors.count() << " network I/O threads";
+	Logger::msg(str, Logger::LOG_NOTICE);
+}
+
+/** Flag the server for shutdown and wake the main loop and I/O threads */
+void MainServer::Shutdown(void)
+{
+	shutdown = true;
+	_reactor->wakeup();
+
+	QPtrListIterator<Reactor> reactor(ioreactors);
+	for (; *reactor; ++reactor)
+	{
+		(*reactor)->wakeup();
 	}
 }
 
@@ -186,9 +239,26 @@ MainServer::~MainServer(void)
 	if (_executor) {
 		_executor->cancel();
 	}
+	/* The I/O threads use the reactors, the database and srv itself, so they
+	 * have to be gone before any of that is torn down */
+	if (_ioexecutor) {
+		Shutdown();
+		_ioexecutor->cancel();
+		_ioexecutor->wait();
+		delete _ioexecutor;
+		_ioexecutor = NULL;
+	}
+
+	/* Listeners unregister from their reactors, so they go first */
+	listeners.setAutoDelete(true);
+	listeners.clear();
+	ioreactors.setAutoDelete(true);
+	ioreactors.clear();
 
+	Logger::instance()->stopFlusher();
 	delete _kmdb;
 	delete _app;
+	delete _reactor;
 }
 
 /** Parse command line arguments */
@@ -21,6 +21,7 @@
 #include "memory.hxx"
 #include "database.hxx"
 #include "exception.hxx"
+#include "reactor.hxx"
 
 namespace koalamud {
 	/* Predeclare socket */
@@ -39,6 +40,10 @@ class MainServer
 		static const unsigned int threadpoolmin = 1;
 		/** Maximum number of threads to create for ZThread threadpool. */
 		static const unsigned int threadpoolmax = 2;
+		/** Longest the main loop sleeps when the GUI is up, in milliseconds.
+		 * X events don't go through the reactor, so we have to look for them
+		 * on our own. */
+		static const int guipollinterval = 50;
 
 	protected: /* internal data */
 		/** Pointer to database management */
@@ -57,8 +62,14 @@ class MainServer
 		QString _profile;
 		/** Shutdown Flag - true if we are shutting down */
 		bool shutdown;
-		/** Socket list */
-		QPtrList<Socket> socklist;
+		/** Socket event reactor for the main thread */
+		Reactor *_reactor;
+		/** Reactors owned by the network I/O threads */
+		QPtrList<Reactor> ioreactors;
+		/** Executor running the network I/O threads */
+		ZThread::Executor *_ioexecutor;
+		/** Listeners opened by startListeners, on any reactor */
+		QPtrList<Listener> listeners;
 
 	public: /* Base system execution functions */
 		MainServer(int argc, char **argv) throw(koalaexception);
@@ -79,15 +90,16 @@ class MainServer
 		KoalaStatus *statwin(void) { return _statwin; }
 		/** Return true if we are detached from the console */
 		bool isdetached(void) { return _background; }
-		void Shutdown(void) { shutdown = true; }
-		/** Add a socket to the socket list */
-		void addSocktoList(Socket *sock) { socklist.append(sock);}
-		/** Remove a socket from the socket list */
-		void removeSockfromList(Socket *sock) { socklist.remove(sock);}
+		/** Return a pointer to our socket reactor */
+		Reactor *reactor(void) { return _reactor; }
+		void Shutdown(void);
+		/** Return true once shutdown has been requested */
+		bool isShuttingDown(void) const { return shutdown; }
 		
 	protected: /* Internal utility functions */
 		void parseargs(int argc, char **argv) throw (koalaexception);
 		void daemonize(void) throw (koalamud::exceptions::daemonize);
+		void startListeners(void);
 
 	public: /* public utility functions */
 		QString versionstring(void);
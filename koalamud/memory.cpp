@@ -16,407 +16,764 @@
 
 #define KOALA_MEMORY_CXX "%A%"
 
-#include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <qfile.h>
+#include <qmap.h>
 #include <zthread/Guard.h>
 #include "memory.hxx"
+#include "main.hxx"
+#include "logging.hxx"
 
 namespace koalamud {
 
+const unsigned int PoolAllocator::classsizes[PoolAllocator::sizeclasses] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096
+};
+
+const char *PoolAllocator::tagnames[MEMTAG_COUNT] = {
+	"other", "room", "exit", "world", "char", "descriptor", "buffer", "parser",
+	"command", "olc", "playerdata", "skill", "database", "log"
+};
+
+__thread PoolAllocator::T_Magazine
+	PoolAllocator::magazines[PoolAllocator::sizeclasses];
+__thread bool PoolAllocator::magazinesregistered = false;
+__thread long PoolAllocator::samplecountdown = 0;
+__thread unsigned int PoolAllocator::samplerand = 0;
+
 /** Pool Allocator Constructor
  *
- * This constructor sets up all of the internal state for the pool allocation
- * engine and allocates a block of memory for the tracking/stats overhead and
- * first usage block.
+ * This constructor sets up the pool for every size class and the table
+ * mapping request sizes to them.  No memory is taken for blocks until the
+ * first allocation from a pool.
  *
  * @warning This function should *only* be called in a single threaded
  * environment.  Usage while multiple threads are excuting and have access to
  * it can lead to an unknown state and cause catastrophic failure.
  */
 PoolAllocator::PoolAllocator(void)
+	: unmapped(0), largecount(0), largebytes(0), largeallocs(0),
+		lastdump(Reactor::now())
 {
-	/* Lock the allocator while we set it up. */
-	ZThread::Guard<ZThread::FastRecursiveMutex> guard(syslock);
+	memset(tags, 0, sizeof(tags));
+	memset(samples, 0, sizeof(samples));
 
-	/* Because the allocation engine is not yet setup, we have to be very
-	 * careful in what member functions we use.  Most of them rely on having all
-	 * of the tracking overhead already setup. */
+	/* backtrace() loads libgcc the first time it is called, get that out of
+	 * the way before anyone is sampled */
+	void *prime[1];
+	backtrace(prime, 1);
 
-	unsigned int counter = 0;
-	unsigned int statsoverhead = sizeof(T_StatsInfo) * maxblocksize;
-	unsigned int poolalloc = poolallocsize;
-
-	/* Figure out how big of a pool we need to accomidate the stats overhead */
-	while (poolalloc < (statsoverhead + (5 * sizeof(T_PoolInfo))))
+	for (unsigned int i = 0; i < sizeclasses; i++)
 	{
-		poolalloc += poolallocsize;
+		T_PoolInfo *pool = &pools[i];
+		pool->poolsize = classsizes[i];
+		pool->freelisthead = NULL;
+		pool->blockcount = 0;
+		pool->freeblocks = 0;
+		pool->slabs = NULL;
+		pool->slabcount = 0;
+		pool->idle = NULL;
+		pool->idlecount = 0;
+		pool->reclaimed = 0;
+		pool->remotefree = NULL;
+		pool->outblocks = 0;
+		pool->allocationcount = 0;
+
+		/* Bigger blocks get smaller magazines so a thread doesn't sit on more
+		 * than magazinebytes of one pool */
+		pool->magazinecap = magazinebytes / pool->poolsize;
+		if (pool->magazinecap > magazinesize)
+			pool->magazinecap = magazinesize;
+		if (pool->magazinecap < 2)
+			pool->magazinecap = 2;
 	}
 
-	/* Create the pool and do some initialization */
-	poollist = (T_PoolInfo *)malloc(poolalloc);
-	if (poollist == NULL)
+	/* Map each request size to the smallest class that fits it */
+	unsigned int cls = 0;
+	for (unsigned int i = 0; i <= maxblocksize / classalign; i++)
 	{
-		cout << "FATAL: PoolAllocator unable to allocate first memory pool!"
-			<< endl;
-		exit(-1);
+		while (classsizes[cls] < i * classalign)
+			cls++;
+		classindex[i] = cls;
 	}
-	/* Initialize the entire pool to 0's to save some time */
-	bzero(poollist, poolalloc);
-	/* Do basic pool initialization */
-	poollist->poolsize = sizeof(T_PoolInfo);
-	poollist->lock = new ZThread::FastRecursiveMutex;
-
-	/* Set our stats pointers */
-	stats = (T_StatsInfo *)(((unsigned)poollist)+sizeof(T_PoolInfo));
-
-	/* Set the appropriate pointer in stats array */
-	poolstat(poollist->poolsize)->pool = poollist;
-
-	/* Calculate the number of blocks we can fit in the remaining memory */
-	counter = (unsigned int)floor((poolalloc - statsoverhead)/
-									(poollist->poolsize + sizeof(T_PoolInfo *)));
-
-	/* Setup pool freelist head and walk through the allocated memory to stamp
-	 * our tracking records. */
-	poollist->freelisthead = (T_allocblock*)((unsigned)stats + statsoverhead);
-	poollist->blockcount +=stamppool(poollist, poollist->freelisthead, counter);
-	poollist->freeblocks = poollist->blockcount;
+
+	/* Threads hand their magazines back when they exit */
+	pthread_key_create(&magazinekey, threadexit);
 }
 
-/** Prepare a new pool block for usage
+/** Map memory aligned to slabsize
+ * Maps slabsize more than was asked for and trims the ends off so that what
+ * is left starts on a slabsize boundary.
  *
- * This function sets up T_allocblock structures throughout the block of
- * memory to prepare it for usage by the allocation engine.
+ * @param length Bytes wanted, a multiple of the page size
+ * @return Start of the mapping, zero filled, or NULL if it couldn't be had
+ */
+void *PoolAllocator::mapslab(size_t length)
+{
+	size_t maplen = length + slabsize;
+	char *mem = (char *)mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+													 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == (char *)MAP_FAILED)
+		return NULL;
+
+	char *start = (char *)(((uintptr_t)mem + slabsize - 1) &
+												 ~(uintptr_t)(slabsize - 1));
+	char *end = start + length;
+	if (start > mem)
+		munmap(mem, start - mem);
+	if (end < mem + maplen)
+		munmap(end, mem + maplen - end);
+
+	return start;
+}
+
+/** Allocate a block bigger than maxblocksize
+ * The block gets a mapping of its own with a slab header in front of it.
  *
- * @param pool Memory pool the block belongs to
- * @param start Location to start stamping from
- * @param count Number of blocks to mark
- * @param list The last block we stamp will have its next pointer set to list
+ * @param size Size of memory block to allocate
+ * @return Pointer to allocated block, aligned to classalign
+ */
+void *PoolAllocator::ialloclarge(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t length = (slabheader() + size + page - 1) & ~(page - 1);
+
+	if (length < size)
+	{
+		cerr << "SEVERE:  Attempt to allocate " << size << " bytes" << endl;
+		return NULL;
+	}
+
+	T_SlabInfo *slab = (T_SlabInfo *)mapslab(length);
+	if (slab == NULL)
+	{
+		cerr << "SEVERE:  Unable to map " << length << " bytes for a large block"
+				 << endl;
+		return NULL;
+	}
+	slab->pool = NULL;
+	slab->length = length;
+
+	__atomic_add_fetch(&largecount, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&largebytes, length, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&largeallocs, 1, __ATOMIC_RELAXED);
+
+	return (void *)((char *)slab + slabheader());
+}
+
+/** Unmap a block allocated by ialloclarge() */
+void PoolAllocator::ifreelarge(T_SlabInfo *slab)
+{
+	__atomic_sub_fetch(&largecount, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&largebytes, slab->length, __ATOMIC_RELAXED);
+	munmap(slab, slab->length);
+}
+
+/** Add a slab to a pool
+ * Reuses one of the pool's idle slabs if it has any, otherwise maps a new
+ * one.  Stamps next pointers through its blocks and links them onto the
+ * front of the pool's free list.
  *
- * @return Number of blocks stamped
+ * @param pool Pool to grow
+ * @return Number of new blocks, 0 if no memory could be had
  *
- * @warning It is the calling functions responsibility to calculate the number
- * of blocks that can be stamped.  Stamppool has no way to know if its
- * activities will write outside of allocated memory, thus it relies on an
- * accurate count to prevent going to far.
+ * @note The pool lock must be held by the caller
  */
-unsigned int PoolAllocator::stamppool(T_PoolInfo *pool, T_allocblock* start, 
-																			unsigned int count,
-																			T_allocblock *list=NULL)
+unsigned int PoolAllocator::newslab(T_PoolInfo *pool)
 {
-	unsigned int step = pool->poolsize + sizeof(T_PoolInfo *);
-	T_allocblock *cur = start;
-	for (unsigned int i=1; i < count; i++)
+	T_SlabInfo *slab = pool->idle;
+	if (slab != NULL)
+	{
+		pool->idle = slab->next;
+		pool->idlecount--;
+	} else if ((slab = (T_SlabInfo *)mapslab(slabsize)) == NULL) {
+		cerr << "SEVERE: Unable to map slab for pool " << pool->poolsize << endl;
+		return 0;
+	}
+
+	unsigned int count = (slabsize - slabheader()) / pool->poolsize;
+	T_allocblock *first = (T_allocblock *)((char *)slab + slabheader());
+
+	/* Stamp the free list through the slab */
+	T_allocblock *cur = first;
+	for (unsigned int i = 1; i < count; i++)
 	{
-		cur->pool = pool;
-		cur->next = (T_allocblock *)((unsigned)cur + step);
+		cur->next = (T_allocblock *)((char *)cur + pool->poolsize);
 		cur = cur->next;
 	}
-	cur->pool = pool;
-	cur->next = list;
+	cur->next = pool->freelisthead;
+	pool->freelisthead = first;
+
+	slab->pool = pool;
+	slab->blockcount = count;
+	slab->freecount = 0;
+	slab->idlesince = 0;
+	slab->sampled = 0;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->slabcount++;
+
+	pool->blockcount += count;
+	__atomic_add_fetch(&pool->freeblocks, count, __ATOMIC_RELAXED);
+
 	return count;
 }
 
-/** Create a new allocation pool
- *
- * This function will create a new memory allocation pool with the specified
- * block size.  It does verify that the pool size has not been defined after
- * locking the system lock to prevent race conditions.
+/** Allocate a block of memory for the given size.
+ * Take a block from this thread's magazine for the size class, refilling the
+ * magazine from the pool if it is empty.
  *
- * @param blocksize  Size of blocks in this pool
+ * @param size Size of memory block to allocate
+ * @param tag Subsystem to account the block to
+ * @return Pointer to allocated block, aligned to classalign
  */
-void PoolAllocator::createpool(unsigned int blocksize)
+void *PoolAllocator::ialloc(size_t size, memtag_t tag = MEMTAG_OTHER)
 {
-	if (blocksize > maxblocksize)
+	/* Big blocks get a mapping of their own */
+	if (size > maxblocksize)
 	{
-		cout << "Maximum block size is: " << maxblocksize << endl 
-			   << "Attempt to create pool with block size: " << blocksize << endl;
-		return;
+		void *ptr = ialloclarge(size);
+		if (ptr != NULL)
+		{
+			tagalloc(tag, slabof(ptr)->length);
+			samplecheck(ptr, slabof(ptr)->length);
+		}
+		return ptr;
 	}
 
-	syslock.acquire();
-	if (poolstat(blocksize)->pool != NULL)
+	unsigned int cls = classindex[(size + classalign - 1) / classalign];
+	T_PoolInfo *pool = &pools[cls];
+	T_Magazine *mag = &magazines[cls];
+
+	if (mag->head == NULL && refill(pool, mag) == 0)
 	{
-		cout << "Pool with block size " << blocksize << " currently exists." 
-				 << endl;
-		syslock.release();
-		return;
+		cerr << "SEVERE:  Pool " << pool->poolsize
+				 << " is empty and unable to extend!" << endl;
+		return NULL;
 	}
-	T_PoolInfo *newpool;
 
-	unsigned int blockcount = 0;
-	unsigned int poolalloc = poolallocsize;
-	
-	/* FIXME:  We may want to allocate a bigger chunk of memory for bigger
-	 * blocks */
+	T_allocblock *block = mag->head;
+	mag->head = block->next;
+	mag->count--;
+	mag->allocs++;
+	tagalloc(tag, pool->poolsize);
+	samplecheck(block, pool->poolsize);
+
+	return (void *)block;
+}
 
-	/* Create the pool and do some initialization */
-	newpool = (T_PoolInfo *)malloc(poolalloc);
-	if (poollist == NULL)
+/** Free an allocated block
+ * Release the memory held by ptr back to the pool that owns the slab it
+ * lives in, or unmap it if it is a large block.
+ *
+ * The block goes in this thread's magazine for the pool.  A full magazine
+ * passes half of its blocks on to the pool's remote free list.
+ *
+ * @param ptr Pointer to allocated block.
+ * @param tag Subsystem the block was allocated for
+ */
+void PoolAllocator::ifree(void *ptr, memtag_t tag = MEMTAG_OTHER)
+{
+	if (ptr == NULL)
+		return;
+
+	T_SlabInfo *slab = slabof(ptr);
+	if (__atomic_load_n(&slab->sampled, __ATOMIC_RELAXED) != 0)
+		unsample(ptr);
+
+	if (slab->pool == NULL)
 	{
-		cerr << "SEVERE: Pool allocation engine unable ot allocate new pool " <<
-			blocksize << endl;
-		syslock.release();
+		tagfree(tag, slab->length);
+		ifreelarge(slab);
 		return;
 	}
-	/* Initialize the entire pool to 0's to save some time */
-	bzero(newpool, poolalloc);
-	/* Do basic pool initialization */
-	newpool->poolsize = blocksize;
-	newpool->lock = new ZThread::FastRecursiveMutex;
-	newpool->pnext = poollist;
-	poollist = newpool;
-
-	newpool->lock->acquire();
-
-	/* Set the appropriate pointer in stats array */
-	poolstat(blocksize)->pool = newpool;
-	syslock.release();
-
-	/* Calculate the number of blocks we can fit in the remaining memory */
-	blockcount = (unsigned int)floor((poolalloc - sizeof(T_PoolInfo))/
-									(newpool->poolsize + sizeof(T_PoolInfo *)));
-
-	/* Setup pool freelist head and walk through the allocated memory to stamp
-	 * our tracking records. */
-	newpool->freelisthead=(T_allocblock*)((unsigned)newpool + sizeof(T_PoolInfo));
-	newpool->blockcount +=stamppool(newpool, newpool->freelisthead, blockcount);
-	newpool->freeblocks = newpool->blockcount;
-
-	/* release lock and we're done */
-	newpool->lock->release();
+
+	T_allocblock *block = (T_allocblock *)ptr;
+	T_PoolInfo *pool = slab->pool;
+	tagfree(tag, pool->poolsize);
+
+	if (!magazinesregistered)
+		registermagazines();
+
+	T_Magazine *mag = &magazines[pool - pools];
+	block->next = mag->head;
+	mag->head = block;
+	mag->count++;
+
+	if (mag->count > pool->magazinecap)
+	{
+		/* Keep the newest half, they are the most likely to still be cached */
+		unsigned int keep = pool->magazinecap / 2;
+		T_allocblock *tail = mag->head;
+		for (unsigned int i = 1; i < keep; i++)
+			tail = tail->next;
+
+		T_allocblock *spill = tail->next;
+		unsigned int count = mag->count - keep;
+		tail->next = NULL;
+		mag->count = keep;
+
+		for (tail = spill; tail->next != NULL; tail = tail->next)
+			;
+		__atomic_sub_fetch(&pool->outblocks, count, __ATOMIC_RELAXED);
+		pushremote(pool, spill, tail, count);
+	}
 }
 
-/** Expand an existing memory pool
- * This function will expand the specified memory pool to provide room for a
- * minimum of the specified number of objects.  We don't allocate less then
- * our pool allocation size, but we may need to allocate multiple blocks to
- * fit the objects into.
- *
- * @param poolsize Pool that we need to expand.  This must be an existing
- * 									pool.
- * @param newcount number of new objects to make room for - default 1
- *
- * @return Number of new blocks allocated, may be different from newcount.  0
- * means no action was taken.
+/** Refill an empty magazine from its pool
+ * Half a magazine of blocks is moved in one trip to the pool lock.  Blocks
+ * waiting on the remote free list are spliced back into the pool first.  The
+ * magazine's allocation count is folded into the pool's while we're there.
  *
- * @note The available block count for the pool will be updated by this
- * function.  Do *NOT* update this separately.
- *
- * @note This function will not create new pools, only expand existing ones.
- * It also may not allocate blocks of exactly poolsize bytes.  If 'poolsize'
- * is using a pool for a larger blocksize, the larger block size will be used
- * in all calculations.
+ * @param pool Pool the magazine belongs to
+ * @param mag This thread's magazine for the pool
+ * @return Number of blocks moved, 0 if the pool couldn't be extended
  */
-unsigned int PoolAllocator::expandpool(unsigned int poolsize,
-																			 unsigned int newcount = 1)
+unsigned int PoolAllocator::refill(T_PoolInfo *pool, T_Magazine *mag)
 {
-	/* First things first, does a pool exist for the given size */
-	T_PoolInfo *pool;
+	if (!magazinesregistered)
+		registermagazines();
+
+	unsigned int want = pool->magazinecap / 2;
+	unsigned int count = 0;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(pool->lock);
 
-	if ((pool = poolstat(poolsize)->pool) == NULL)
+	__atomic_add_fetch(&pool->allocationcount, mag->allocs, __ATOMIC_RELAXED);
+	mag->allocs = 0;
+
+	T_allocblock *remote = __atomic_exchange_n(&pool->remotefree, NULL,
+																						 __ATOMIC_ACQUIRE);
+	if (remote != NULL)
 	{
-		cout << "Attempt to expand nonexisting pool size " << poolsize << endl;
-		return 0;
+		T_allocblock *tail = remote;
+		while (tail->next != NULL)
+			tail = tail->next;
+		tail->next = pool->freelisthead;
+		pool->freelisthead = remote;
 	}
 
-	/* Lock the pool from other modification */
-	pool->lock->acquire();
+	if (pool->freelisthead == NULL && newslab(pool) == 0)
+		return 0;
 
-	/* There is an existing pool and we have a pointer to it.  Now we need to
-	 * figure out how much memory we need to allocate. */
-	unsigned int poolalloc = poolallocsize;
-	while (poolalloc < (pool->poolsize * newcount))
+	while (count < want && pool->freelisthead != NULL)
 	{
-		poolalloc += poolallocsize;
+		T_allocblock *block = pool->freelisthead;
+		pool->freelisthead = block->next;
+		block->next = mag->head;
+		mag->head = block;
+		count++;
 	}
+	mag->count += count;
 
-	/* Allocate memory */
-	T_allocblock *newchunk;
-	if ((newchunk = (T_allocblock*)malloc(poolalloc)) == NULL)
+	__atomic_sub_fetch(&pool->freeblocks, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->outblocks, count, __ATOMIC_RELAXED);
+
+	return count;
+}
+
+/** Make sure this thread's magazines come back if the thread goes away */
+void PoolAllocator::registermagazines(void)
+{
+	pthread_setspecific(magazinekey, this);
+	magazinesregistered = true;
+}
+
+/** Push a chain of free blocks on a pool's remote free list
+ * Lock free, so any thread can hand blocks back at any time.
+ *
+ * @param pool Pool the blocks belong to
+ * @param head First block of the chain
+ * @param tail Last block of the chain, its next pointer is overwritten
+ * @param count Number of blocks in the chain
+ */
+void PoolAllocator::pushremote(T_PoolInfo *pool, T_allocblock *head,
+															 T_allocblock *tail, unsigned int count)
+{
+	T_allocblock *top = __atomic_load_n(&pool->remotefree, __ATOMIC_RELAXED);
+	do {
+		tail->next = top;
+	} while (!__atomic_compare_exchange_n(&pool->remotefree, &top, head, true,
+																				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_add_fetch(&pool->freeblocks, count, __ATOMIC_RELAXED);
+}
+
+/** Hand every block in this thread's magazines back to their pools */
+void PoolAllocator::drainmagazines(void)
+{
+	for (unsigned int i = 0; i < sizeclasses; i++)
 	{
-		cout << "SEVERE: Unable to allocate " << poolalloc << " bytes for pool "
-				 << pool->poolsize << endl << endl;
-		pool->lock->release();
-		return 0;
+		T_PoolInfo *pool = &pools[i];
+		T_Magazine *mag = &magazines[i];
+
+		__atomic_add_fetch(&pool->allocationcount, mag->allocs, __ATOMIC_RELAXED);
+		mag->allocs = 0;
+
+		if (mag->head == NULL)
+			continue;
+
+		T_allocblock *tail = mag->head;
+		while (tail->next != NULL)
+			tail = tail->next;
+		__atomic_sub_fetch(&pool->outblocks, mag->count, __ATOMIC_RELAXED);
+		pushremote(pool, mag->head, tail, mag->count);
+		mag->head = NULL;
+		mag->count = 0;
 	}
+	magazinesregistered = false;
+}
+
+/** Thread exit hook for magazinekey */
+void PoolAllocator::threadexit(void *arg)
+{
+	((PoolAllocator *)arg)->drainmagazines();
+}
 
-	/* Calculate actual block count */
-	unsigned int blockcount = (unsigned int)floor(poolalloc/
-								(pool->poolsize+sizeof(T_PoolInfo *)));
-	/* Stamp out the block */
-	unsigned int newblocks;
-	newblocks = stamppool(pool,newchunk,blockcount,pool->freelisthead);
-	pool->blockcount += newblocks;
-	pool->freeblocks += newblocks;
+/** Start the reclaim and tag dump timers on the main reactor */
+void PoolAllocator::start(void)
+{
+	srv->reactor()->addTimer(&reclaimer, reclaiminterval, true);
+	srv->reactor()->addTimer(&tagdumper, tagdumpinterval, true);
+}
 
-	/* Link the new block in */
-	pool->freelisthead = newchunk;
+/** Give slabs that have been free for slabcooldown back to the system */
+void PoolAllocator::reclaim(void)
+{
+	unsigned long long now = Reactor::now();
 
-	/* Release our lock */
-	pool->lock->release();
+	for (unsigned int i = 0; i < sizeclasses; i++)
+		reclaimpool(&pools[i], now);
+}
 
-	return blockcount;
+/** Return true if reclaim() should take a slab out of its pool
+ * The slab must have been completely free for slabcooldown. */
+bool PoolAllocator::slabexpired(const T_SlabInfo *slab, unsigned long long now)
+{
+	return slab->freecount == slab->blockcount && slab->idlesince != 0 &&
+				 now - slab->idlesince >= slabcooldown;
 }
 
-/** Allocate a block of memory for the given size.
- * Pickup the first free block for the given size and return a pointer to the
- * beginning of the block.  Link to an existing pool or create a new pool as
- * needed to fulfill the request.  Extend a pool that is out of free blocks if
- * needed.
+/** Take a pool's expired slabs out of it
+ * Counts the free blocks in each slab, starts the cooldown of slabs that
+ * have just become completely free and takes out the ones whose cooldown
+ * has run out.  Up to idleslabs of them are kept for reuse with their pages
+ * given back, the rest are unmapped.
  *
- * @param size Size of memory block to allocate
- * @return Pointer to allocated block
+ * @param pool Pool to reclaim from
+ * @param now Reactor::now()
+ * @return Number of slabs taken out
  */
-void *PoolAllocator::ialloc(size_t size)
+unsigned int PoolAllocator::reclaimpool(T_PoolInfo *pool, unsigned long long now)
 {
-	/* Make sure we aren't allocating too big of a block */
-	if (size > maxblocksize)
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(pool->lock);
+
+	if (pool->slabs == NULL)
+		return 0;
+
+	/* Blocks on the remote list count as free too */
+	T_allocblock *remote = __atomic_exchange_n(&pool->remotefree, NULL,
+																						 __ATOMIC_ACQUIRE);
+	if (remote != NULL)
 	{
-		cerr << "SEVERE:  Attempt to allocate block larger then maxblocksize"
-				 << endl;
-		return NULL;
+		T_allocblock *tail = remote;
+		while (tail->next != NULL)
+			tail = tail->next;
+		tail->next = pool->freelisthead;
+		pool->freelisthead = remote;
 	}
 
-	/* This will be the block we allocate */
-	T_allocblock *block;
-	/* Pool we will allocate from */
-	T_PoolInfo *pool;
-	/* Pointer to the stats info */
-	T_StatsInfo *ppoolstat;
+	T_SlabInfo *slab;
+	for (slab = pool->slabs; slab != NULL; slab = slab->next)
+		slab->freecount = 0;
+	for (T_allocblock *block = pool->freelisthead; block; block = block->next)
+		slabof(block)->freecount++;
 
-	/* Attempt to get a pointer to the pool stats */
-	ppoolstat = poolstat(size);
+	unsigned int expired = 0;
+	for (slab = pool->slabs; slab != NULL; slab = slab->next)
+	{
+		if (slab->freecount < slab->blockcount)
+			slab->idlesince = 0;
+		else if (slab->idlesince == 0)
+			slab->idlesince = now;
+		else if (slabexpired(slab, now))
+			expired++;
+	}
+	if (expired == 0)
+		return 0;
 
-	/* Check to see if the pool exists for this block size.  Create/link to a
-	 * pool if it doesn't */
-	if (ppoolstat->pool == NULL)
+	/* Take the expired slabs' blocks off the free list */
+	T_allocblock **link = &pool->freelisthead;
+	while (*link != NULL)
 	{
-		pool = getpoolfor(size);
-		if (pool == NULL)
-		{
-			cerr << "SEVERE:  Unable to get pool for block size " << size << endl;
-			return NULL;
-		}
-	} else {
-		pool = ppoolstat->pool;
+		if (slabexpired(slabof(*link), now))
+			*link = (*link)->next;
+		else
+			link = &(*link)->next;
 	}
 
-	/* If we get to here, then we have valid pool and ppoolstat pointers.  Next
-	 * we need to check for free blocks in the pool. */
-	pool->lock->acquire();
-	if (pool->freelisthead == NULL)
+	/* And the slabs out of the pool */
+	size_t page = sysconf(_SC_PAGESIZE);
+	T_SlabInfo **slink = &pool->slabs;
+	while ((slab = *slink) != NULL)
 	{
-		/* Expand the pool */
-		if (expandpool(size) == 0)
+		if (!slabexpired(slab, now))
+		{
+			slink = &slab->next;
+			continue;
+		}
+		*slink = slab->next;
+
+		pool->slabcount--;
+		pool->blockcount -= slab->blockcount;
+		__atomic_sub_fetch(&pool->freeblocks, slab->blockcount, __ATOMIC_RELAXED);
+
+		if (pool->idlecount < idleslabs)
 		{
-			pool->lock->release();
-			cerr << "SEVERE:  Pool " << size << " is empty and unable to extend!"
-					 << endl;
-			return NULL;
+			/* Keep the header page, give back the rest */
+			madvise((char *)slab + page, slabsize - page, MADV_DONTNEED);
+			slab->next = pool->idle;
+			pool->idle = slab;
+			pool->idlecount++;
+		} else {
+			munmap(slab, slabsize);
+			__atomic_add_fetch(&unmapped, 1, __ATOMIC_RELAXED);
 		}
 	}
-	
-	/* We pointers are available.  Attach block and update counters. */
-	block = pool->freelisthead;
-	pool->freelisthead = block->next;
-	pool->freeblocks--;
-	ppoolstat->allocationcount++;
+	pool->reclaimed += expired;
 
-	/* Unlock pool */
-	pool->lock->release();
+	return expired;
+}
+
+/** Allocations per second for a tag since the last dumptags() */
+unsigned long PoolAllocator::tagrate(memtag_t tag, unsigned long long now)
+{
+	if (now <= lastdump)
+		return 0;
 
-	/* Return a pointer to the allocated memory */
-	return (void *)((unsigned int)block + sizeof(T_PoolInfo *));
+	unsigned long allocs = __atomic_load_n(&tags[tag].allocs, __ATOMIC_RELAXED);
+	return (allocs - tags[tag].lastallocs) * 1000 / (now - lastdump);
 }
 
-/** Free an allocated block
- * Release the memory held by ptr back to the free pool for the pool attached
- * to the block.  Every block allocated by our system has a pointer to the
- * source pool positioned just before the block allocation.
- *
- * @param ptr Pointer to allocated block.
- */
-void PoolAllocator::ifree(void *ptr)
+/** Pool memory per room
+ * Room, exit and world bytes over the number of live rooms. */
+long PoolAllocator::bytesperroom(void)
 {
-	/* Get a pointer to the real beginning of the allocblock */
-	T_allocblock *block=(T_allocblock*)((unsigned int)ptr -sizeof(T_PoolInfo*));
-	/* Lock the pool */
-	block->pool->lock->acquire();
-	/* Link the freed block into the list */
-	block->next = block->pool->freelisthead;
-	block->pool->freelisthead = block;
-	block->pool->freeblocks += 1;
-	/* Release the lock - all done */
-	block->pool->lock->release();
+	long rooms = tags[MEMTAG_ROOM].livecount;
+	if (rooms <= 0)
+		return 0;
+
+	return (tags[MEMTAG_ROOM].livebytes + tags[MEMTAG_EXIT].livebytes +
+					tags[MEMTAG_WORLD].livebytes) / rooms;
 }
 
-/** Get a pool for a specified block size
- * Return a pointer to a pool for a specific block size.  Create the pool or
- * link to an existing pool if the specified size doesn't already exist.
- *
- * @param poolsize Block Size requested
- * @return Pointer to a pool for the specified block size
- *
- * @note We have to grab the system lock in the process of doing this.
- * Failure to do so can corrupt the entire allocation system or result in
- * significant memory leaks.
- */
-PoolAllocator::T_PoolInfo* PoolAllocator::getpoolfor(unsigned int poolsize)
+/** Pool memory per connection
+ * Descriptor, buffer, parser, char and player data bytes over the number of
+ * live descriptors. */
+long PoolAllocator::bytesperconnection(void)
 {
-	T_PoolInfo *pool = NULL;
+	long conns = tags[MEMTAG_DESCRIPTOR].livecount;
+	if (conns <= 0)
+		return 0;
+
+	return (tags[MEMTAG_DESCRIPTOR].livebytes + tags[MEMTAG_BUFFER].livebytes +
+					tags[MEMTAG_PARSER].livebytes + tags[MEMTAG_CHAR].livebytes +
+					tags[MEMTAG_PLAYERDATA].livebytes) / conns;
+}
 
-	if (poolsize > maxblocksize)
+/** Log a one line tag breakdown and start a new rate interval */
+void PoolAllocator::dumptags(void)
+{
+	unsigned long long now = Reactor::now();
+	QString str;
+	QTextOStream os(&str);
+
+	os << "Memory:";
+	for (unsigned int i = 0; i < MEMTAG_COUNT; i++)
 	{
-		return NULL;
+		if (tags[i].allocs == 0)
+			continue;
+		os << " " << tagnames[i] << "=" << tags[i].livebytes << "/"
+			 << tags[i].livecount << "@" << tagrate((memtag_t)i, now) << "/s";
 	}
+	os << " room=" << bytesperroom() << "B"
+		 << " connection=" << bytesperconnection() << "B";
+	Logger::msg(str, Logger::LOG_INFO);
 
-	syslock.acquire();
-	if (poolstat(poolsize)->pool != NULL)
+	for (unsigned int i = 0; i < MEMTAG_COUNT; i++)
+		tags[i].lastallocs = __atomic_load_n(&tags[i].allocs, __ATOMIC_RELAXED);
+	lastdump = now;
+}
+
+/** Write the tag breakdown to @a os */
+void PoolAllocator::tagreport(QTextStream &os)
+{
+	unsigned long long now = Reactor::now();
+
+	os << "Memory by subsystem: " << endl;
+	os << "Tag\t\t| Live Blocks\t| Live Bytes\t| Allocations\t| Allocs/sec"
+		 << endl;
+	for (unsigned int i = 0; i < MEMTAG_COUNT; i++)
 	{
-		syslock.release();
-		return (poolstat(poolsize)->pool);
+		if (tags[i].allocs == 0)
+			continue;
+		os << tagnames[i] << (strlen(tagnames[i]) < 8 ? "\t\t| " : "\t| ")
+			 << tags[i].livecount << "\t\t| "
+			 << tags[i].livebytes << "\t\t| "
+			 << tags[i].allocs << "\t\t| "
+			 << tagrate((memtag_t)i, now) << endl;
 	}
+	os << endl;
+	os << "Bytes per room: " << bytesperroom() << " over "
+		 << tags[MEMTAG_ROOM].livecount << " rooms" << endl;
+	os << "Bytes per connection: " << bytesperconnection() << " over "
+		 << tags[MEMTAG_DESCRIPTOR].livecount << " connections" << endl;
+	os << "Only pool blocks are counted, not the strings and containers the "
+		 << "objects own." << endl;
+}
 
-	/* Define a search range and check for an existing pool that fits */
-	unsigned int searchhigh = poolsize + (poolsize/4) + 1;
-	if (searchhigh > poolsize + maxblockoverhead)
-		searchhigh = poolsize + maxblockoverhead;
+/** Pick the number of bytes until this thread's next sample
+ * Exponentially distributed with a mean of sampleinterval, so every byte
+ * allocated is equally likely to be sampled.
+ */
+long PoolAllocator::nextsample(void)
+{
+	/* xorshift32 */
+	samplerand ^= samplerand << 13;
+	samplerand ^= samplerand >> 17;
+	samplerand ^= samplerand << 5;
+
+	/* Uniform in (0, 1] */
+	double u = ((samplerand >> 8) + 1.0) / 16777216.0;
+	return (long)(-log(u) * sampleinterval) + 1;
+}
 
-	if (searchhigh > maxblocksize)
-		searchhigh = maxblocksize;
-	
-	/* Search through the pool stats list for the first existing pool.  If we
-	 * find one, link to it. */
-	for (unsigned int i=poolsize+1; i <= searchhigh; i++)
+/** Record a heap profile sample for a block that has just been allocated
+ * @param ptr Block to sample
+ * @param bytes Bytes the block takes up
+ */
+void PoolAllocator::sample(void *ptr, size_t bytes)
+{
+	/* A thread's first allocation only starts its countdown */
+	if (samplerand == 0)
 	{
-		if (poolstat(i)->pool != NULL)
+		samplerand = (unsigned int)(uintptr_t)&samplecountdown ^
+								 (unsigned int)Reactor::now();
+		if (samplerand == 0)
+			samplerand = 1;
+		samplecountdown = nextsample();
+		return;
+	}
+	samplecountdown = nextsample();
+
+	T_Sample *s = (T_Sample *)::malloc(sizeof(T_Sample));
+	if (s == NULL)
+		return;
+	s->ptr = ptr;
+	s->bytes = bytes;
+	s->depth = backtrace(s->stack, sampledepth);
+
+	__atomic_add_fetch(&slabof(ptr)->sampled, 1, __ATOMIC_RELAXED);
+
+	unsigned int bucket = samplebucket(ptr);
+	ZThread::Guard<ZThread::FastRecursiveMutex>
+		guard(samplelock[bucket % samplelocks]);
+	s->next = samples[bucket];
+	samples[bucket] = s;
+}
+
+/** Drop the sample for a block that is being freed, if it has one */
+void PoolAllocator::unsample(void *ptr)
+{
+	unsigned int bucket = samplebucket(ptr);
+	T_Sample *found = NULL;
+
+	{
+		ZThread::Guard<ZThread::FastRecursiveMutex>
+			guard(samplelock[bucket % samplelocks]);
+		for (T_Sample **link = &samples[bucket]; *link; link = &(*link)->next)
 		{
-			pool = poolstat(i)->pool;
-			poolstat(poolsize)->pool = pool;
+			if ((*link)->ptr == ptr)
+			{
+				found = *link;
+				*link = found->next;
+				break;
+			}
 		}
 	}
 
-	/* If we didn't find an existing pool in our search, make our requested
-	 * poolsize even and create a pool.
-	 * FIXME:  We may eventually want to do some additional magic here to make
-	 * pools overlap a bit more. */
-	if (pool == NULL)
+	if (found != NULL)
+	{
+		__atomic_sub_fetch(&slabof(ptr)->sampled, 1, __ATOMIC_RELAXED);
+		::free(found);
+	}
+}
+
+/** Write the live heap profile samples to a file
+ * Samples with the same call stack are merged.  The file is in the heap_v2
+ * text format, followed by this process's mappings so pprof can find the
+ * symbols.
+ *
+ * @param filename File to write, replaced if it exists
+ * @return true if the file was written
+ */
+bool PoolAllocator::heapprofile(QString filename)
+{
+	QMap<QString, unsigned long> counts;
+	QMap<QString, unsigned long> bytes;
+	unsigned long totalcount = 0;
+	unsigned long totalbytes = 0;
+
+	for (unsigned int b = 0; b < samplebuckets; b++)
 	{
-		unsigned int poolblock = poolsize;
-		/* Adjust to even */
-		if ((poolblock % 2) != 0)
+		ZThread::Guard<ZThread::FastRecursiveMutex>
+			guard(samplelock[b % samplelocks]);
+		for (T_Sample *s = samples[b]; s != NULL; s = s->next)
 		{
-			poolblock += 1;
+			QString stack;
+			for (int i = 0; i < s->depth; i++)
+				stack += " 0x" + QString::number((unsigned long)s->stack[i], 16);
+
+			counts[stack]++;
+			bytes[stack] += s->bytes;
+			totalcount++;
+			totalbytes += s->bytes;
 		}
-		createpool(poolblock);
-		pool = poolstat(poolblock)->pool;
-		poolstat(poolsize)->pool = pool;
 	}
 
-	syslock.release();
-	return pool;
+	QFile file(filename);
+	if (!file.open(IO_WriteOnly | IO_Truncate))
+		return false;
+
+	QTextStream os(&file);
+	os << "heap profile: " << totalcount << ": " << totalbytes << " ["
+		 << totalcount << ": " << totalbytes << "] @ heap_v2/" << sampleinterval
+		 << endl;
+
+	QMap<QString, unsigned long>::Iterator it;
+	for (it = counts.begin(); it != counts.end(); ++it)
+	{
+		os << it.data() << ": " << bytes[it.key()] << " ["
+			 << it.data() << ": " << bytes[it.key()] << "] @" << it.key() << endl;
+	}
+
+	os << endl << "MAPPED_LIBRARIES:" << endl;
+	QFile maps("/proc/self/maps");
+	if (maps.open(IO_ReadOnly))
+	{
+		QTextStream ms(&maps);
+		while (!ms.atEnd())
+			os << ms.readLine() << endl;
+	}
+
+	return file.status() == IO_Ok;
 }
 
 /** Write all of the pool information to the specified ostream */
@@ -431,49 +788,59 @@ ostream& operator<<(ostream& os, const PoolAllocator& pa)
 	return os;
 }
 
-/** Write all of the pool information to the specified ostream */
+/** Write all of the pool information to the specified ostream
+ * Allocation counts lag a little, threads fold theirs in when they refill.
+ */
 QTextStream& operator<<(QTextStream& os, const PoolAllocator& pa)
 {
 	unsigned int poolcount = 0;
 	unsigned int totblocks = 0;
 	unsigned int freeblocks = 0;
+	unsigned int outblocks = 0;
 	unsigned long allocamt = 0;
 	unsigned long freeamt = 0;
+	unsigned long usedamt = 0;
 	os << "Pool Allocator Status Report: " << endl;
-	os << "BlockSize\t| Free Blocks\t| Total Blocks\t| Total Allocations"
-		 << endl;
-	for (unsigned int i = 0; i < PoolAllocator::maxblocksize; i++)
+	os << "BlockSize\t| Free Blocks\t| Out\t\t| Total Blocks\t| Slabs\t| "
+		 << "Idle\t| Reclaimed\t| Total Allocations" << endl;
+	for (unsigned int i = 0; i < PoolAllocator::sizeclasses; i++)
 	{
-		if (pa.stats[i].pool != NULL)
-		{
-			os << i + 1 << "\t\t| ";
-			if (pa.stats[i].pool->poolsize != (i+1))
-			{
-				os << "shared with poolsize " << pa.stats[i].pool->poolsize << "\t| ";
-			} else {
-				os << pa.stats[i].pool->freeblocks << "\t\t| "
-				   << pa.stats[i].pool->blockcount << "\t\t| ";
-				poolcount++;
-				allocamt += pa.stats[i].pool->blockcount * (pa.stats[i].pool->poolsize
-											+ sizeof(PoolAllocator::T_PoolInfo *));
-				freeamt += pa.stats[i].pool->freeblocks * (pa.stats[i].pool->poolsize
-											+ sizeof(PoolAllocator::T_PoolInfo *));
-				totblocks += pa.stats[i].pool->blockcount;
-				freeblocks += pa.stats[i].pool->freeblocks;
-			}
-			os << pa.stats[i].allocationcount << endl;
-		}
+		const PoolAllocator::T_PoolInfo *pool = &pa.pools[i];
+		if (pool->slabcount == 0 && pool->idlecount == 0)
+			continue;
+
+		os << pool->poolsize << "\t\t| "
+			 << pool->freeblocks << "\t\t| "
+			 << pool->outblocks << "\t\t| "
+			 << pool->blockcount << "\t\t| "
+			 << pool->slabcount << "\t| "
+			 << pool->idlecount << "\t| "
+			 << pool->reclaimed << "\t\t| "
+			 << pool->allocationcount << endl;
+
+		poolcount++;
+		allocamt += (unsigned long)pool->slabcount * PoolAllocator::slabsize;
+		freeamt += (unsigned long)pool->freeblocks * pool->poolsize;
+		usedamt += (unsigned long)pool->blockcount * pool->poolsize;
+		totblocks += pool->blockcount;
+		freeblocks += pool->freeblocks;
+		outblocks += pool->outblocks;
 	}
-	unsigned int overhead = sizeof(PoolAllocator::T_StatsInfo) *
-													PoolAllocator::maxblocksize;
-	overhead += sizeof(PoolAllocator::T_PoolInfo) * poolcount;
-	allocamt += overhead;
+	unsigned long overhead = allocamt - usedamt;
 	os << endl << "Summary: " << endl;
 	os << "Total Memory Allocated: " << allocamt << " - Overhead: " 
 		 << overhead << " - Free Memory: "
 		 << freeamt << endl;
 	os << totblocks << " Blocks allocated in " << poolcount << " pools with "
-	   << freeblocks << " blocks free." << endl;
+	   << freeblocks << " blocks free in the pools and " << outblocks
+		 << " out (in use or held by thread magazines)." << endl;
+	os << "Large blocks: " << pa.largecount << " mapped, " << pa.largebytes
+		 << " bytes - Total Allocations: " << pa.largeallocs << endl;
+	os << endl << "Reclaim policy: every " << PoolAllocator::reclaiminterval / 1000
+		 << "s, slabs free for " << PoolAllocator::slabcooldown / 1000
+		 << "s are taken out of their pool.  Each pool keeps up to "
+		 << PoolAllocator::idleslabs << " of them madvised for reuse, the rest "
+		 << "are unmapped (" << pa.unmapped << " so far)." << endl;
 
 	return os;
 }
@@ -17,12 +17,36 @@
 #define KOALA_MEMORY_HXX "%A%"
 
 #include <iostream>
+#include <pthread.h>
+#include <stdint.h>
 #include <zthread/FastRecursiveMutex.h>
+#include <zthread/Runnable.h>
 
 #include <qtextstream.h>
 
 namespace koalamud {
 
+/** Subsystems that pool allocations are accounted to
+ * Classes pass their tag to PoolAllocator::alloc and free from their
+ * operator new and delete overloads. */
+typedef enum {
+	MEMTAG_OTHER = 0, /**< Untagged */
+	MEMTAG_ROOM, /**< Rooms */
+	MEMTAG_EXIT, /**< Room exits */
+	MEMTAG_WORLD, /**< Room grid chunks and resident zones */
+	MEMTAG_CHAR, /**< Characters */
+	MEMTAG_DESCRIPTOR, /**< Network connections */
+	MEMTAG_BUFFER, /**< Output buffers and their segments */
+	MEMTAG_PARSER, /**< Input parsers */
+	MEMTAG_COMMAND, /**< Commands, command trees and permissions */
+	MEMTAG_OLC, /**< OLC fields */
+	MEMTAG_PLAYERDATA, /**< Pending saves and prefetched players */
+	MEMTAG_SKILL, /**< Skills and languages */
+	MEMTAG_DATABASE, /**< Database requests */
+	MEMTAG_LOG, /**< Log entries */
+	MEMTAG_COUNT /**< Number of tags */
+} memtag_t;
+
 /**  Memory Pool Allocator
  *
  * @author Matthew Schlegel <nitehawk@koalamud.org>
@@ -31,73 +55,102 @@ namespace koalamud {
  * operators.  Provides low overhead allocation/deallocation by allocating
  * large chunks of memory for fixed size class groups.
  *
- * This implementation manages multiple memory pools with varying sizes.  Pool
- * selection is based on requested block size so that objects of the same size
- * will share a single pool.  There is a small amount of overhead required for
- * each pool managed in order to provide locking around pointer updates and
- * the memory overhead to track free blocks in each pool.  We use the memory
- * we allocate for the pool for most of the tracking, but we do allocate a
- * chunk of memory separately to track the first free node of each pool.
+ * Requests are rounded up to one of sizeclasses fixed block sizes, all of
+ * them multiples of classalign, and each size class has its own pool.  A
+ * pool is a list of slabs.  A slab is slabsize bytes of memory aligned to
+ * slabsize, with a small T_SlabInfo header at the start and the blocks
+ * after it, so the slab (and from it the pool) that owns any block is found
+ * by masking the low bits off the block's address.  Blocks carry no header
+ * of their own and are aligned to classalign bytes.
  *
- * Both alloc's and free's need to lock the affected pool before updating
- * pointers.  Failure to lock pools before updating could have a devistating
- * effect in KoalaMud's multithreaded environment.
+ * Slabs are mapped on demand when a pool runs out of free blocks.  The slab
+ * is walked to stamp next pointers through its blocks and the chain is
+ * linked onto the pool's free list.
  *
- * New pools are allocated on demand based upon the following criteria:
- * a) There is no existing pool with large enough blocks
- * b) There are pools with big enough blocks, but the overhead in using those
- * blocks is greater then 25%
+ * Slabs are given back by reclaim(), which runs every reclaiminterval once
+ * start() has been called.  It counts the free blocks in each slab of each
+ * pool, and a slab whose blocks have all been on the pool's free list for
+ * slabcooldown is taken out of the pool.  The pool keeps up to idleslabs of
+ * those with everything but their first page given back to the system with
+ * madvise(MADV_DONTNEED), ready to be reused before a new slab is mapped;
+ * the rest are unmapped.  Blocks in thread magazines or on the remote free
+ * list count as in use, so a slab is only taken out while nothing can touch
+ * it.
  *
- * Block sizes for automatically allocated objects may be adjusted slightly to
- * make a better fit into the memory that will be allocated for it.  There
- * will most likely be blocksizes that can't be adjusted without significant
- * overhead.  Those block sizes will most certainly leave extra room in the
- * pool that we will attempt to fill with blocks from a smaller pool.
+ * Every allocation is also accounted to a memtag_t, so memory can be broken
+ * down by subsystem.  Each tag keeps atomic counts of its live blocks, the
+ * bytes they take up (whole blocks, or whole mappings for large blocks) and
+ * its total allocations.  Once start() has been called the breakdown is
+ * logged every tagdumpinterval, and allocation rates are worked out over the
+ * time since the last dump.
  *
- * There is a bit of overhead involved in allocating a new pool or starting a
- * block size on an exiting pool, but that overhead is only required on the
- * first allocation of a block size or when the block needs to be expanded.
- * These large block allocations include malloc'ing the block of memory for
- * the calculated block size, and walking through the block to stamp next
- * pointers through it.  For new pools, it is also necessary to create the
- * mutex controlling access to a block.  When adding a new allocation size to
- * an existing pool (120 byte allocations would use the same pool as 128 byte
- * allocations typically), the pool structure will have a pointer to the real
- * pool structure and a counter.
+ * A sampling heap profiler is always running.  Each thread counts down the
+ * bytes it allocates from a random, exponentially distributed interval
+ * averaging sampleinterval, and the block that takes the count past zero
+ * has its call stack recorded in a hash table keyed by the block's address.
+ * ifree() drops the record, so the table holds a statistical picture of
+ * what is live.  Slab headers count their sampled blocks, and frees from
+ * slabs without any only pay for reading that count.  heapprofile() writes
+ * the table out in the heap_v2 text format that pprof reads.
  *
- * The allocator also keeps an allocation counter for each block size so that
- * we can see how memory is being used.  This information is also used to
- * manually force specific pool sizes for heavily used object sizes.  There
- * is also a counter that tracks the largest number of blocks available for a
- * given memory size.
+ * Anything bigger than maxblocksize gets a mapping of its own, aligned to
+ * slabsize like a slab, with a T_SlabInfo header that has no pool.  ifree()
+ * tells the two apart by that header and unmaps large blocks straight away.
  *
- * @note  We automatically allocate a pool of 20 byte blocks during
- * construction.  We use the beginning of this block to put all of our
- * tracking overhead in.
+ * The allocator also keeps an allocation counter for each size class so
+ * that we can see how memory is being used.
  *
+ * Each thread keeps a magazine of free blocks for each pool.  Allocations
+ * and frees are served from the magazine without taking any lock.  An empty
+ * magazine is refilled with half a magazine of blocks in one trip to the
+ * pool lock, and a full one hands half of its blocks back as a single chain
+ * on the pool's remote free list with a compare and swap; the next refill
+ * splices that list back into the pool under the lock.  ifree() never waits
+ * on a lock.
  */
 class PoolAllocator
 {
 	/* Constants */
 	public:
-		/** This is used to limit the byte amount of overhead in larger blocks.
-		 * It may need to be adjusted if we end up with sparse usage of bigger
-		 * pools.
-		 * @note This value has a dramatic effect on the time required to allocate
-		 * the first block for a given block size.  pool overlap searches are
-		 * bound to this value as a maximum, so high values here will cause longer
-		 * times in search loops for block linking. */
-		static const unsigned int maxblockoverhead = 128;
 		/** We need an upper limit to the block sizes we manage so that we don't
 		 * kill ourselves in overhead. */
 		static const unsigned int maxblocksize = 4096; 
-		/** With a 4 byte minimum block size, we are at 100% overhead with the
-		 * pool pointer.  We likely won't see any pools this size, but we do need
-		 * a lower limit. */
-		static const unsigned int minblocksize = 4;
-		/** Size of pools we allocate.  For larger block sizes, we may allocate
-		 * a multiple of this size to reduce the allocation overhead impact */
-		static const unsigned int poolallocsize = 65536;
+		/** Every size class is a multiple of this, so every block is aligned to
+		 * it */
+		static const unsigned int classalign = 16;
+		/** Number of size classes */
+		static const unsigned int sizeclasses = 28;
+		/** Size of the slabs pools are built from.  Must be a power of two,
+		 * slabs are aligned to it. */
+		static const unsigned int slabsize = 65536;
+		/** Most blocks a thread keeps in one magazine */
+		static const unsigned int magazinesize = 64;
+		/** Most bytes a thread keeps in one magazine.  Limits the magazines of
+		 * the bigger size classes. */
+		static const unsigned int magazinebytes = 32768;
+		/** Milliseconds between reclaim() runs */
+		static const unsigned int reclaiminterval = 10000;
+		/** Milliseconds a slab must stay completely free before it is taken
+		 * out of its pool */
+		static const unsigned int slabcooldown = 30000;
+		/** Free slabs each pool keeps (madvised) for reuse, the rest are
+		 * unmapped */
+		static const unsigned int idleslabs = 2;
+		/** Milliseconds between logged tag breakdowns */
+		static const unsigned int tagdumpinterval = 60000;
+		/** Average bytes allocated between heap profile samples */
+		static const unsigned int sampleinterval = 524288;
+		/** Deepest call stack kept for a sample */
+		static const unsigned int sampledepth = 32;
+		/** Buckets in the sample table */
+		static const unsigned int samplebuckets = 4096;
+		/** Locks striped over the sample table's buckets */
+		static const unsigned int samplelocks = 16;
+
+		/** Block size of each size class */
+		static const unsigned int classsizes[sizeclasses];
+		/** Display name of each tag */
+		static const char *tagnames[MEMTAG_COUNT];
 	
 	/* All of our tracking variables are private in case we later need to
 	 * subclass our allocator */
@@ -105,26 +158,38 @@ class PoolAllocator
 		/* predefine the pool info struct */
 		struct TAG_PoolInfo;
 
-		/** Allocation block
-		 * This structure is written throughout the allocated block to make
-		 * allocating the smaller chunks and tracking them easy.
+		/** Free block
+		 * Free blocks are linked through their first bytes.
 		 */
 		typedef struct TAG_allocblock {
-			/** Pointer to the pool this block is a part of - used to free */
-			struct TAG_PoolInfo *pool;
 			/** Pointer to next free block */
 			struct TAG_allocblock *next;
 		} T_allocblock;
+
+		/** Slab header
+		 * Sits at the start of every slab, ahead of the first block, and at the
+		 * start of every large block's mapping.
+		 */
+		typedef struct TAG_SlabInfo {
+			/** Pool the slab's blocks belong to, NULL for a large block */
+			struct TAG_PoolInfo *pool;
+			/** Next slab in the pool */
+			struct TAG_SlabInfo *next;
+			/** Number of blocks in the slab */
+			unsigned int blockcount;
+			/** Free blocks counted by the last reclaim() */
+			unsigned int freecount;
+			/** Reactor::now() when the slab was first seen completely free, 0
+			 * while it has blocks in use */
+			unsigned long long idlesince;
+			/** Bytes mapped, for large blocks */
+			size_t length;
+			/** Blocks with a heap profile sample.  Updated atomically. */
+			unsigned int sampled;
+		} T_SlabInfo;
+
 		/** Pool information structure
-		 * This struct tracks all of the information for a single pool
-		 * 		free list pointer
-		 * 		locking mutex pointer
-		 * 		total allocated blocks
-		 * 		Total free blocks
-		 * 		next pool (so we can traverse existing pools easily)
-		 * Everything except the mutex itself lives inside of our blocks.  The
-		 * pool information structures consume the first 24 bytes of the first
-		 * block allocated for a pool.
+		 * This struct tracks all of the information for a single size class.
 		 */
 		typedef struct TAG_PoolInfo {
 			/** Size of blocks in this pool */
@@ -133,64 +198,206 @@ class PoolAllocator
 			T_allocblock* freelisthead;
 			/** Total number of blocks allocated */
 			unsigned int blockcount;
-			/** Total number of free blocks in this pool */
+			/** Total number of free blocks in this pool, including the remote
+			 * free list.  Updated atomically. */
 			unsigned int freeblocks;
-			/** Pointer to next pool */
-			struct TAG_PoolInfo *pnext;
-			/** Pointer to lock for pool */
-			ZThread::FastRecursiveMutex *lock;
+			/** Slabs making up the pool */
+			T_SlabInfo *slabs;
+			/** Number of slabs */
+			unsigned int slabcount;
+			/** Slabs taken out of the pool and kept for reuse */
+			T_SlabInfo *idle;
+			/** Number of idle slabs */
+			unsigned int idlecount;
+			/** Slabs reclaim() has taken out of the pool */
+			unsigned int reclaimed;
+			/** Lock for the free list and slab list */
+			ZThread::FastRecursiveMutex lock;
+			/** Blocks freed without the lock, pushed with compare and swap */
+			T_allocblock* remotefree;
+			/** Blocks out of the pool: in use, or free in a thread magazine.
+			 * Magazine allocations and frees don't touch it, so it can't tell the
+			 * two apart.  Updated atomically. */
+			unsigned int outblocks;
+			/** Most blocks a thread keeps in its magazine for this pool */
+			unsigned int magazinecap;
+			/** Total allocations from this pool.  Updated atomically. */
+			unsigned int allocationcount;
 		} T_PoolInfo;
 
-		/** This structure is used for tracking the statistics of the allocation
-		 * engine as well as the location of pools */
-		typedef struct TAG_StatsInfo {
-			/** Pool this block size uses.  pool->poolsize may not equal block size
-			 */
-			T_PoolInfo *pool;
-			/** Total allocations for this block size */
-			unsigned int allocationcount;
-		} T_StatsInfo;
+		/** Accounting for one tag, on a cache line of its own */
+		typedef struct TAG_MemTag {
+			/** Bytes in live blocks.  Updated atomically. */
+			long livebytes;
+			/** Live blocks.  Updated atomically. */
+			long livecount;
+			/** Total allocations.  Updated atomically. */
+			unsigned long allocs;
+			/** allocs at the last dumptags() */
+			unsigned long lastallocs;
+		} __attribute__((aligned(64))) T_MemTag;
+
+		/** Heap profile sample for one live block */
+		typedef struct TAG_Sample {
+			/** Sampled block */
+			void *ptr;
+			/** Bytes the block takes up */
+			size_t bytes;
+			/** Frames in stack */
+			int depth;
+			/** Return addresses, innermost first */
+			void *stack[sampledepth];
+			/** Next sample in the bucket */
+			struct TAG_Sample *next;
+		} T_Sample;
+
+		/** Per thread stack of free blocks for one pool */
+		typedef struct TAG_Magazine {
+			/** First block in the magazine */
+			T_allocblock* head;
+			/** Number of blocks in the magazine */
+			unsigned int count;
+			/** Allocations not yet added to the pool's count */
+			unsigned int allocs;
+		} T_Magazine;
+
+		/** One pool per size class */
+		T_PoolInfo pools[sizeclasses];
+		/** Size class for each request size, indexed by size in classalign
+		 * units rounded up */
+		unsigned char classindex[maxblocksize / classalign + 1];
 
-		/** Pool List head */
-		T_PoolInfo *poollist;
-		/** Pointer to array of stats info - bounds are 0 - maxblocksize-1 */
-		T_StatsInfo *stats;
+		/** Key whose destructor hands back an exiting thread's magazines */
+		pthread_key_t magazinekey;
 
-		/** This lock is needed for creating new pools to prevent poollist and
-		 * stats corruption */
-		ZThread::FastRecursiveMutex syslock;
+		/** Timer task that runs reclaim() */
+		class ReclaimTask : public ZThread::Runnable
+		{
+			public:
+				/** Empty virtual destructor */
+				virtual ~ReclaimTask(void) {}
+				/** Give back free slabs */
+				virtual void run(void) { PoolAllocator::instance()->reclaim(); }
+		};
+
+		/** Reclaim timer task */
+		ReclaimTask reclaimer;
+
+		/** Timer task that runs dumptags() */
+		class TagDumpTask : public ZThread::Runnable
+		{
+			public:
+				/** Empty virtual destructor */
+				virtual ~TagDumpTask(void) {}
+				/** Log the tag breakdown */
+				virtual void run(void) { PoolAllocator::instance()->dumptags(); }
+		};
+
+		/** Tag dump timer task */
+		TagDumpTask tagdumper;
+		/** Accounting for each tag */
+		T_MemTag tags[MEMTAG_COUNT];
+		/** Reactor::now() at the last dumptags() */
+		unsigned long long lastdump;
+
+		/** Heap profile samples, hashed on block address */
+		T_Sample *samples[samplebuckets];
+		/** Lock for every samplelocks'th bucket of samples */
+		ZThread::FastRecursiveMutex samplelock[samplelocks];
+		/** Bytes this thread has left to allocate before its next sample */
+		static __thread long samplecountdown;
+		/** This thread's random number state for sample intervals, 0 until
+		 * the thread's first allocation */
+		static __thread unsigned int samplerand;
+		/** Slabs unmapped by reclaim() since startup */
+		unsigned int unmapped;
+		/** Large blocks currently allocated.  Updated atomically. */
+		unsigned long largecount;
+		/** Bytes mapped for large blocks.  Updated atomically. */
+		unsigned long largebytes;
+		/** Total large block allocations.  Updated atomically. */
+		unsigned long largeallocs;
+
+		/** This thread's magazines, one per pool */
+		static __thread T_Magazine magazines[sizeclasses];
+		/** True once this thread's magazines will be drained on exit */
+		static __thread bool magazinesregistered;
 			
 	protected:
 		PoolAllocator(void);
 
 	public:
+		void *ialloc(size_t size, memtag_t tag = MEMTAG_OTHER);
+		void ifree(void *ptr, memtag_t tag = MEMTAG_OTHER);
 
-		void createpool(unsigned int blocksize);
-		unsigned int expandpool(unsigned int poolsize, unsigned int newcount = 1);
-
-		void *ialloc(size_t size);
-		void ifree(void *ptr);
+		void start(void);
+		void reclaim(void);
+		void dumptags(void);
+		void tagreport(QTextStream &os);
+		long bytesperroom(void);
+		long bytesperconnection(void);
+		bool heapprofile(QString filename);
 
 	protected:
-		unsigned int stamppool(T_PoolInfo *pool, T_allocblock* start,
-														unsigned int count, T_allocblock* list=NULL);
-		/** Get a pointer to that stats structure for a pool size */
-		T_StatsInfo *poolstat(unsigned int poolsize) { return &stats[poolsize-1];}
-		T_PoolInfo *getpoolfor(unsigned int poolsize);
+		static void *mapslab(size_t length);
+		void *ialloclarge(size_t size);
+		void ifreelarge(T_SlabInfo *slab);
+		unsigned int newslab(T_PoolInfo *pool);
+		unsigned int reclaimpool(T_PoolInfo *pool, unsigned long long now);
+		static bool slabexpired(const T_SlabInfo *slab, unsigned long long now);
+		/** Account a new block of @a bytes to @a tag */
+		void tagalloc(memtag_t tag, long bytes)
+			{
+				__atomic_add_fetch(&tags[tag].livebytes, bytes, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&tags[tag].livecount, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&tags[tag].allocs, 1, __ATOMIC_RELAXED);
+			}
+		/** Account a freed block of @a bytes to @a tag */
+		void tagfree(memtag_t tag, long bytes)
+			{
+				__atomic_sub_fetch(&tags[tag].livebytes, bytes, __ATOMIC_RELAXED);
+				__atomic_sub_fetch(&tags[tag].livecount, 1, __ATOMIC_RELAXED);
+			}
+		unsigned long tagrate(memtag_t tag, unsigned long long now);
+		/** Count an allocation of @a bytes towards the next sample */
+		void samplecheck(void *ptr, size_t bytes)
+			{
+				samplecountdown -= bytes;
+				if (samplecountdown < 0)
+					sample(ptr, bytes);
+			}
+		void sample(void *ptr, size_t bytes);
+		void unsample(void *ptr);
+		long nextsample(void);
+		/** Bucket of the sample table for a block */
+		static unsigned int samplebucket(void *ptr)
+			{ return (((uintptr_t)ptr >> 4) * 2654435761U) % samplebuckets; }
+		/** Find the slab a block lives in */
+		static T_SlabInfo *slabof(void *ptr)
+			{ return (T_SlabInfo *)((uintptr_t)ptr & ~(uintptr_t)(slabsize - 1)); }
+		/** Offset of the first block in a slab */
+		static unsigned int slabheader(void)
+			{ return (sizeof(T_SlabInfo) + classalign - 1) & ~(classalign - 1); }
+		unsigned int refill(T_PoolInfo *pool, T_Magazine *mag);
+		void pushremote(T_PoolInfo *pool, T_allocblock *head, T_allocblock *tail,
+										unsigned int count);
+		void registermagazines(void);
+		void drainmagazines(void);
+		static void threadexit(void *arg);
 
 	friend ostream& operator<<(ostream& os, const PoolAllocator& pa);
 	friend QTextStream& operator<<(QTextStream& os, const PoolAllocator& pa);
 
 	public:  /* Singleton support stuff */
 		/** Singleton Based allocate */
-		static void *alloc(size_t size)
+		static void *alloc(size_t size, memtag_t tag = MEMTAG_OTHER)
 			{
-				return instance()->ialloc(size);
+				return instance()->ialloc(size, tag);
 			}
 		/** Singleton based free */
-		static void free(void *ptr)
+		static void free(void *ptr, memtag_t tag = MEMTAG_OTHER)
 			{
-				instance()->ifree(ptr);
+				instance()->ifree(ptr, tag);
 			}
 		/** Get a pointer to the singleton instance */
 		static PoolAllocator *instance(void)
@@ -18,66 +18,70 @@
 #include <qhostaddress.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 #include "main.hxx"
 #include "logging.hxx"
 #include "network.hxx"
+#include "reactor.hxx"
 #include "parser.hxx"
 #include "event.hxx"
 
 namespace koalamud {
 
-/** Initialize a network socket */
-Socket::Socket(int sock = 0)
-	: _sock(sock), _closeme(false)
+/** Initialize a network socket
+ * @param sock Existing socket descriptor, or 0 to create a new TCP socket.
+ * 						 Existing sockets must already be non blocking (Listener
+ * 						 accepts them that way), so they need no extra syscalls here.
+ * @param reactor Reactor to register with.  Defaults to the main server
+ * 								reactor.
+ */
+Socket::Socket(int sock = 0, Reactor *reactor = NULL)
+	: _sock(sock), _closeme(false), _wantwrite(false), _reactor(reactor)
 {
 	/* If there is no socket, create one */
 	if (_sock == 0)
 	{
 		struct protoent *protoentry = NULL;
 		protoentry = getprotobyname("tcp");
-		_sock = socket(AF_INET, SOCK_STREAM, protoentry->p_proto);
-	}
+		_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+									 protoentry->p_proto);
 
-	/* Set socket options */
-	{
 		/* Set Linger */
 		struct linger l;
 		l.l_onoff = 0;
 		l.l_linger = 0;
 		setsockopt(_sock, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
-	}
 
-	{
-		/* Set non blocking */
-		int sockflags;
-		int result;
-		sockflags = fcntl(_sock, F_GETFL, 0);
-		sockflags |= O_NONBLOCK;
-		result = fcntl(_sock, F_SETFL, sockflags);
-	}
-
-	{
 		/* Set reuse addr */
 		int optval = 1;
 		setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 	}
 
-	srv->addSocktoList(this);
+	if (_reactor == NULL)
+		_reactor = srv->reactor();
+	_reactor->addSocket(this);
 }
 
-/** Destroy a network socket - remove it from the list */
+/** Destroy a network socket - remove it from the reactor and close it */
 Socket::~Socket(void)
 {
-	srv->removeSockfromList(this);
+	_reactor->removeSocket(this);
+	close(_sock);
 }
 
 /** Initialize a listener object
-* Setup a port listener and update the gui status
+* Setup a port listener and update the gui status.  Every I/O thread opens
+* its own listener on each port with SO_REUSEPORT and the kernel spreads new
+* connections between them.
+* @param backlog Length of the kernel accept queue.  This needs to be large
+* 							 enough to absorb every client reconnecting after a reboot.
 */
-Listener::Listener(unsigned int port, porttype_t newporttype = GAMESERVER)
-: _type(newporttype), _port(port)
+Listener::Listener(unsigned int port, porttype_t newporttype = GAMESERVER,
+										Reactor *reactor = NULL, int backlog = defaultbacklog)
+: Socket(0, reactor), _type(newporttype), _port(port)
 {
     /* Create a list item if the gui is active */
     if (srv->usegui())
@@ -96,9 +100,15 @@ Listener::Listener(unsigned int port, porttype_t newporttype = GAMESERVER)
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = htons(INADDR_ANY);
 
+	{
+		/* Share the port with the listeners on the other I/O threads */
+		int optval = 1;
+		setsockopt(_sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+	}
+
 	/* Bind away */
 	bind(_sock, (struct sockaddr *)&addr, sizeof(addr));
-	listen(_sock, 5);
+	listen(_sock, backlog);
 
 	/* Log a message */
 	QString str;
@@ -112,7 +122,7 @@ Listener::Listener(unsigned int port, porttype_t newporttype = GAMESERVER)
 			break;
 	}
 
-	os << " started on port #" << port;
+	os << " started on port #" << port << " (backlog " << backlog << ")";
 	Logger::msg(str, Logger::LOG_NOTICE);
 }
 
@@ -129,34 +139,66 @@ Listener::~Listener()
 }
 
 /** Dispatch a read message.
- * In listener case, we accept a connection and call newConnection with it.
+ * In listener case, we accept connections and call newConnection with each
+ * of them.  The reactor only tells us when new connections arrive, so we
+ * keep accepting until the queue is empty.  New sockets come back from
+ * accept4 already non blocking and close on exec.
+ *
+ * At most acceptbudget connections are taken per event so a reconnect storm
+ * on one port can't starve the other sockets on this reactor.  If we stop
+ * early, the listener is re-armed to get another event on the next pass.
  */
 void Listener::dispatchRead(void)
 {
 	struct sockaddr addr;
-	socklen_t slen = sizeof(struct sockaddr);
+	socklen_t slen;
+	int newsock;
+	unsigned int accepted = 0;
 
-	int newsock = accept(_sock, &addr, &slen);
-	newConnection(newsock);
+	while (accepted < acceptbudget)
+	{
+		slen = sizeof(struct sockaddr);
+		if ((newsock = accept4(_sock, &addr, &slen,
+													 SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		newConnection(newsock);
+		++accepted;
+	}
+
+	/* Budget used up - there may be more waiting */
+	_reactor->rearm(this);
 }
 
-/** Handle a newly accepted connection and bring it into the game world */
+/** Handle a newly accepted connection and bring it into the game world
+ * The new descriptor is pinned to our reactor, so it is serviced by the same
+ * I/O thread that accepted it for its whole life.
+ */
 void Listener::newConnection(int socket)
 {
 	ParseDescriptor *desc;
+	PlayerLoginParser *login;
 
 	switch (_type)
 	{
 		case GAMESERVER:
-			desc = new ParseDescriptor(socket);
-			desc->setParser(new PlayerLoginParser(NULL, desc));
+			desc = new ParseDescriptor(socket, NULL, _reactor);
+			login = new PlayerLoginParser(NULL, desc);
+			desc->setParser(login);
+			login->welcome();
 			break;
 	}
 }
 
 /** Construct a Descriptor object */
-Descriptor::Descriptor(int sock)
-	: Socket(sock), sendcolor(false), inBuffer(4096), outBuffer(4096) 
+Descriptor::Descriptor(int sock, Reactor *reactor = NULL)
+	: Socket(sock, reactor), sendcolor(false), readStalled(false),
+		_overflowed(false), _softlimit(defaultsoftlimit),
+		_hardlimit(defaulthardlimit), inBuffer(4096, true),
+		outBuffer(4096)
 {
 	struct sockaddr_in addr;
 	socklen_t len = sizeof(struct sockaddr_in);
@@ -171,31 +213,65 @@ Descriptor::Descriptor(int sock)
 	Logger::msg(str);
 }
 
+/** Read everything the socket has into the input buffer
+ * The reactor is edge triggered, so we read until the kernel has nothing
+ * left for us.  If the input buffer fills first, we note it in readStalled
+ * and leave the rest in the kernel until the buffer drains.
+ * @return false if the connection was closed by the peer or failed
+ */
+bool Descriptor::readInput(void)
+{
+	for (;;)
+	{
+		char *start = inBuffer.getTail();
+		int maxread = inBuffer.getFree();
+		if (maxread == 0)
+		{
+			inBuffer.externDatain(0);
+			readStalled = true;
+			return true;
+		}
+
+		int numread = read(_sock, start, maxread);
+		if (numread < 0)
+		{
+			inBuffer.externDatain(0);
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+		inBuffer.externDatain(numread);
+
+		if (numread == 0)
+			return false;
+	}
+}
+
 /** Dispatch read read events for Descriptors */
 void Descriptor::dispatchRead(void)
 {
-	/* Read data into the buffer from the socket, then pass it over to
-	 * readClient */
-	char *start = inBuffer.getTail();
-	int maxread = inBuffer.getFree();
-	int numread = read(_sock, start, maxread);
-	inBuffer.externDatain(numread);
-
-	if (numread == 0)
-	{
+	if (!readInput())
 		delete this;
-		return;
-	}
 }
 
 /** Dispatch a ParseDescriptor read */
 void ParseDescriptor::dispatchRead(void)
 {
-	Descriptor::dispatchRead();
+	if (!readInput())
+	{
+		delete this;
+		return;
+	}
 	
+	queueInputTask();
+}
+
+/** Start an input task unless one is already running or input is held */
+void ParseDescriptor::queueInputTask(void)
+{
 	/* Lock and check for an existing input task */
 	inputTaskLock.acquire();
-	if (!inputTaskRunning)
+	if (!inputTaskRunning && !inputHeld)
 	{
 		inputTaskRunning = true;
 		srv->executor()->execute(new InputTask(this));
@@ -203,12 +279,36 @@ void ParseDescriptor::dispatchRead(void)
 	inputTaskLock.release();
 }
 
+/** Stop parsing input until resumeInput()
+ * Parsers call this before issuing an asynchronous request (such as a
+ * DBRequest) so the player's later input waits for the result instead of
+ * being parsed out of order.  Input keeps being read into the buffer in the
+ * meantime.
+ */
+void ParseDescriptor::holdInput(void)
+{
+	inputTaskLock.acquire();
+	inputHeld = true;
+	inputTaskLock.release();
+}
+
+/** Resume parsing input held by holdInput() */
+void ParseDescriptor::resumeInput(void)
+{
+	inputTaskLock.acquire();
+	inputHeld = false;
+	if (inBuffer.canReadLine())
+		queueInputTask();
+	inputTaskLock.release();
+}
+
 /** Run an InputTask */
 void ParseDescriptor::InputTask::run(void)
 {
-	char *input;
+	const char *input;
+	int len;
 	_desc->inputTaskLock.acquire();
-	input = _desc->inBuffer.getLine();
+	input = _desc->inputHeld ? NULL : _desc->inBuffer.peekLine(len);
 	if (input == NULL)
 	{
 		_desc->inputTaskRunning = false;
@@ -217,17 +317,28 @@ void ParseDescriptor::InputTask::run(void)
 	}
 	_desc->inputTaskLock.release();
 
+	/* Take the line straight out of the ring, then give the space back */
+	QString line = QString::fromLatin1(input, len);
+	_desc->inBuffer.releaseLine();
+
+	/* We just made room in the input buffer.  If the network side stopped
+	 * reading because the buffer was full, ask the reactor for another go. */
+	if (_desc->readStalled)
+	{
+		_desc->readStalled = false;
+		_desc->reactor()->rearm(_desc);
+	}
+
 	/** Run the attached parser for the line of input */
 	if (_desc->_parse)
 	{
-		_desc->_parse->parseLine(QString(input));
+		_desc->_parse->parseLine(line);
 	}
-	free(input);
 
 	/* Check input buffer for another line of input.  If another line is in the
 	 * buffer, queue another input task. */
 	_desc->inputTaskLock.acquire();
-	if (_desc->inBuffer.canReadLine())
+	if (!_desc->inputHeld && _desc->inBuffer.canReadLine())
 	{
 		srv->executor()->execute(new InputTask(_desc));
 	} else {
@@ -237,178 +348,293 @@ void ParseDescriptor::InputTask::run(void)
 }
 
 /** Handle write events for descriptors
- * Take a chunk of data from the outBuffer and send it on to the socket
- * If the buffer is empty when we are done and we are closing, then close the
- * socket and selfdestruct
+ * Send the outBuffer straight from ring memory, followed by any overflow
+ * segments in outChain, with one sendmsg call per pass.  The mirrored mapping
+ * means the ring is always a single iovec.  Queued data only moves by what
+ * the kernel took, and we keep going until the socket would block; the
+ * reactor tells us when it drains.
+ * If everything is gone when we are done, turn off write notification.  If
+ * we are also closing, then selfdestruct (the socket is closed by ~Socket).
  */
 void Descriptor::doWrite(void)
 {
-	char buf[512];
-	int len = outBuffer.getData(buf, 512);
+	struct iovec iov[maxiov];
+	struct msghdr msg;
 
-	write(_sock, buf, len);
-
-	if (_closeme && outBuffer.isEmpty())
+	for (;;)
 	{
-		close(_sock);
-		delete this;
+		char *start = outBuffer.getHead();
+		unsigned int ringlen = outBuffer.getUsed();
+		int niov = 0;
+		if (ringlen)
+		{
+			iov[0].iov_base = start;
+			iov[0].iov_len = ringlen;
+			niov = 1;
+		}
+		niov += outChain.fillIov(iov + niov, maxiov - niov);
+		if (niov == 0)
+		{
+			/* getHead() left the buffer locked, so a send() can't add data
+			 * between this check and dropping write interest */
+			_reactor->setWriteInterest(this, false);
+			outBuffer.externDataout(0);
+			if (_closeme)
+				delete this;
+			return;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = niov;
+		ssize_t sent = sendmsg(_sock, &msg, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			outBuffer.externDataout(0);
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			/* Connection is gone, nothing more we can send */
+			delete this;
+			return;
+		}
+
+		/* The ring goes out first, so it is drained before the chain is */
+		unsigned int fromring = ((size_t)sent < ringlen) ? sent : ringlen;
+		outChain.consume(sent - fromring);
+		outBuffer.externDataout(fromring);
+
+		/* A short write usually means the socket buffer is full, but keep
+		 * going until the kernel says so.  The socket is edge triggered, so
+		 * we only hear about it again once it has returned EAGAIN. */
 	}
 }
 
 /** Check to see if there is data pending in the output buffer */
 bool Descriptor::isDataPending(void)
 {
-	return !outBuffer.isEmpty();
+	return (getOutputPending() != 0);
 }
 
-/** Send data out to the network
- * This class will replace or strip color codes as needed
+/** Get the number of bytes queued for the client but not yet sent */
+unsigned int Descriptor::getOutputPending(void)
+{
+	outBuffer.lock();
+	unsigned int pending = outBuffer.getUsed() + outChain.getUsed();
+	outBuffer.unlock();
+	return pending;
+}
+
+/** Set the output limits for this descriptor
+ * @param soft Queued bytes above which the client counts as slow
+ * @param hard Queued bytes above which overflowPolicy() decides what happens
  */
-void Descriptor::send(QString data)
+void Descriptor::setOutputLimits(unsigned int soft, unsigned int hard)
 {
-	char *dataout, *outpos;
-	const char *datain = data.latin1();
-	unsigned int count;
-	unsigned int inlen = data.length();
-	unsigned int pos = 0;
-	const char *inpos = datain;
-	/* Check to see if there are any color code markers - | is our marker */
-	if ((count = data.contains("|")))
+	outBuffer.lock();
+	_softlimit = soft;
+	_hardlimit = (hard < soft) ? soft : hard;
+	outBuffer.unlock();
+}
+
+/** Make sure there is room under the hard limit for more output
+ * If @a len more bytes would take us past the hard limit the overflow policy
+ * decides whether to drop the new output or the whole connection.
+ * @return true if the output should be queued
+ * @note The outBuffer lock must be held by the caller
+ */
+bool Descriptor::reserveOutput(unsigned int len)
+{
+	if (_overflowed)
+		return false;
+
+	unsigned int pending = outBuffer.getUsed() + outChain.getUsed();
+	if (pending + len <= _hardlimit)
+		return true;
+
+	if (overflowPolicy(pending) == OVERFLOW_DISCONNECT)
+	{
+		/* Throw away what is queued and let the reactor clean up the
+		 * hangup on its own thread */
+		_overflowed = true;
+		_closeme = true;
+		outChain.clear();
+		::shutdown(_sock, SHUT_RDWR);
+	}
+	return false;
+}
+
+/** Queue output bytes
+ * The ring is filled first; whatever doesn't fit goes on the overflow chain.
+ * Once the chain is in use everything goes there until it drains, so output
+ * stays in order.
+ * @note The outBuffer lock must be held by the caller
+ */
+void Descriptor::appendOutput(const char *data, unsigned int len)
+{
+	if (len == 0)
+		return;
+
+	if (outChain.isEmpty())
 	{
-		outpos = dataout = new char[inlen + count*8];
-		bzero(dataout, inlen + count*8);
+		char *bufpos = outBuffer.getTail();
+		unsigned int ringlen = len;
+		if (ringlen > (unsigned int)outBuffer.getFree())
+			ringlen = outBuffer.getFree();
+		memcpy(bufpos, data, ringlen);
+		outBuffer.externDatain(ringlen);
+		data += ringlen;
+		len -= ringlen;
+	}
 
-		while (pos <= inlen)
+	if (len)
+		outChain.append(data, len);
+}
+
+/** Colour code translation tables
+ * One table for links with colour and one for links without, indexed by the
+ * character following a | marker.  Each entry holds exactly what to send in
+ * place of the two character code.
+ */
+static class ColorTable
+{
+	public:
+		/** Replacement for one colour code */
+		typedef struct {
+			/** Length of seq */
+			unsigned char len;
+			/** Bytes to send.  Not null terminated. */
+			char seq[7];
+		} code_t;
+
+		/** [0] is used without colour, [1] with colour */
+		code_t codes[2][256];
+
+	public:
+		/** Fill in the tables */
+		ColorTable(void)
 		{
-			if (*inpos != '|')
+			/* Anything we don't know is passed through untouched */
+			for (int c = 0; c < 256; c++)
 			{
-				*outpos++ = *inpos++;
-				pos++;
-			} else {
-				inpos++;
-				pos++;
-				if (*inpos == '|')
+				for (int mode = 0; mode < 2; mode++)
 				{
-					*outpos++ = '|';
-				} else if (sendcolor) {
-					/* interpret a color code */
-					switch(*inpos)
-					{
-						case 'x':
-							strcpy(outpos,"\x1B[0;0m");
-							outpos += 6;
-							break;
-						case 'l':
-							strcpy(outpos,"\x1B[0;30m");
-							outpos += 7;
-							break;
-						case 'r':
-							strcpy(outpos,"\x1B[0;31m");
-							outpos += 7;
-							break;
-						case 'g':
-							strcpy(outpos,"\x1B[0;32m");
-							outpos += 7;
-							break;
-						case 'y':
-							strcpy(outpos,"\x1B[0;33m");
-							outpos += 7;
-							break;
-						case 'b':
-							strcpy(outpos,"\x1B[0;34m");
-							outpos += 7;
-							break;
-						case 'm':
-							strcpy(outpos,"\x1B[0;35m");
-							outpos += 7;
-							break;
-						case 'c':
-							strcpy(outpos,"\x1B[0;36m");
-							outpos += 7;
-							break;
-						case 'w':
-							strcpy(outpos,"\x1B[0;37m");
-							outpos += 7;
-							break;
-						case 'L':
-							strcpy(outpos,"\x1B[1;30m");
-							outpos += 7;
-							break;
-						case 'R':
-							strcpy(outpos,"\x1B[1;31m");
-							outpos += 7;
-							break;
-						case 'G':
-							strcpy(outpos,"\x1B[1;32m");
-							outpos += 7;
-							break;
-						case 'Y':
-							strcpy(outpos,"\x1B[1;33m");
-							outpos += 7;
-							break;
-						case 'B':
-							strcpy(outpos,"\x1B[1;34m");
-							outpos += 7;
-							break;
-						case 'M':
-							strcpy(outpos,"\x1B[1;35m");
-							outpos += 7;
-							break;
-						case 'C':
-							strcpy(outpos,"\x1B[1;36m");
-							outpos += 7;
-							break;
-						case 'W':
-							strcpy(outpos,"\x1B[1;37m");
-							outpos += 7;
-							break;
-						default:
-							*outpos++ = '|';
-							*outpos++ = *inpos;
-					}
-				} else {
-					if (!index("xlrgybcmwLRGYBCMW", *inpos))
-					{
-						*outpos++ = '|';
-						*outpos++ = *inpos;
-					}
+					codes[mode][c].len = 2;
+					codes[mode][c].seq[0] = '|';
+					codes[mode][c].seq[1] = c;
 				}
-				inpos++;
-				pos++;
 			}
+
+			/* || is a literal bar */
+			set('|', "|", "|");
+
+			set('x', "", "\x1B[0;0m");
+			set('l', "", "\x1B[0;30m");
+			set('r', "", "\x1B[0;31m");
+			set('g', "", "\x1B[0;32m");
+			set('y', "", "\x1B[0;33m");
+			set('b', "", "\x1B[0;34m");
+			set('m', "", "\x1B[0;35m");
+			set('c', "", "\x1B[0;36m");
+			set('w', "", "\x1B[0;37m");
+			set('L', "", "\x1B[1;30m");
+			set('R', "", "\x1B[1;31m");
+			set('G', "", "\x1B[1;32m");
+			set('Y', "", "\x1B[1;33m");
+			set('B', "", "\x1B[1;34m");
+			set('M', "", "\x1B[1;35m");
+			set('C', "", "\x1B[1;36m");
+			set('W', "", "\x1B[1;37m");
 		}
-		++outpos = '\0';
-		/* Put this on the output buffer */
-		char *bufpos = outBuffer.getTail();
-		int outlen = strlen(dataout);
-		if (outlen > outBuffer.getFree())
-			outlen = outBuffer.getFree();
-		strncpy(bufpos, dataout, outlen);
-		outBuffer.externDatain(outlen);
-		delete[] dataout;
-	} else {
-		/* Put this on the output buffer */
-		char *bufpos = outBuffer.getTail();
-		int outlen = inlen;
-		if (outlen > outBuffer.getFree())
-			outlen = outBuffer.getFree();
-		strncpy(bufpos, datain, outlen);
-		outBuffer.externDatain(outlen);
+
+	protected:
+		/** Set the replacements for one code */
+		void set(unsigned char c, const char *plain, const char *color)
+		{
+			codes[0][c].len = strlen(plain);
+			memcpy(codes[0][c].seq, plain, codes[0][c].len);
+			codes[1][c].len = strlen(color);
+			memcpy(codes[1][c].seq, color, codes[1][c].len);
+		}
+} colortable;
+
+/** Send data out to the network
+ * Colour codes (a | followed by a code character) are replaced or stripped
+ * as they are copied into the output queue.  Text between markers goes in
+ * with a single copy, so plain text costs one memcpy.
+ * @note The hard limit is checked against the untranslated length.
+ */
+void Descriptor::send(QString data)
+{
+	const char *in = data.latin1();
+	const char *end = in + data.length();
+	const ColorTable::code_t *codes = colortable.codes[sendcolor ? 1 : 0];
+
+	/* Hold the output buffer across the whole send so the write interest
+	 * update below can't race doWrite draining the buffer */
+	outBuffer.lock();
+	bool wasempty = outBuffer.isEmpty() && outChain.isEmpty();
+	bool overflowed = _overflowed;
+
+	if (reserveOutput(end - in))
+	{
+		const char *bar;
+		while ((bar = (const char *)memchr(in, '|', end - in)) != NULL)
+		{
+			appendOutput(in, bar - in);
+
+			/* A bar at the very end has no code to go with it */
+			if (bar + 1 == end)
+			{
+				appendOutput(bar, 1);
+				in = end;
+				break;
+			}
+
+			const ColorTable::code_t &code = codes[(unsigned char)bar[1]];
+			appendOutput(code.seq, code.len);
+			in = bar + 2;
+		}
+		appendOutput(in, end - in);
+	}
+
+	/* Let the reactor know we have something to write */
+	if (wasempty && !(outBuffer.isEmpty() && outChain.isEmpty()))
+		_reactor->setWriteInterest(this, true);
+	bool justoverflowed = (_overflowed && !overflowed);
+	outBuffer.unlock();
+
+	/* Log outside the buffer lock; the log may be echoed to descriptors */
+	if (justoverflowed)
+	{
+		QString str;
+		QTextOStream os(&str);
+		os << "Disconnecting socket " << _sock
+			 << ": output queue passed the hard limit of " << _hardlimit
+			 << " bytes";
+		Logger::msg(str, Logger::LOG_WARNING);
 	}
 }
 
 /** Construct a Descriptor object
  * @param sock identifier of connected socket.
  * @param parser Pointer to parser object to start system with
+ * @param reactor Reactor (and so I/O thread) that services this descriptor
  */
-ParseDescriptor::ParseDescriptor(int sock, Parser *parser = NULL)
-	: Descriptor(sock), _parse(parser), inputTaskRunning(false)
+ParseDescriptor::ParseDescriptor(int sock, Parser *parser = NULL,
+																 Reactor *reactor = NULL)
+	: Descriptor(sock, reactor), _parse(parser), inputTaskRunning(false),
+		inputHeld(false)
 {
 }
 
 /** Destroy a descriptor */
 ParseDescriptor::~ParseDescriptor(void)
 {
+	if (_parse)
+		_parse->detach();
 	delete _parse;
 }
 
@@ -25,6 +25,7 @@
 #include <zthread/Thread.h>
 
 #include "buffer.hxx"
+#include "reactor.hxx"
 
 /* Predefine classes */
 namespace koalamud {
@@ -44,7 +45,7 @@ class Socket : public QObject
 	Q_OBJECT
 
 	public:
-		Socket(int sock = 0);
+		Socket(int sock = 0, Reactor *reactor = NULL);
 		virtual ~Socket(void);
 
 		/** This is called by the main socket loop for reads. */
@@ -63,12 +64,25 @@ class Socket : public QObject
 		 */
 		void markClose(void) { _closeme = true; }
 
+		/** Return true if the reactor is watching this socket for writes */
+		bool wantsWrite(void) const { return _wantwrite; }
+		/** Return the reactor this socket is registered with.  All events for
+		 * the socket are dispatched on that reactor's thread. */
+		Reactor *reactor(void) const { return _reactor; }
+
 		/** Set all the appropriate socket options on newly accepted sockets */
 	protected:
 		/** Socket descriptor */
 		int _sock;
 		/** Should we close when the output buffer empties */
 		bool _closeme;
+		/** Write interest currently registered with the reactor */
+		bool _wantwrite;
+		/** Reactor we are registered with */
+		Reactor *_reactor;
+
+		/** The reactor maintains our write interest flag */
+		friend class EpollReactor;
 };
 
 /** Network listener class
@@ -83,8 +97,14 @@ class Listener : public Socket
 			GAMESERVER, /**< Listener is a game player listener */
 		} porttype_t;
 
+		/** Accept queue length when the config doesn't give one */
+		static const int defaultbacklog = 128;
+		/** Most connections accepted for a single read event */
+		static const unsigned int acceptbudget = 64;
+
 	public:
-		Listener(unsigned int port, porttype_t = GAMESERVER);
+		Listener(unsigned int port, porttype_t = GAMESERVER,
+							Reactor *reactor = NULL, int backlog = defaultbacklog);
 		virtual ~Listener();
 
 		/** Handle a newly accepted connection and bring it into the game world */
@@ -116,16 +136,30 @@ class Descriptor : public Socket
 	Q_OBJECT
 
 	public:
-		Descriptor(int sock);
+		Descriptor(int sock, Reactor *reactor = NULL);
 		/** Destroy a descriptor */
 		virtual ~Descriptor(void) {};
 
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_DESCRIPTOR); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_DESCRIPTOR); }
+
+	public:
+		/** What to do with a client whose queued output passed the hard limit */
+		typedef enum {
+			OVERFLOW_DROP, /**< Throw away the output that didn't fit */
+			OVERFLOW_DISCONNECT, /**< Drop the connection */
+		} overflow_t;
+
+		/** Default soft output limit in bytes */
+		static const unsigned int defaultsoftlimit = 65536;
+		/** Default hard output limit in bytes */
+		static const unsigned int defaulthardlimit = 1048576;
+		/** Most iovecs handed to the kernel in one write */
+		static const int maxiov = 64;
 
 	public:
 		virtual void send(QString sendthis);
@@ -138,13 +172,45 @@ class Descriptor : public Socket
 		/** Get color flag */
 		bool getColor(void) { return sendcolor;}
 
+		void setOutputLimits(unsigned int soft, unsigned int hard);
+		unsigned int getOutputPending(void);
+		/** Return true if the client is not keeping up with its output.
+		 * Callers can use this to skip optional output such as channel
+		 * chatter. */
+		bool isSlow(void) { return (getOutputPending() > _softlimit); }
+
+	protected:
+		bool readInput(void);
+		bool reserveOutput(unsigned int len);
+		void appendOutput(const char *data, unsigned int len);
+		/** Decide what to do when output would pass the hard limit
+		 * @param pending Bytes already queued for the client
+		 * The default is to disconnect; a client that far behind is almost
+		 * certainly gone. */
+		virtual overflow_t overflowPolicy(unsigned int pending)
+			{ return OVERFLOW_DISCONNECT; }
+
 	protected:
 		/** True if we want to send color on the link */
 		bool sendcolor;
-		/** Input buffer */
+		/** True if the last read stopped on a full input buffer.  The reactor
+		 * is edge triggered, so we have to ask for another read event once
+		 * there is room again. */
+		bool readStalled;
+		/** True once output has been refused by the hard limit */
+		bool _overflowed;
+		/** Queued output above which isSlow() is true */
+		unsigned int _softlimit;
+		/** Queued output above which overflowPolicy() is consulted */
+		unsigned int _hardlimit;
+		/** Input buffer.  Only the reactor thread writes it and only the
+		 * current InputTask reads it, so it runs in lock free SPSC mode. */
 		Buffer inBuffer;
-		/** Output buffer */
+		/** Output buffer.  Any thread may send, so this one stays locked. */
 		Buffer outBuffer;
+		/** Output that didn't fit in outBuffer.  Protected by the outBuffer
+		 * lock. */
+		BufferChain outChain;
 };
 
 /** Descriptor with hooks to parser
@@ -161,7 +227,8 @@ class ParseDescriptor : public Descriptor
 	Q_OBJECT
 
 	public:
-		ParseDescriptor(int sock, Parser *parser = NULL);
+		ParseDescriptor(int sock, Parser *parser = NULL,
+										Reactor *reactor = NULL);
 		virtual ~ParseDescriptor(void);
 
 	public:
@@ -170,15 +237,22 @@ class ParseDescriptor : public Descriptor
 		Parser *parser(void) { return _parse; }
 		virtual void dispatchRead(void);
 
+		void holdInput(void);
+		void resumeInput(void);
+
 	protected:
 		/** Pointer to the attached parser */
 		Parser *_parse;
 
 	protected: /* Input Task stuff */
+		void queueInputTask(void);
+
 		/** Lock for updating task status */
 		ZThread::FastRecursiveMutex inputTaskLock;
 		/** Status of input handler task */
 		bool inputTaskRunning;
+		/** True while input is held for an asynchronous request */
+		bool inputHeld;
 		/** Input handler Task */
 		class InputTask : public ZThread::Runnable
 		{
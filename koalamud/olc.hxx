@@ -50,10 +50,10 @@ class olc : public Parser
 			QString name; /**< String to display */
 			/** Operator new overload */
 			void * operator new(size_t obj_size)
-				{ return koalamud::PoolAllocator::alloc(obj_size); }
+				{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_OLC); }
 			/** Operator delete overload */
 			void operator delete(void *ptr)
-				{ koalamud::PoolAllocator::free(ptr); }
+				{ koalamud::PoolAllocator::free(ptr, MEMTAG_OLC); }
 		} listnode_t;
 		/** Field information */
 		typedef struct {
@@ -70,10 +70,10 @@ class olc : public Parser
 			long min; /**< Min length for string or min integer value */
 			/** Operator new overload */
 			void * operator new(size_t obj_size)
-				{ return koalamud::PoolAllocator::alloc(obj_size); }
+				{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_OLC); }
 			/** Operator delete overload */
 			void operator delete(void *ptr)
-				{ koalamud::PoolAllocator::free(ptr); }
+				{ koalamud::PoolAllocator::free(ptr, MEMTAG_OLC); }
 		} field_t;
 		/** Parser state */
 		typedef enum {
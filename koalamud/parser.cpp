@@ -15,50 +15,64 @@
 #define KOALA_PARSER_CXX "%A%"
 
 #include <qsqlquery.h>
+#include <qdeepcopy.h>
+#include <zthread/Guard.h>
 
 #include "parser.hxx"
 #include "main.hxx"
 #include "network.hxx"
 #include "playerchar.hxx"
 #include "cmdtree.hxx"
+#include "playercache.hxx"
+#include "playersave.hxx"
 
 namespace koalamud
 {
 
 /** Build a player login parser
- * We also send our welcome message from here.
+ * Call welcome() once the parser is attached to its descriptor.
  */
 PlayerLoginParser::PlayerLoginParser(Char *ch=NULL, ParseDescriptor *desc=NULL)
 	: Parser(ch, desc), state(STATE_GETNAME)
+{
+	_link = new QueryLink(this, desc);
+}
+
+/** Destroy a login parser
+ * Queries still outstanding drop their results, but still let the
+ * descriptor's input flow again.
+ */
+PlayerLoginParser::~PlayerLoginParser(void)
+{
+	_link->lock.acquire();
+	_link->parser = NULL;
+	_link->lock.release();
+	_link->unref();
+}
+
+/** Send our welcome message, once the art has been fetched
+ * This must wait until the descriptor is using us as its parser, since the
+ * result may come back before setParser() returns.
+ */
+void PlayerLoginParser::welcome(void)
 {
 	/* If desc is null, we really have other problems anyway.  Nothing that
 	 * would explicitly cause failure though. */
 	if (_desc)
 	{
-		QString query;
-		QTextOStream qos(&query);
-		QSqlQuery q;
-		qos << "select art from welcomeart order by RAND() limit 1;";
-		if (q.exec(query) && q.numRowsAffected() > 0)
-		{
-			/* Got a welcome screen from the database, send it on to the new
-			 * descriptor */
-			q.next();
-			_desc->send(q.value(0).toString());
-		} else {
-			/* Query for welcome art failed or no art available.  Send a default
-			 * string */
-			QString str;
-			QTextOStream os(&str);
-
-			os << "Welcome to Shadow of the Wheel!" << endl
-				 << "Server running " << srv->versionstring() << endl
-				 << "By what name are you known? ";
-			_desc->send(str);
-		}
+		submitQuery(LoginQuery::QUERY_WELCOME,
+								"select art from welcomeart order by RAND() limit 1;");
 	}
 }
 
+/** Our descriptor is going away - outstanding queries must not touch it */
+void PlayerLoginParser::detach(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(_link->lock);
+	_link->parser = NULL;
+	_link->desc = NULL;
+}
+
 /** Player login
  * Parse a line of input.  First line is player name - Check to see if it
  * exists, if it does, get password and attempt to spawn a playerchar object.
@@ -66,6 +80,8 @@ PlayerLoginParser::PlayerLoginParser(Char *ch=NULL, ParseDescriptor *desc=NULL)
  * parser to 'Playing' parser.
  * @note We confirm that the player wants a new character in this class and
  * pass the name into the next parser.
+ * @note The name and password checks run on the database workers and finish
+ * in queryDone.
  */
 void PlayerLoginParser::parseLine(QString line)
 {
@@ -75,7 +91,6 @@ void PlayerLoginParser::parseLine(QString line)
 	QString out;
 	QTextOStream os(&out);
 	/* Query stuff */
-	QSqlQuery q;
 	QString query;
 	QTextOStream qos(&query);
 
@@ -93,19 +108,7 @@ void PlayerLoginParser::parseLine(QString line)
 				/* Confirm that player name exists */
 				qos << "Select playerid from players" << endl
 					  << "where name = '" << sline << "';";
-				if (q.exec(query))
-				{
-					if (q.numRowsAffected() == 1)
-					{
-						state = STATE_GETPASS;
-						/* FIXME: We should turn off echo here */
-						os << endl << "Enter your password: ";
-					} else {
-						state = STATE_CONFNAME;
-						os << endl << "That player does not exist, would you like to "
-							 << "create a new character?";
-					}
-				}
+				submitQuery(LoginQuery::QUERY_NAME, query);
 			}
 			break;
 		case STATE_GETPASS:
@@ -118,18 +121,7 @@ void PlayerLoginParser::parseLine(QString line)
 			qos << "select playerid from players" << endl
 					<< "where name = '" << pname << "' and" << endl
 					<< "pass = MD5('" << sline << "');";
-			if (q.exec(query))
-			{
-				if (q.numRowsAffected() == 1)
-				{
-					_ch = new PlayerChar(pname, _desc);
-					_desc->setParser(new PlayerParser(_ch, _desc));
-				} else {
-					os << endl << "I'm sorry, that password is incorrect." << endl
-						 << "By what name are you known? ";
-					state = STATE_GETNAME;
-				}
-			}
+			submitQuery(LoginQuery::QUERY_PASS, query);
 			break;
 		case STATE_CONFNAME:
 			if (QString("yes").startsWith(sline.lower()))
@@ -157,6 +149,144 @@ void PlayerLoginParser::parseLine(QString line)
 	}
 }
 
+/** Hold the descriptor's input and queue a login query */
+void PlayerLoginParser::submitQuery(LoginQuery::kind_t kind, QString sql)
+{
+	_desc->holdInput();
+	_link->ref();
+	srv->db()->submit(new LoginQuery(_link, kind, sql));
+}
+
+/** Handle the result of a login query
+ * This runs on the game executor with the descriptor's input still held.
+ */
+void PlayerLoginParser::queryDone(LoginQuery *q)
+{
+	QString out;
+	QTextOStream os(&out);
+
+	switch (q->_kind)
+	{
+		case LoginQuery::QUERY_WELCOME:
+			if (q->_ok && q->_rows > 0)
+			{
+				/* Got a welcome screen from the database, send it on to the new
+				 * descriptor */
+				_desc->send(q->_art);
+			} else {
+				/* Query for welcome art failed or no art available.  Send a default
+				 * string */
+				os << "Welcome to Shadow of the Wheel!" << endl
+					 << "Server running " << srv->versionstring() << endl
+					 << "By what name are you known? ";
+			}
+			break;
+		case LoginQuery::QUERY_NAME:
+			if (q->_ok)
+			{
+				if (q->_rows == 1)
+				{
+					state = STATE_GETPASS;
+					/* FIXME: We should turn off echo here */
+					os << endl << "Enter your password: ";
+					/* Read the player while they type.  If their last session
+					 * hasn't been written yet the rows are stale, so leave it to
+					 * PlayerChar::load. */
+					if (!PlayerSaver::instance()->hasUnsaved(q->_id))
+						PlayerCache::instance()->prefetch(pname);
+				} else {
+					state = STATE_CONFNAME;
+					os << endl << "That player does not exist, would you like to "
+						 << "create a new character?";
+				}
+			}
+			break;
+		case LoginQuery::QUERY_PASS:
+			if (q->_ok)
+			{
+				if (q->_rows == 1)
+				{
+					/* This replaces (and deletes) us, so we're done after it */
+					_ch = new PlayerChar(pname, _desc);
+					_desc->setParser(new PlayerParser(_ch, _desc));
+					return;
+				} else {
+					PlayerCache::instance()->discard(pname);
+					os << endl << "I'm sorry, that password is incorrect." << endl
+						 << "By what name are you known? ";
+					state = STATE_GETNAME;
+				}
+			}
+			break;
+	}
+
+	if (!out.isEmpty())
+	{
+		_desc->send(out);
+	}
+}
+
+/** Add a reference for a new query */
+void PlayerLoginParser::QueryLink::ref(void)
+{
+	lock.acquire();
+	++refs;
+	lock.release();
+}
+
+/** Drop a reference, deleting the link with the last one */
+void PlayerLoginParser::QueryLink::unref(void)
+{
+	lock.acquire();
+	int left = --refs;
+	lock.release();
+
+	if (left == 0)
+		delete this;
+}
+
+/** Build a login query
+ * The SQL is deep copied since it will be used on another thread.
+ */
+PlayerLoginParser::LoginQuery::LoginQuery(QueryLink *link, kind_t kind,
+																					QString sql)
+	: _link(link), _kind(kind), _sql(QDeepCopy<QString>(sql)), _ok(false),
+		_rows(0), _id(0)
+{
+}
+
+/** Let go of the parser link */
+PlayerLoginParser::LoginQuery::~LoginQuery(void)
+{
+	_link->unref();
+}
+
+/** Run the login query on a database worker */
+void PlayerLoginParser::LoginQuery::query(QSqlDatabase *db)
+{
+	QSqlQuery q(QString::null, db);
+	if ((_ok = q.exec(_sql)))
+	{
+		_rows = q.numRowsAffected();
+		if (_kind == QUERY_WELCOME && _rows > 0 && q.next())
+			_art = q.value(0).toString();
+		if (_kind == QUERY_NAME && _rows == 1 && q.next())
+			_id = q.value(0).toInt();
+	}
+}
+
+/** Hand the result to the parser and let input flow again
+ * Either may have gone away while the query ran, in which case we skip it.
+ */
+void PlayerLoginParser::LoginQuery::complete(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(_link->lock);
+	if (_link->parser)
+		_link->parser->queryDone(this);
+	if (_link->desc)
+		_link->desc->resumeInput();
+}
+
 /** Build a player parser
  * This also sends the characters initial prompt
  */
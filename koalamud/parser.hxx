@@ -21,7 +21,10 @@ namespace koalamud {
 	class ParseDescriptor;
 };
 
+#include <zthread/FastRecursiveMutex.h>
+
 #include "char.hxx"
+#include "dbpool.hxx"
 
 namespace koalamud {
 
@@ -38,15 +41,19 @@ class Parser
 	public: /* operators */
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_PARSER); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_PARSER); }
 
 	public: /* pure virtual functions */
 		/** Parse a line of input */
 		virtual void parseLine(QString line) =0;
 
+	public: /* virtual functions */
+		/** Called by the descriptor just before it is destroyed */
+		virtual void detach(void) {}
+
 	protected:
 		/** Pointer to attached character */
 		Char *_ch;
@@ -75,19 +82,95 @@ class PlayerLoginParser : public Parser
 			STATE_CONFNEW,
 		} state_t;
 		
+		/** Link between the parser and its outstanding login queries
+		 * The parser clears its pointers here when it or its descriptor goes
+		 * away, so a query finishing later knows to drop its result.  The
+		 * lock is held while a result is delivered. */
+		class QueryLink
+		{
+			public:
+				/** Build a link with one reference, held by @a parser */
+				QueryLink(PlayerLoginParser *parser, ParseDescriptor *desc)
+					: parser(parser), desc(desc), refs(1) {}
+
+				void ref(void);
+				void unref(void);
+
+			public:
+				/** Lock for the pointers below */
+				ZThread::FastRecursiveMutex lock;
+				/** Parser waiting on the queries, or NULL once it is gone */
+				PlayerLoginParser *parser;
+				/** Descriptor whose input is held, or NULL once it is gone.  Kept
+				 * separately because the parser may replace itself while handling
+				 * a result. */
+				ParseDescriptor *desc;
+
+			protected:
+				/** Parser and outstanding queries still using the link */
+				int refs;
+		};
+
+		/** Login database lookup
+		 * Runs one of the login queries on a database worker and hands the
+		 * result back to the parser.  The descriptor's input is held while
+		 * the query is outstanding. */
+		class LoginQuery : public DBRequest
+		{
+			public:
+				/** Which login query this is */
+				typedef enum {
+					QUERY_WELCOME, /**< Fetch welcome art */
+					QUERY_NAME, /**< Check that a player name exists */
+					QUERY_PASS, /**< Check a player password */
+				} kind_t;
+
+			public:
+				LoginQuery(QueryLink *link, kind_t kind, QString sql);
+				virtual ~LoginQuery(void);
+
+				virtual void query(QSqlDatabase *db);
+				virtual void complete(void);
+
+			public:
+				/** Link back to the parser that issued the query */
+				QueryLink *_link;
+				/** Which query this is */
+				kind_t _kind;
+				/** SQL to run */
+				QString _sql;
+				/** True if the query ran */
+				bool _ok;
+				/** Rows returned */
+				int _rows;
+				/** Player id, for QUERY_NAME */
+				int _id;
+				/** Welcome art, for QUERY_WELCOME */
+				QString _art;
+		};
+		friend class LoginQuery;
+
 	public:
 		PlayerLoginParser(Char *ch = NULL, ParseDescriptor *desc = NULL);
-		/** Destroy a parser object */
-		virtual ~PlayerLoginParser(void) {}
+		virtual ~PlayerLoginParser(void);
+
+		void welcome(void);
 
 	public: /* virtual functions */
 		virtual void parseLine(QString line);
+		virtual void detach(void);
+
+	protected:
+		void submitQuery(LoginQuery::kind_t kind, QString sql);
+		void queryDone(LoginQuery *q);
 
 	protected:
 		/** Player name */
 		QString pname;
 		/** Current parse state */
 		state_t state;
+		/** Link shared with our outstanding queries */
+		QueryLink *_link;
 };
 
 /** Normal player parsing
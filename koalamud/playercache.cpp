@@ -0,0 +1,236 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CHAR/PlayerCache
+* Description:
+* 	Login prefetch.  Once a player's name is accepted, everything
+* 	PlayerChar::load needs is fetched in the background while the
+* 	player types their password.
+* Classes:
+* 	PlayerRecord
+* 	PlayerCache
+\***************************************************************/
+
+#define KOALA_PLAYERCACHE_CXX "%A%"
+
+#include <qdeepcopy.h>
+#include <qsqlquery.h>
+#include <qstringlist.h>
+#include <zthread/Guard.h>
+
+#include "playercache.hxx"
+#include "main.hxx"
+#include "database.hxx"
+#include "logging.hxx"
+
+namespace koalamud {
+
+/** Database request reading one player for the cache */
+class PrefetchRequest : public DBRequest
+{
+	public:
+		/** Fetch the player called @a name as fetch number @a fetch */
+		PrefetchRequest(QString name, unsigned int fetch)
+			: _name(QDeepCopy<QString>(name)), _fetch(fetch), _rec(NULL) {}
+		/** Free the record if nobody took it */
+		virtual ~PrefetchRequest(void) { delete _rec; }
+
+		virtual void query(QSqlDatabase *db);
+		/** Hand the record to the cache */
+		virtual void complete(void)
+			{ PlayerCache::instance()->store(_name, _fetch, _rec); _rec = NULL; }
+
+	protected:
+		/** Player name as typed */
+		QString _name;
+		/** Fetch number handed out by the cache */
+		unsigned int _fetch;
+		/** Record read, NULL if the player couldn't be read */
+		PlayerRecord *_rec;
+};
+
+/** Read the player row, skills and command permissions */
+void PrefetchRequest::query(QSqlDatabase *db)
+{
+	QSqlQuery q(QString::null, db);
+	PlayerRecord *rec = new PlayerRecord;
+
+	{
+		QString query;
+		QTextOStream qos(&query);
+		qos << "select playerid, name, lastname, inroomzone, inroomlat, "
+				<< "inroomlong, inroomelev from players" << endl
+				<< "where name = '" << Logger::escapeString(_name) << "';";
+		if (!q.exec(query) || !q.next())
+		{
+			delete rec;
+			return;
+		}
+		rec->dbid = q.value(0).toInt();
+		rec->name = q.value(1).toString();
+		rec->lname = q.value(2).toString();
+		rec->inzone = q.value(3).toInt();
+		rec->inlat = q.value(4).toInt();
+		rec->inlong = q.value(5).toInt();
+		rec->inelev = q.value(6).toInt();
+	}
+
+	{
+		QString query;
+		QTextOStream qos(&query);
+		qos << "select skid, learned from skilllevels" << endl
+				<< "where pid = " << rec->dbid << ";";
+		if (!q.exec(query))
+		{
+			delete rec;
+			return;
+		}
+		while (q.next())
+			rec->skills.insert(q.value(0).toString(), q.value(1).toInt());
+	}
+
+	{
+		QString query;
+		QTextOStream qos(&query);
+		qos << "select cmdname, allowed from cmdperm" << endl
+				<< "where playerid = " << rec->dbid << ";";
+		if (!q.exec(query))
+		{
+			delete rec;
+			return;
+		}
+		while (q.next())
+			rec->grants.insert(q.value(0).toString(),
+												 q.value(1).toString() == "yes");
+	}
+
+	{
+		QString query;
+		QTextOStream qos(&query);
+		qos << "select groupid from groupmem" << endl
+				<< "where playerid = " << rec->dbid << ";";
+		if (!q.exec(query))
+		{
+			delete rec;
+			return;
+		}
+		while (q.next())
+			rec->groups.append(q.value(0).toInt());
+	}
+
+	rec->fetched = Reactor::now();
+	_rec = rec;
+}
+
+/** Build an empty cache */
+PlayerCache::PlayerCache(void)
+	: records(31), lastfetch(0)
+{
+	records.setAutoDelete(true);
+}
+
+/** Start reading a player in the background
+ * Does nothing if the player is already cached or being read.
+ */
+void PlayerCache::prefetch(QString name)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+
+	expire();
+
+	QString key = name.lower();
+	if (records.find(key))
+		return;
+
+	/* A fetch that was taken or discarded may have read rows that have
+	 * changed since, so it is never wanted again.  Start a new one. */
+	QMap<QString, unsigned int>::Iterator it = fetching.find(key);
+	if (it != fetching.end() && it.data())
+		return;
+
+	if (++lastfetch == 0)
+		++lastfetch;
+	fetching.replace(key, lastfetch);
+	srv->db()->submit(new PrefetchRequest(name, lastfetch));
+}
+
+/** Take a player's record out of the cache
+ * @return The record, which the caller now owns, or NULL if there isn't a
+ * 				 fresh one.  A fetch still running for the player is abandoned.
+ */
+PlayerRecord *PlayerCache::take(QString name)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+
+	QString key = name.lower();
+	QMap<QString, unsigned int>::Iterator it = fetching.find(key);
+	if (it != fetching.end())
+		it.data() = 0;
+
+	PlayerRecord *rec = records.take(key);
+	if (rec && Reactor::now() - rec->fetched > ttl)
+	{
+		delete rec;
+		return NULL;
+	}
+	return rec;
+}
+
+/** Throw away anything cached or being fetched for a player */
+void PlayerCache::discard(QString name)
+{
+	delete take(name);
+}
+
+/** Called on the game executor when a fetch finishes
+ * @param fetch Number the fetch was started with
+ * @param rec Record read, or NULL if the fetch failed.  The cache takes
+ * 					  ownership.
+ */
+void PlayerCache::store(QString name, unsigned int fetch, PlayerRecord *rec)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(cachelock);
+
+	QString key = name.lower();
+	QMap<QString, unsigned int>::Iterator it = fetching.find(key);
+	bool wanted = (it != fetching.end() && it.data() == fetch);
+	/* Leave the entry alone if a newer fetch owns it */
+	if (it != fetching.end() && (wanted || it.data() == 0))
+		fetching.remove(it);
+
+	if (rec == NULL)
+		return;
+	if (!wanted)
+	{
+		delete rec;
+		return;
+	}
+
+	records.replace(key, rec);
+}
+
+/** Drop records older than ttl
+ * @note cachelock must be held by the caller
+ */
+void PlayerCache::expire(void)
+{
+	unsigned long long now = Reactor::now();
+	QStringList old;
+
+	QDictIterator<PlayerRecord> rec(records);
+	for (; rec.current(); ++rec)
+	{
+		if (now - rec.current()->fetched > ttl)
+			old << rec.currentKey();
+	}
+
+	for (QStringList::Iterator it = old.begin(); it != old.end(); ++it)
+		records.remove(*it);
+}
+
+}; /* end koalamud namespace */
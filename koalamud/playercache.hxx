@@ -0,0 +1,115 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CHAR/PlayerCache
+* Description:
+* 	Login prefetch.  Once a player's name is accepted, everything
+* 	PlayerChar::load needs is fetched in the background while the
+* 	player types their password.
+* Classes:
+* 	PlayerRecord
+* 	PlayerCache
+\***************************************************************/
+
+#ifndef KOALA_PLAYERCACHE_HXX
+#define KOALA_PLAYERCACHE_HXX "%A%"
+
+#include <qdict.h>
+#include <qmap.h>
+#include <qvaluelist.h>
+#include <zthread/FastRecursiveMutex.h>
+
+#include "memory.hxx"
+
+namespace koalamud {
+
+/** Everything PlayerChar::load reads from the database for one player */
+class PlayerRecord
+{
+	public:
+		/** Build an empty record */
+		PlayerRecord(void)
+			: dbid(0), inzone(0), inlat(0), inlong(0), inelev(0), fetched(0) {}
+
+		/** players.playerid */
+		int dbid;
+		/** Player name as stored */
+		QString name;
+		/** Last name */
+		QString lname;
+		/** Room the player was last in */
+		int inzone, inlat, inlong, inelev;
+		/** Skill know levels by skill id */
+		QMap<QString, int> skills;
+		/** cmdperm grants by command name */
+		QMap<QString, bool> grants;
+		/** groupmem group ids */
+		QValueList<int> groups;
+		/** Reactor::now() when the record was read */
+		unsigned long long fetched;
+
+	public:
+		/** Operator new overload */
+		void * operator new(size_t obj_size)
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_PLAYERDATA); }
+		/** Operator delete overload */
+		void operator delete(void *ptr)
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_PLAYERDATA); }
+};
+
+/** Short lived cache of prefetched players
+ * PlayerLoginParser calls prefetch() as soon as a name checks out.  The
+ * record is read on a database worker and kept for up to ttl.  take() hands
+ * it to PlayerChar::load once the password is accepted; a wrong password
+ * calls discard(), as does anything that changes the player's rows.  A
+ * record is only ever used once, and a fetch that is still running when its
+ * record is taken or discarded is thrown away when it finishes, even if the
+ * player is prefetched again meanwhile.  So a record can never outlive the
+ * login it was fetched for, or predate a discard().
+ */
+class PlayerCache
+{
+	public:
+		/** Milliseconds a prefetched record stays usable */
+		static const unsigned int ttl = 60000;
+
+	protected:
+		PlayerCache(void);
+
+	public:
+		void prefetch(QString name);
+		PlayerRecord *take(QString name);
+		void discard(QString name);
+		void store(QString name, unsigned int fetch, PlayerRecord *rec);
+
+		/** Get a pointer to the singleton instance */
+		static PlayerCache *instance(void)
+			{
+				static PlayerCache *_instance = NULL;
+				if (_instance == NULL)
+					_instance = new PlayerCache;
+				return _instance;
+			}
+
+	protected:
+		void expire(void);
+
+	protected:
+		/** Fetched records by lower case name */
+		QDict<PlayerRecord> records;
+		/** Fetch whose result is wanted by lower case name, 0 once unwanted */
+		QMap<QString, unsigned int> fetching;
+		/** Number of the last fetch started */
+		unsigned int lastfetch;
+		/** Protects everything above */
+		ZThread::FastRecursiveMutex cachelock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_PLAYERCACHE_HXX
@@ -25,14 +25,17 @@
 #include "event.hxx"
 #include "playerchar.hxx"
 #include "cmdtree.hxx"
+#include "cmdperm.hxx"
 #include "logging.hxx"
 #include "room.hxx"
+#include "playersave.hxx"
+#include "playercache.hxx"
 
 namespace koalamud {
 
 /** Build Player character object, including loading from the database */
 PlayerChar::PlayerChar(QString name, ParseDescriptor *desc = NULL)
-	: Char(name, NULL), dbid(0)
+	: Char(name, NULL), dbid(0), _loaded(false)
 {
 
 	if (desc)
@@ -74,7 +77,9 @@ PlayerChar::~PlayerChar(void)
 	connectedplayerlist.removeRef(this);
 	connectedplayermap.remove(_name);
 
-	save();
+	/* Anything unsaved goes out with the next batch */
+	PlayerSaver::instance()->saveSoon(dbid);
+	CmdPermCache::instance()->invalidate(dbid);
 
 	/* cleanup gui */
 	if (srv->usegui())
@@ -108,11 +113,65 @@ void PlayerChar::setDesc(ParseDescriptor *desc)
 	connect(desc, SIGNAL(destroyed()), this, SLOT(descriptorClosed()));
 }
 
-/** Load player from database */
+/** Load player from database
+ * If the player was prefetched while typing their password everything comes
+ * from that record and nothing is read here.  Changes from a previous
+ * session that haven't been written yet are laid over whatever was read.
+ */
 bool PlayerChar::load(void)
+{
+	int inzone = 0, inlat = 0, inlong = 0, inelev = 0;
+	PlayerRecord *rec = PlayerCache::instance()->take(_name);
+
+	if (rec)
+	{
+		dbid = rec->dbid;
+		_name = rec->name;
+		_lname = rec->lname;
+		inzone = rec->inzone;
+		inlat = rec->inlat;
+		inlong = rec->inlong;
+		inelev = rec->inelev;
+
+		QMap<QString, int>::Iterator sk;
+		for (sk = rec->skills.begin(); sk != rec->skills.end(); ++sk)
+			setSkillLevel(sk.key(), sk.data());
+
+		/* Command permissions came along with the rest */
+		CmdPermCache::instance()->prime(dbid, rec->grants, rec->groups);
+		delete rec;
+	} else {
+		loadRows(inzone, inlat, inlong, inelev);
+
+		/* Cache command permissions so restricted commands don't hit the db */
+		CmdPermCache::instance()->load(dbid);
+	}
+
+	if (dbid != 0)
+	{
+		QMap<QString, int> skillchanges;
+		PlayerSaver::instance()->unsaved(dbid, inzone, inlat, inlong, inelev,
+																		 skillchanges);
+		QMap<QString, int>::Iterator sk;
+		for (sk = skillchanges.begin(); sk != skillchanges.end(); ++sk)
+			setSkillLevel(sk.key(), sk.data());
+	}
+
+	/* turn on color */
+	_desc->setColor(true);
+	_inroom = Room::findRoom(inzone, inlat, inlong, inelev);
+
+	_loaded = true;
+	PlayerSaver::instance()->loggedIn(dbid);
+	return true;
+}
+
+/** Read the player row and skills from the database
+ * Used when the player wasn't prefetched.
+ */
+void PlayerChar::loadRows(int &inzone, int &inlat, int &inlong, int &inelev)
 {
 	QSqlQuery q;
-	int inzone, inlat, inlong, inelev;
 
 	{
 		QString query;
@@ -155,62 +214,33 @@ bool PlayerChar::load(void)
 			cerr << "Failed query: " << query << endl;
 		}
 	}
-
-	/* turn on color */
-	_desc->setColor(true);
-	_inroom = Room::findRoom(inzone, inlat, inlong, inelev);
-	return true;
 }
 
-/** Save player to database */
+/** Save player to database
+ * Only what has changed since the last save is written, and it is written
+ * in the background along with any other players that are due.
+ */
 bool PlayerChar::save(void)
 {
 	if (dbid == 0)
 		return false;
 
-	QSqlQuery q;
-	{
-		/* Save main player record */
-		QString query;
-		QTextOStream qos(&query);
-
-		qos << "update players" << endl
-				<< "set lastlogin = NOW()," << endl
-				<< "inroomzone = " << _inroom->getZone() << "," << endl
-				<< "inroomlat = " << _inroom->getLat() << "," << endl
-				<< "inroomlong = " << _inroom->getLong() << "," << endl
-				<< "inroomelev = " << _inroom->getElev() << endl
-				<< "where playerid = " << dbid << ";";
-
-		if (!q.exec(query))
-			cerr << "Failed query: " << query << endl;
-	}
-
-	{
-		/* Save skill levels */
-		QString query;
-		QTextOStream qos(&query);
+	PlayerSaver::instance()->saveSoon(dbid, true);
+	return true;
+}
 
-		qos << "replace into skilllevels (pid, skid, learned) values";
-		QDictIterator<SkillRecord> skrec(skills);
-		bool first=true;
-		for (; *skrec; ++skrec)
-		{
-			if (!first)
-			{
-				qos << ",";
-			} else {
-				first = false;
-			}
-			qos << endl << "(" << dbid << ", '" << (*skrec)->getId() << "',"
-					<< (*skrec)->getKnow() << ")";
-		}
-		qos << ";";
+/** Record our new location for the next save */
+void PlayerChar::roomChanged(void)
+{
+	if (_loaded)
+		PlayerSaver::instance()->setLocation(dbid, _inroom);
+}
 
-		if (!q.exec(query))
-			cerr << "Failed query: " << query << endl;
-	}
-	return true;
+/** Record a skill level change for the next save */
+void PlayerChar::skillChanged(QString id, int know)
+{
+	if (_loaded)
+		PlayerSaver::instance()->setSkill(dbid, id, know);
 }
 
 }; /* end koalamud namespace */
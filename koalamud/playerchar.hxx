@@ -45,6 +45,8 @@ class PlayerChar : public Char
 		virtual ~PlayerChar(void);
 		virtual bool load(void);
 		virtual bool save(void);
+		/** Return our database id */
+		virtual int getDBID(void) const { return dbid; }
 
 	public:
 		virtual void setDesc(ParseDescriptor *desc);
@@ -52,9 +54,16 @@ class PlayerChar : public Char
 	public slots:
 		virtual void descriptorClosed(void);
 
+	protected:
+		void loadRows(int &inzone, int &inlat, int &inlong, int &inelev);
+		virtual void roomChanged(void);
+		virtual void skillChanged(QString id, int know);
+
 	protected:
 		/** Database ID - 0 means we aren't in the database */
 		int dbid;
+		/** True once load() has finished, changes before that aren't saved */
+		bool _loaded;
 };
 	
 }; /* end koalamud namespace */
@@ -0,0 +1,434 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CHAR/PlayerSaver
+* Description:
+* 	Write-behind player persistence.  Changes to players are
+* 	recorded as they happen and written in batches, one
+* 	transaction per batch, on the database workers.
+* Classes:
+* 	PlayerSaver
+\***************************************************************/
+
+#define KOALA_PLAYERSAVE_CXX "%A%"
+
+#include <qdeepcopy.h>
+#include <qsqlquery.h>
+#include <zthread/Guard.h>
+
+#include "playersave.hxx"
+#include "main.hxx"
+#include "database.hxx"
+#include "logging.hxx"
+#include "room.hxx"
+
+namespace koalamud {
+
+/** Database request writing one batch of players */
+class PlayerSaveRequest : public DBRequest
+{
+	public:
+		/** Write @a batch */
+		PlayerSaveRequest(PlayerSaver::batch_t *batch)
+			: _batch(batch), _ok(false) {}
+
+		/** Write the batch in one transaction */
+		virtual void query(QSqlDatabase *db)
+			{ _ok = PlayerSaver::write(db, _batch); }
+		/** Let the saver know how it went */
+		virtual void complete(void)
+			{ PlayerSaver::instance()->written(_batch, _ok); }
+
+	protected:
+		/** Records to write, owned by the saver */
+		PlayerSaver::batch_t *_batch;
+		/** True if the batch was committed */
+		bool _ok;
+};
+
+/** Build an empty saver.  Nothing is written until start(). */
+PlayerSaver::PlayerSaver(void)
+	: pending(101), _started(false), _stopped(false)
+{
+	pending.setAutoDelete(true);
+}
+
+/** Find or create the unsaved record for a player
+ * A new record is due savedelay from now.
+ * @note savelock must be held by the caller
+ */
+PlayerSaver::PendingSave *PlayerSaver::record(int dbid)
+{
+	PendingSave *r = pending.find(dbid);
+	if (r == NULL)
+	{
+		r = new PendingSave(dbid);
+		r->due = Reactor::now() + savedelay;
+		pending.insert(dbid, r);
+	}
+	return r;
+}
+
+/** Note that a player has just logged in */
+void PlayerSaver::loggedIn(int dbid)
+{
+	if (dbid == 0)
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	PendingSave *r = record(dbid);
+	r->fields |= FIELD_LOGIN;
+	r->login = time(NULL);
+}
+
+/** Note that a player has moved to @a room */
+void PlayerSaver::setLocation(int dbid, Room *room)
+{
+	if (dbid == 0 || room == NULL)
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	PendingSave *r = record(dbid);
+	r->fields |= FIELD_LOCATION;
+	r->zone = room->getZone();
+	r->lat = room->getLat();
+	r->longi = room->getLong();
+	r->elev = room->getElev();
+}
+
+/** Note a change to a player's skill level */
+void PlayerSaver::setSkill(int dbid, QString skid, int know)
+{
+	if (dbid == 0)
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	/* The key is read on a database worker, so it can't share data with the
+	 * caller's string */
+	record(dbid)->skills[QDeepCopy<QString>(skid)] = know;
+}
+
+/** Bring a player's save forward
+ * Used when a player quits (their changes go out with the next batch) and by
+ * the save command.  Players with nothing unsaved are left alone.
+ * @param now Write the due players straight away instead of on the next tick
+ */
+void PlayerSaver::saveSoon(int dbid, bool now = false)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	PendingSave *r = pending.find(dbid);
+	if (r == NULL)
+		return;
+
+	r->due = 0;
+	if (now)
+		flush();
+}
+
+/** Return true if a player has changes that haven't reached the database */
+bool PlayerSaver::hasUnsaved(int dbid)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	if (pending.find(dbid))
+		return true;
+
+	QPtrListIterator<batch_t> batch(inflight);
+	for (; *batch; ++batch)
+	{
+		QPtrListIterator<PendingSave> rec(**batch);
+		for (; *rec; ++rec)
+		{
+			if ((*rec)->dbid == dbid)
+				return true;
+		}
+	}
+	return false;
+}
+
+/** Find changes to a player that haven't reached the database yet
+ * A player who logs back in before their last session has been written reads
+ * stale rows, so load() lays these over whatever it read.
+ * @param skills Unsaved skill levels are added to this map
+ * @return The field_t bits that were found.  The coordinates are only set if
+ * 				 FIELD_LOCATION is among them.
+ */
+unsigned int PlayerSaver::unsaved(int dbid, int &zone, int &lat, int &longi,
+																	int &elev, QMap<QString, int> &skills)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	/* Newest first, merge() only fills in what is missing */
+	PendingSave merged(dbid);
+	PendingSave *r = pending.find(dbid);
+	if (r)
+		merge(&merged, r);
+
+	QPtrListIterator<batch_t> batch(inflight);
+	for (batch.toLast(); *batch; --batch)
+	{
+		QPtrListIterator<PendingSave> rec(**batch);
+		for (; *rec; ++rec)
+		{
+			if ((*rec)->dbid == dbid)
+				merge(&merged, *rec);
+		}
+	}
+
+	if (merged.fields & FIELD_LOCATION)
+	{
+		zone = merged.zone;
+		lat = merged.lat;
+		longi = merged.longi;
+		elev = merged.elev;
+	}
+
+	QMap<QString, int>::Iterator sk;
+	for (sk = merged.skills.begin(); sk != merged.skills.end(); ++sk)
+		skills.insert(sk.key(), sk.data());
+
+	return merged.fields;
+}
+
+/** Start the flush timer on the main reactor */
+void PlayerSaver::start(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	if (_started || _stopped)
+		return;
+
+	srv->reactor()->addTimer(&flusher, flushinterval, true);
+	_started = true;
+}
+
+/** Hand the players that are due to the database workers as one batch */
+void PlayerSaver::flush(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	if (_stopped || pending.isEmpty())
+		return;
+
+	unsigned long long now = Reactor::now();
+	QPtrList<PendingSave> due;
+	QIntDictIterator<PendingSave> it(pending);
+	for (; it.current() && due.count() < maxbatch; ++it)
+	{
+		if (it.current()->due <= now)
+			due.append(it.current());
+	}
+	if (due.isEmpty())
+		return;
+
+	batch_t *batch = new batch_t;
+	batch->setAutoDelete(true);
+	QPtrListIterator<PendingSave> r(due);
+	for (; *r; ++r)
+		batch->append(pending.take((*r)->dbid));
+
+	inflight.append(batch);
+	srv->db()->submit(new PlayerSaveRequest(batch));
+}
+
+/** Called on the game executor when a batch has been written
+ * Records from a failed batch go back in the pending list to be tried again
+ * after savedelay, unless something newer has been recorded for them.
+ */
+void PlayerSaver::written(batch_t *batch, bool ok)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	if (!inflight.removeRef(batch))
+		return;
+
+	if (!ok)
+	{
+		QString str;
+		QTextOStream os(&str);
+		os << "Unable to save " << batch->count() << " players, will retry";
+		Logger::msg(str, Logger::LOG_ERROR);
+
+		unsigned long long retry = Reactor::now() + savedelay;
+		PendingSave *r;
+		while ((r = batch->take(0)) != NULL)
+		{
+			PendingSave *newer = pending.find(r->dbid);
+			if (newer)
+			{
+				merge(newer, r);
+				delete r;
+			} else {
+				r->due = retry;
+				pending.insert(r->dbid, r);
+			}
+		}
+	}
+
+	delete batch;
+}
+
+/** Write everything still unsaved on the calling thread
+ * Run once the main loop has stopped and the database workers have been
+ * stopped, so nothing else is writing players.  Batches the workers haven't
+ * confirmed are written again first, so the newer pending values land on top
+ * of them.
+ */
+void PlayerSaver::shutdown(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(savelock);
+
+	if (_stopped)
+		return;
+	_stopped = true;
+
+	if (_started)
+		srv->reactor()->removeTimer(&flusher);
+
+	batch_t all;
+	QPtrListIterator<batch_t> batch(inflight);
+	for (; *batch; ++batch)
+	{
+		QPtrListIterator<PendingSave> r(**batch);
+		for (; *r; ++r)
+			all.append(*r);
+	}
+	QIntDictIterator<PendingSave> r(pending);
+	for (; r.current(); ++r)
+		all.append(r.current());
+
+	if (all.isEmpty())
+		return;
+
+	QString str;
+	QTextOStream os(&str);
+	if (write(QSqlDatabase::database(), &all))
+	{
+		os << "Saved " << all.count() << " players at shutdown";
+		Logger::msg(str, Logger::LOG_NOTICE);
+	} else {
+		os << "Unable to save " << all.count() << " players at shutdown";
+		Logger::msg(str, Logger::LOG_CRITICAL);
+	}
+}
+
+/** Merge an older record into a newer one for the same player
+ * Only what @a into doesn't already have is copied. */
+void PlayerSaver::merge(PendingSave *into, PendingSave *from)
+{
+	if ((from->fields & FIELD_LOGIN) && !(into->fields & FIELD_LOGIN))
+		into->login = from->login;
+	if ((from->fields & FIELD_LOCATION) && !(into->fields & FIELD_LOCATION))
+	{
+		into->zone = from->zone;
+		into->lat = from->lat;
+		into->longi = from->longi;
+		into->elev = from->elev;
+	}
+	into->fields |= from->fields;
+
+	QMap<QString, int>::Iterator sk;
+	for (sk = from->skills.begin(); sk != from->skills.end(); ++sk)
+	{
+		if (!into->skills.contains(sk.key()))
+			into->skills.insert(sk.key(), sk.data());
+	}
+
+	if (from->due < into->due)
+		into->due = from->due;
+}
+
+/** Write a batch of records in one transaction
+ * Each player with changed fields gets an update of just those fields, and
+ * every changed skill in the batch goes in a single replace.  Records for
+ * the same player are written in order, so later ones win.
+ * @param db Connection to write on
+ * @return true if everything was written
+ */
+bool PlayerSaver::write(QSqlDatabase *db, batch_t *batch)
+{
+	QSqlQuery q(QString::null, db);
+	bool ok = true;
+	bool trans = db->transaction();
+
+	QPtrListIterator<PendingSave> r(*batch);
+	for (; *r && ok; ++r)
+	{
+		if ((*r)->fields == 0)
+			continue;
+
+		QString query;
+		QTextOStream qos(&query);
+		qos << "update players set";
+		if ((*r)->fields & FIELD_LOGIN)
+		{
+			qos << endl << "lastlogin = from_unixtime("
+					<< (unsigned long)(*r)->login << ")";
+			if ((*r)->fields & FIELD_LOCATION)
+				qos << ",";
+		}
+		if ((*r)->fields & FIELD_LOCATION)
+		{
+			qos << endl
+					<< "inroomzone = " << (*r)->zone << "," << endl
+					<< "inroomlat = " << (*r)->lat << "," << endl
+					<< "inroomlong = " << (*r)->longi << "," << endl
+					<< "inroomelev = " << (*r)->elev;
+		}
+		qos << endl << "where playerid = " << (*r)->dbid << ";";
+
+		if (!q.exec(query))
+		{
+			Logger::msg("Failed query: " + query, Logger::LOG_ERROR);
+			ok = false;
+		}
+	}
+
+	if (ok)
+	{
+		QString query;
+		QTextOStream qos(&query);
+		bool first = true;
+
+		qos << "replace into skilllevels (pid, skid, learned) values";
+		for (r.toFirst(); *r; ++r)
+		{
+			QMap<QString, int>::Iterator sk;
+			for (sk = (*r)->skills.begin(); sk != (*r)->skills.end(); ++sk)
+			{
+				if (!first)
+					qos << ",";
+				first = false;
+				qos << endl << "(" << (*r)->dbid << ", '"
+						<< Logger::escapeString(sk.key()) << "', " << sk.data() << ")";
+			}
+		}
+		qos << ";";
+
+		if (!first && !q.exec(query))
+		{
+			Logger::msg("Failed query: " + query, Logger::LOG_ERROR);
+			ok = false;
+		}
+	}
+
+	if (trans)
+	{
+		if (ok)
+			ok = db->commit();
+		else
+			db->rollback();
+	}
+	return ok;
+}
+
+}; /* end koalamud namespace */
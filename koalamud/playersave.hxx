@@ -0,0 +1,164 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CHAR/PlayerSaver
+* Description:
+* 	Write-behind player persistence.  Changes to players are
+* 	recorded as they happen and written in batches, one
+* 	transaction per batch, on the database workers.
+* Classes:
+* 	PlayerSaver
+\***************************************************************/
+
+#ifndef KOALA_PLAYERSAVE_HXX
+#define KOALA_PLAYERSAVE_HXX "%A%"
+
+#include <time.h>
+#include <qintdict.h>
+#include <qmap.h>
+#include <qptrlist.h>
+#include <qsqldatabase.h>
+#include <zthread/FastRecursiveMutex.h>
+#include <zthread/Runnable.h>
+
+#include "memory.hxx"
+
+namespace koalamud {
+
+class Room;
+
+/** Player write-behind cache
+ * PlayerChar reports each change (login, room, skill level) as it happens.
+ * The latest values are kept per player until the player's save comes due,
+ * savedelay after the first unsaved change, or sooner if the player saves or
+ * quits.  A timer on the main reactor collects due players every
+ * flushinterval into one batch and hands it to the database workers, which
+ * write it as a single transaction.  A batch holds at most maxbatch players,
+ * anyone left over goes in the next one, so a crowd logging in or out at once
+ * is spread over a few ticks instead of hitting the database together.
+ *
+ * Players with nothing unsaved cost nothing to save.  Batches that fail are
+ * merged back and tried again.  shutdown() writes everything that is left,
+ * including batches the workers haven't confirmed, on the calling thread.
+ */
+class PlayerSaver
+{
+	public:
+		/** Milliseconds between flushes */
+		static const unsigned int flushinterval = 2000;
+		/** Milliseconds a change may wait before it is written */
+		static const unsigned int savedelay = 60000;
+		/** Most players written in one transaction */
+		static const unsigned int maxbatch = 200;
+
+		/** Player fields that can be waiting to be written */
+		typedef enum {
+			FIELD_LOGIN = 1 << 0, /**< lastlogin */
+			FIELD_LOCATION = 1 << 1 /**< inroom coordinates */
+		} field_t;
+
+	protected:
+		/** Unsaved changes for one player */
+		class PendingSave
+		{
+			public:
+				/** Build an empty record */
+				PendingSave(int playerid)
+					: dbid(playerid), fields(0), login(0), zone(0), lat(0), longi(0),
+						elev(0), due(0)
+					{}
+
+				/** players.playerid */
+				int dbid;
+				/** field_t bits that need writing */
+				unsigned int fields;
+				/** Login time for FIELD_LOGIN */
+				time_t login;
+				/** Room coordinates for FIELD_LOCATION */
+				int zone, lat, longi, elev;
+				/** Skill levels that need writing, keyed by skill id */
+				QMap<QString, int> skills;
+				/** Reactor::now() when the record is to be written */
+				unsigned long long due;
+
+			public:
+				/** Operator new overload */
+				void * operator new(size_t obj_size)
+					{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_PLAYERDATA); }
+				/** Operator delete overload */
+				void operator delete(void *ptr)
+					{ koalamud::PoolAllocator::free(ptr, MEMTAG_PLAYERDATA); }
+		};
+
+		/** Records handed to the workers together */
+		typedef QPtrList<PendingSave> batch_t;
+
+		/** Timer task that runs flush() */
+		class FlushTask : public ZThread::Runnable
+		{
+			public:
+				/** Empty virtual destructor */
+				virtual ~FlushTask(void) {}
+				/** Write whatever is due */
+				virtual void run(void) { PlayerSaver::instance()->flush(); }
+		};
+
+		friend class PlayerSaveRequest;
+
+	protected:
+		PlayerSaver(void);
+
+	public:
+		void loggedIn(int dbid);
+		void setLocation(int dbid, Room *room);
+		void setSkill(int dbid, QString skid, int know);
+		void saveSoon(int dbid, bool now = false);
+		bool hasUnsaved(int dbid);
+		unsigned int unsaved(int dbid, int &zone, int &lat, int &longi, int &elev,
+											 QMap<QString, int> &skills);
+
+		void start(void);
+		void flush(void);
+		void shutdown(void);
+
+		/** Return the number of players with unsaved changes */
+		unsigned int pendingCount(void) const { return pending.count(); }
+
+		/** Get a pointer to the singleton instance */
+		static PlayerSaver *instance(void)
+			{
+				static PlayerSaver *_instance = NULL;
+				if (_instance == NULL)
+					_instance = new PlayerSaver;
+				return _instance;
+			}
+
+	protected:
+		PendingSave *record(int dbid);
+		void written(batch_t *batch, bool ok);
+		static void merge(PendingSave *into, PendingSave *from);
+		static bool write(QSqlDatabase *db, batch_t *batch);
+
+	protected:
+		/** Unsaved changes by player id */
+		QIntDict<PendingSave> pending;
+		/** Batches given to the workers and not yet confirmed */
+		QPtrList<batch_t> inflight;
+		/** True once the flush timer is running */
+		bool _started;
+		/** True once shutdown() has run */
+		bool _stopped;
+		/** Flush timer task */
+		FlushTask flusher;
+		/** Protects everything above */
+		ZThread::FastRecursiveMutex savelock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_PLAYERSAVE_HXX
@@ -0,0 +1,382 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CORE/Reactor
+* Description:
+* 	Socket event demultiplexing.  Sockets register with a reactor
+* 	once when they are created and the reactor calls back into
+* 	dispatchRead/doWrite when the kernel reports activity.  The
+* 	reactor also keeps the server timer queue so the main loop can
+* 	sleep until the next socket event or timer deadline.
+* Classes:
+* 	Reactor
+* 	EpollReactor
+* 	IOThread
+\***************************************************************/
+
+#define KOALA_REACTOR_CXX "%A%"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <zthread/Guard.h>
+
+#include "main.hxx"
+#include "reactor.hxx"
+#include "network.hxx"
+#include "logging.hxx"
+
+namespace koalamud {
+
+/** Build an empty timer queue */
+Reactor::Reactor(void)
+	: runningtimer(NULL)
+{
+	timers.setAutoDelete(true);
+}
+
+/** Current monotonic time in milliseconds */
+unsigned long long Reactor::now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/** Wait for and dispatch socket events, then run any expired timers.
+ * @param maxwait Longest time to block in milliseconds, -1 to wait until
+ * 								the next event or timer
+ * @return Number of socket events dispatched, or -1 on a fatal error
+ */
+int Reactor::poll(int maxwait = -1)
+{
+	int count = wait(nextTimeout(maxwait));
+	if (count >= 0)
+		runTimers();
+	return count;
+}
+
+/** Schedule a timer task
+ * @param task Task to run on the reactor thread.  The caller keeps ownership.
+ * @param msec Milliseconds until the task runs
+ * @param repeat Run again every @a msec milliseconds until removeTimer()
+ */
+void Reactor::addTimer(ZThread::Runnable *task, unsigned int msec,
+											 bool repeat = false)
+{
+	timerent_t *timer = new timerent_t;
+	timer->deadline = now() + msec;
+	timer->interval = repeat ? msec : 0;
+	timer->task = task;
+
+	timerlock.acquire();
+	queueTimer(timer);
+	bool first = (timers.getFirst() == timer);
+	timerlock.release();
+
+	/* The reactor may be sleeping past our deadline */
+	if (first)
+		wakeup();
+}
+
+/** Cancel every pending timer for a task
+ * This is safe to call from inside the task itself; a repeating timer will
+ * not be requeued. */
+void Reactor::removeTimer(ZThread::Runnable *task)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(timerlock);
+
+	if (runningtimer && runningtimer->task == task)
+		runningtimer->interval = 0;
+
+	timerent_t *cur = timers.first();
+	while (cur)
+	{
+		if (cur->task == task)
+		{
+			timers.remove();
+			cur = timers.current();
+		} else {
+			cur = timers.next();
+		}
+	}
+}
+
+/** Insert a timer into the queue in deadline order
+ * @note timerlock must be held by the caller */
+void Reactor::queueTimer(timerent_t *timer)
+{
+	unsigned int pos = 0;
+	timerent_t *cur;
+	for (cur = timers.first(); cur; cur = timers.next(), pos++)
+	{
+		if (cur->deadline > timer->deadline)
+			break;
+	}
+	timers.insert(pos, timer);
+}
+
+/** Work out how long poll() can block
+ * @return The smaller of @a maxwait and the time to the first timer
+ */
+int Reactor::nextTimeout(int maxwait)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(timerlock);
+
+	timerent_t *first = timers.getFirst();
+	if (first == NULL)
+		return maxwait;
+
+	unsigned long long cur = now();
+	int untilnext = 0;
+	if (first->deadline > cur)
+		untilnext = (int)(first->deadline - cur);
+
+	if (maxwait < 0 || untilnext < maxwait)
+		return untilnext;
+	return maxwait;
+}
+
+/** Run every timer whose deadline has passed
+ * Repeating timers are requeued relative to their old deadline so that a
+ * late pass doesn't make the interval drift.
+ */
+void Reactor::runTimers(void)
+{
+	unsigned long long cur = now();
+
+	timerlock.acquire();
+	timerent_t *first;
+	while ((first = timers.getFirst()) != NULL && first->deadline <= cur)
+	{
+		timers.setAutoDelete(false);
+		timers.removeFirst();
+		timers.setAutoDelete(true);
+
+		/* Don't hold the lock while the task runs; it may add timers */
+		runningtimer = first;
+		timerlock.release();
+		first->task->run();
+		timerlock.acquire();
+		runningtimer = NULL;
+
+		if (first->interval)
+		{
+			first->deadline += first->interval;
+			if (first->deadline <= cur)
+				first->deadline = cur + first->interval;
+			queueTimer(first);
+		} else {
+			delete first;
+		}
+	}
+	timerlock.release();
+}
+
+/** Create the reactor backend for this platform */
+Reactor *Reactor::create(void)
+{
+	EpollReactor *er = new EpollReactor;
+	if (!er->isValid())
+	{
+		delete er;
+		return NULL;
+	}
+	return er;
+}
+
+/** Create the epoll descriptor and the wakeup eventfd */
+EpollReactor::EpollReactor(void)
+	: _wakefd(-1), _nevents(0)
+{
+	if ((_epfd = epoll_create(maxevents)) < 0)
+	{
+		cerr << "Failed to create epoll descriptor for reactor" << endl;
+		return;
+	}
+
+	if ((_wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		cerr << "Failed to create wakeup eventfd for reactor" << endl;
+		return;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = this;
+	epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &ev);
+}
+
+/** Close the epoll and wakeup descriptors */
+EpollReactor::~EpollReactor(void)
+{
+	if (_wakefd >= 0)
+		close(_wakefd);
+	if (_epfd >= 0)
+		close(_epfd);
+}
+
+/** Interrupt a blocked epoll_wait */
+void EpollReactor::wakeup(void)
+{
+	unsigned long long one = 1;
+	write(_wakefd, &one, sizeof(one));
+}
+
+/** Issue an epoll_ctl call for a socket
+ * @param op EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ * @param sock Socket to update
+ * @param wantwrite Include EPOLLOUT in the interest set
+ */
+bool EpollReactor::control(int op, Socket *sock, bool wantwrite)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (wantwrite)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = sock;
+
+	return (epoll_ctl(_epfd, op, sock->getSock(), &ev) == 0);
+}
+
+/** Register a socket for read events */
+bool EpollReactor::addSocket(Socket *sock)
+{
+	sock->_wantwrite = false;
+	if (!control(EPOLL_CTL_ADD, sock, false))
+	{
+		QString str;
+		QTextOStream os(&str);
+		os << "Unable to add socket " << sock->getSock() << " to reactor: "
+			 << strerror(errno);
+		Logger::msg(str, Logger::LOG_ERROR);
+		return false;
+	}
+	return true;
+}
+
+/** Unregister a socket
+ * Any events for the socket that were fetched but not yet dispatched are
+ * dropped so that a socket deleted by an earlier handler in the same batch is
+ * never called into.
+ */
+void EpollReactor::removeSocket(Socket *sock)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(_lock);
+
+	struct epoll_event ev;
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, sock->getSock(), &ev);
+
+	for (int i = 0; i < _nevents; i++)
+	{
+		if (_events[i].data.ptr == sock)
+			_events[i].data.ptr = NULL;
+	}
+}
+
+/** Turn write notification on or off
+ * This only touches the kernel when the interest actually changes.  Callers
+ * must serialize calls for a given socket (Descriptor uses its output buffer
+ * lock).
+ */
+void EpollReactor::setWriteInterest(Socket *sock, bool wantwrite)
+{
+	if (sock->_wantwrite == wantwrite)
+		return;
+
+	sock->_wantwrite = wantwrite;
+	control(EPOLL_CTL_MOD, sock, wantwrite);
+}
+
+/** Re-arm an edge triggered socket
+ * EPOLL_CTL_MOD makes the kernel re-check readiness, which produces a fresh
+ * edge if unread data is still waiting on the socket.
+ */
+void EpollReactor::rearm(Socket *sock)
+{
+	control(EPOLL_CTL_MOD, sock, sock->_wantwrite);
+}
+
+/** Wait for events and dispatch them
+ * Errors and hangups delete the socket.  Otherwise reads are dispatched
+ * before writes so that anything a read queues can go out on the same pass.
+ */
+int EpollReactor::wait(int timeout)
+{
+	int count = epoll_wait(_epfd, _events, maxevents, timeout);
+	if (count < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+		return -1;
+	}
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(_lock);
+	_nevents = count;
+
+	for (int i = 0; i < count; i++)
+	{
+		Socket *sock = (Socket *)_events[i].data.ptr;
+		unsigned int ev = _events[i].events;
+
+		/* Removed by an earlier handler in this batch */
+		if (sock == NULL)
+			continue;
+
+		/* Cross thread wakeup - just drain the counter */
+		if (_events[i].data.ptr == this)
+		{
+			unsigned long long val;
+			read(_wakefd, &val, sizeof(val));
+			continue;
+		}
+
+		if (ev & EPOLLIN)
+		{
+			sock->dispatchRead();
+			if (_events[i].data.ptr == NULL)
+				continue;
+		}
+
+		if (ev & EPOLLOUT)
+		{
+			sock->doWrite();
+			if (_events[i].data.ptr == NULL)
+				continue;
+		}
+
+		if (ev & (EPOLLERR | EPOLLHUP))
+		{
+			/* Close any sockets in error */
+			delete sock;
+		}
+	}
+
+	_nevents = 0;
+	return count;
+}
+
+/** Service our reactor until the server shuts down.
+ * MainServer::Shutdown wakes every reactor so we notice promptly. */
+void IOThread::run(void)
+{
+	while (!srv->isShuttingDown())
+	{
+		if (_reactor->poll() < 0)
+		{
+			Logger::msg("I/O thread reactor failed, thread exiting",
+									Logger::LOG_CRITICAL);
+			return;
+		}
+	}
+}
+
+}; /* end koalamud namespace */
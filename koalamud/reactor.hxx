@@ -0,0 +1,171 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: CORE/Reactor
+* Description:
+* 	Socket event demultiplexing.  Sockets register with a reactor
+* 	once when they are created and the reactor calls back into
+* 	dispatchRead/doWrite when the kernel reports activity.  The
+* 	reactor also keeps the server timer queue so the main loop can
+* 	sleep until the next socket event or timer deadline.
+* Classes:
+* 	Reactor
+* 	EpollReactor
+* 	IOThread
+\***************************************************************/
+
+#ifndef KOALA_REACTOR_HXX
+#define KOALA_REACTOR_HXX "%A%"
+
+#include <sys/epoll.h>
+#include <qptrlist.h>
+#include <zthread/FastRecursiveMutex.h>
+#include <zthread/Runnable.h>
+
+namespace koalamud {
+
+/* Predefine socket */
+class Socket;
+
+/** Event reactor base class
+ * A reactor owns the set of sockets the server is watching and dispatches
+ * read, write and error events to them.  Unlike the old select() loop, the
+ * interest set lives in the kernel, so nothing has to be rebuilt on each pass
+ * through the main loop.  Sockets always have read interest; write interest
+ * is switched on and off with setWriteInterest() as output is queued and
+ * drained.
+ *
+ * Backends are chosen by create().  Only epoll is provided at the moment.
+ *
+ * Timers are kept here as well.  poll() sleeps until the first of: a socket
+ * event, the earliest timer deadline, the caller's maximum wait, or a
+ * wakeup() from another thread.  Timer tasks run on the reactor thread after
+ * socket events have been dispatched.  The reactor does not take ownership
+ * of timer tasks.
+ */
+class Reactor
+{
+	protected:
+		/** Timer queue entry */
+		typedef struct {
+			/** Monotonic deadline in milliseconds */
+			unsigned long long deadline;
+			/** Repeat interval in milliseconds, 0 for one shot timers */
+			unsigned int interval;
+			/** Task to run when the timer expires */
+			ZThread::Runnable *task;
+		} timerent_t;
+
+	public:
+		Reactor(void);
+		/** Empty virtual destructor */
+		virtual ~Reactor(void) {}
+
+		/** Start watching a socket for events */
+		virtual bool addSocket(Socket *sock) = 0;
+		/** Stop watching a socket.  Safe to call while dispatching events. */
+		virtual void removeSocket(Socket *sock) = 0;
+		/** Turn write notification for a socket on or off */
+		virtual void setWriteInterest(Socket *sock, bool wantwrite) = 0;
+		/** Ask for another read notification if data is still queued in the
+		 * kernel.  Used when a socket stopped reading early on a full buffer. */
+		virtual void rearm(Socket *sock) = 0;
+		/** Wake a thread blocked in poll() from any other thread */
+		virtual void wakeup(void) = 0;
+
+		int poll(int maxwait = -1);
+
+		void addTimer(ZThread::Runnable *task, unsigned int msec,
+									bool repeat = false);
+		void removeTimer(ZThread::Runnable *task);
+
+		static Reactor *create(void);
+		static unsigned long long now(void);
+
+	protected:
+		/** Wait up to @a timeout milliseconds for events and dispatch them.
+		 * @return Number of events dispatched, or -1 on a fatal error */
+		virtual int wait(int timeout) = 0;
+
+		int nextTimeout(int maxwait);
+		void runTimers(void);
+		void queueTimer(timerent_t *timer);
+
+	protected:
+		/** Pending timers sorted by deadline */
+		QPtrList<timerent_t> timers;
+		/** Protects the timer queue */
+		ZThread::FastRecursiveMutex timerlock;
+		/** Timer whose task is running right now, if any */
+		timerent_t *runningtimer;
+};
+
+/** Edge triggered epoll backend
+ * Sockets are registered with EPOLLET, so a notification only arrives when
+ * new data shows up.  Handlers are expected to read or accept until the
+ * kernel returns EAGAIN.
+ */
+class EpollReactor : public Reactor
+{
+	public:
+		/** Maximum number of events fetched per epoll_wait call */
+		static const int maxevents = 256;
+
+	public:
+		EpollReactor(void);
+		virtual ~EpollReactor(void);
+
+		/** Return true if the epoll and wakeup descriptors were created */
+		bool isValid(void) const { return (_epfd >= 0 && _wakefd >= 0); }
+
+		virtual bool addSocket(Socket *sock);
+		virtual void removeSocket(Socket *sock);
+		virtual void setWriteInterest(Socket *sock, bool wantwrite);
+		virtual void rearm(Socket *sock);
+		virtual void wakeup(void);
+
+	protected:
+		virtual int wait(int timeout);
+		bool control(int op, Socket *sock, bool wantwrite);
+
+	protected:
+		/** epoll descriptor */
+		int _epfd;
+		/** eventfd used by wakeup().  Registered with this reactor as the
+		 * event data so it can't collide with a Socket pointer. */
+		int _wakefd;
+		/** Events returned by the last epoll_wait */
+		struct epoll_event _events[maxevents];
+		/** Number of valid entries in _events */
+		int _nevents;
+		/** Held while dispatching so removeSocket can clear stale events */
+		ZThread::FastRecursiveMutex _lock;
+};
+
+/** I/O thread task
+ * Runs a reactor loop on a thread from the I/O executor until the server
+ * shuts down.  Each I/O thread has its own reactor with its own listeners,
+ * and every descriptor stays on the thread that accepted it.
+ */
+class IOThread : public ZThread::Runnable
+{
+	public:
+		/** Build an I/O thread task for @a reactor */
+		IOThread(Reactor *reactor) : _reactor(reactor) {}
+		/** Empty virtual destructor */
+		virtual ~IOThread(void) {}
+		virtual void run(void);
+
+	protected:
+		/** Reactor this thread services */
+		Reactor *_reactor;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_REACTOR_HXX
@@ -15,10 +15,12 @@
 #define KOALA_ROOM_CXX "%A%"
 
 #include <qregexp.h>
+#include <qsqlquery.h>
 
 #include "room.hxx"
 #include "roomedit.hxx"
 #include "logging.hxx"
+#include "worldsnap.hxx"
 #include "cmdtree.hxx"
 
 namespace koalamud {
@@ -38,7 +40,6 @@ static QMap<Room::directions, QString> Roomdirtostringmap;
 /** Map direction to its opposite */
 static QMap<Room::directions, Room::directions> Roomdiroppositemap;
 
-
 /** Load a room by its coordinate reference.
  * This is the standard constructor.  The default values will create a new
  * room for OLC, Any other coordinates load the room from the database or find
@@ -49,14 +50,15 @@ static QMap<Room::directions, Room::directions> Roomdiroppositemap;
  * @param zone Zone of the room, only used for new rooms
  */
 Room::Room(int zone, int lat, int longi, int ele)
-	: _virtual(false), _zone(zone), _lat(lat), _long(longi), _elev(ele)
+	: _virtual(false), _zone(zone), _lat(lat), _long(longi), _elev(ele),
+		_zoneinfo(NULL)
 {
 	for (int d = DIR_NORTH; d <= DIR_DOWN; d++)
 		exits[d] = NULL;
 
 	load();
 
-	RoomMap.insert(getRef(zone, lat, longi, ele), this);
+	indexRoom();
 }
 
 /** Virtual Room (not saved) - used for generating mazes and other dynamic
@@ -73,23 +75,62 @@ Room::Room(QString title, QString desc, QString smell, QString sound,
 	: _title(title), _description(desc), _smell(smell), _sound(sound),
 		_soundfile(soundfile), _virtual(true),
 		_zone(zone), _lat(lat), _long(longi), _elev(elev),
-		_plrlimit(plrlimit), _flags(flags), _rtype(rtype)
+		_plrlimit(plrlimit), _flags(flags), _rtype(rtype), _zoneinfo(NULL)
+{
+	for (int d = DIR_NORTH; d <= DIR_DOWN; d++)
+		exits[d] = NULL;
+
+	indexRoom();
+}
+
+/** Build a room from a row already read from the database
+ * Used by loadWorldRooms so that the whole room table can be loaded in a
+ * single pass instead of a query per room.
+ */
+Room::Room(int zone, int lat, int longi, int ele, QString title,
+						QString desc, unsigned int rflags, type_t rtype,
+						unsigned int plrlimit)
+	: _title(title), _description(desc), _virtual(false),
+		_zone(zone), _lat(lat), _long(longi), _elev(ele),
+		_plrlimit(plrlimit), _flags(rflags), _rtype(rtype), _zoneinfo(NULL)
 {
 	for (int d = DIR_NORTH; d <= DIR_DOWN; d++)
 		exits[d] = NULL;
 
-	RoomMap.insert(getRef(zone, lat, longi, elev), this);
+	indexRoom();
 }
 
 /** Destructor - Save room if needed and free memory */
 Room::~Room()
 {
-	RoomMap.remove(getRef(_zone, _lat, _long, _elev));
+	unindexRoom();
 
 	for (int d = DIR_NORTH; d <= DIR_DOWN; d++)
 		delete exits[d];
 }
 
+/** Add the room to RoomMap and WorldGrid under its current coordinates */
+void Room::indexRoom(void)
+{
+	WorldGrid.add(this);
+	if (RoomMap.insert(_zone, _lat, _long, _elev, this))
+		return;
+
+	QString log;
+	QTextOStream out(&log);
+	out << "Room " << getRef(_zone, _lat, _long, _elev)
+			<< " is out of range for the room index";
+	Logger::msg(log, Logger::LOG_ERROR);
+}
+
+/** Take the room out of RoomMap and WorldGrid
+ * Must be called before the room's coordinates change. */
+void Room::unindexRoom(void)
+{
+	RoomMap.remove(_zone, _lat, _long, _elev, this);
+	WorldGrid.remove(this);
+}
+
 /** Load a room from the database
  * @note This is only for non-virtual rooms
  */
@@ -389,18 +430,48 @@ void Room::sendToRoom(Char *from, Char *to, QString msg, QString fromtmpl,
  */
 void Room::moveRoom(int zone, int lat, int longi, int elev)
 {
-	RoomMap.remove(getRef(_zone, _lat, _long, _elev));
+	unindexRoom();
 	_zone = zone;
 	_lat = lat;
 	_long = longi;
 	_elev = elev;
-	RoomMap.insert(getRef(zone, lat, longi, elev), this);
+	indexRoom();
 }
 
-/** Find a room in the Room Map */
+/** Find a room in the Room Map
+ * When zones are paged a miss loads the room's zone and looks again.
+ */
 Room *Room::findRoom(int zone, int lat, int longi, int elev)
 {
-	return RoomMap[getRef(zone, lat, longi, elev)];
+	Room *room = RoomMap.find(zone, lat, longi, elev);
+	if (room || !ZoneManager::instance()->isPaging())
+		return room;
+	return ZoneManager::instance()->page(zone, lat, longi, elev);
+}
+
+/** Map a direction name from the database to its direction number
+ * This only reads the map, so it is safe to call from the database workers
+ * once initializeMaps has run.  Unknown names map to DIR_NORTH.
+ */
+Room::directions Room::stringToDir(QString dir)
+{
+	const QMap<QString, Room::directions> &dirmap = Roomstringtodirmap;
+	QMap<QString, Room::directions>::ConstIterator it = dirmap.find(dir.upper());
+	if (it == dirmap.end())
+		return DIR_NORTH;
+	return it.data();
+}
+
+/** Return the direction opposite @a dir
+ * Like stringToDir this only reads the map. */
+Room::directions Room::oppositeDir(directions dir)
+{
+	const QMap<Room::directions, Room::directions> &oppmap = Roomdiroppositemap;
+	QMap<Room::directions, Room::directions>::ConstIterator it =
+					oppmap.find(dir);
+	if (it == oppmap.end())
+		return dir;
+	return it.data();
 }
 
 /** Initialize Mappings for Room enum types */
@@ -478,32 +549,79 @@ void Room::loadWorldRooms(void)
 	Room::initializeMaps();
 	RoomExit::initializeMaps();
 
-	QString query("select zone, latitude, longitude, elevation from room");
+	unsigned int roomcount = 0, exitcount = 0;
 	QSqlQuery q;
 
-	/* Load rooms */
-	q.exec(query);
+	/* Load rooms.  One forward only pass over the table builds every room
+	 * straight from its row. */
+	q.setForwardOnly(true);
+	if (!q.exec("select zone, latitude, longitude, elevation, title,\n"
+							"description, flags+0, type+0, plrlimit from room;"))
+	{
+		Logger::msg("Unable to load world rooms", Logger::LOG_CRITICAL);
+		return;
+	}
 	while (q.next())
 	{
 		new Room(q.value(0).toInt(), q.value(1).toInt(), q.value(2).toInt(),
-							q.value(3).toInt());
+						 q.value(3).toInt(), q.value(4).toString(), q.value(5).toString(),
+						 q.value(6).toUInt(), (type_t)q.value(7).toInt(),
+						 q.value(8).toUInt());
+		roomcount++;
 	}
 
 	/* Load exits */
-	QTextOStream qos(&query);
-	qos << "select r1zone, r1lat, r1long, r1elev," << endl
-			<< "r2zone, r2lat, r2long, r2elev, name, keyobj, flags+0," << endl
-			<< "direction from roomexits;";
-	q.exec(query);
+	q.setForwardOnly(true);
+	if (!q.exec("select r1zone, r1lat, r1long, r1elev,\n"
+							"r2zone, r2lat, r2long, r2elev, name, keyobj, flags+0,\n"
+							"direction from roomexits;"))
+	{
+		Logger::msg("Unable to load world room exits", Logger::LOG_CRITICAL);
+		return;
+	}
 	while (q.next())
 	{
-		RoomExit::makeExits(q.value(0).toInt(), q.value(1).toInt(),
-						q.value(2).toInt(), q.value(3).toInt(),
-						q.value(4).toInt(), q.value(5).toInt(),
-						q.value(6).toInt(), q.value(7).toInt(),
-						q.value(8).toString(), q.value(9).toInt(),
-						q.value(10).toUInt(), q.value(11).toString());
+		Room *r1 = findRoom(q.value(0).toInt(), q.value(1).toInt(),
+												q.value(2).toInt(), q.value(3).toInt());
+		Room *r2 = findRoom(q.value(4).toInt(), q.value(5).toInt(),
+												q.value(6).toInt(), q.value(7).toInt());
+		if (!r1 || !r2)
+			continue;
+
+		RoomExit::makeExits(r1, r2, q.value(8).toString(),
+												q.value(9).toInt(), q.value(10).toUInt(),
+												q.value(11).toString());
+		exitcount++;
 	}
+
+	QString str;
+	QTextOStream os(&str);
+	os << "Loaded " << roomcount << " rooms and " << exitcount << " exits";
+	Logger::msg(str, Logger::LOG_INFO);
+}
+
+/** Initialize a room exit to a loaded room */
+RoomExit::RoomExit(Room *destroom, int exitflags, QString name=NULL,
+									 unsigned int keyobj=0)
+	: _name(name), dest(RoomIndex::emptykey), flags(exitflags), keynum(keyobj)
+{
+	if (destroom)
+		RoomIndex::packKey(destroom->getZone(), destroom->getLat(),
+											 destroom->getLong(), destroom->getElev(), dest);
+}
+
+/** Return pointer to destination room or NULL if the door is closed
+ * The room is looked up by coordinates, which pages its zone back in if it
+ * has been evicted.
+ */
+Room *RoomExit::getDest(void)
+{
+	if (flags[FLAG_CLOSED] || dest == RoomIndex::emptykey)
+		return NULL;
+
+	int zone, lat, longi, elev;
+	RoomIndex::unpackKey(dest, zone, lat, longi, elev);
+	return Room::findRoom(zone, lat, longi, elev);
 }
 
 /** Create exits and attach them to the appropriate rooms */
@@ -512,9 +630,29 @@ void RoomExit::makeExits(int r1zone, int r1lat, int r1long, int r1elev,
 												 QString name, int keyobj, unsigned int flagval,
 												 QString dir)
 {
-	Room *r1 = Room::findRoom(r1zone, r1lat, r1long, r1elev);
-	Room *r2 = Room::findRoom(r2zone, r2lat, r2long, r2elev);
+	makeExits(Room::findRoom(r1zone, r1lat, r1long, r1elev),
+						Room::findRoom(r2zone, r2lat, r2long, r2elev),
+						name, keyobj, flagval, dir);
+}
+
+/** Create exits between two rooms we already have pointers for
+ * @param dir Direction name of the exit from @a r1
+ */
+void RoomExit::makeExits(Room *r1, Room *r2, QString name, int keyobj,
+												 unsigned int flagval, QString dir)
+{
+	makeExits(r1, r2, name, keyobj, flagval, (int)Room::stringToDir(dir));
+}
 
+/** Create exits between two rooms we already have pointers for
+ * @param r1 Room the exit leads from
+ * @param r2 Room the exit leads to
+ * @param dir Direction of the exit from @a r1.  Two way exits also get an
+ * 						exit back from @a r2 in the opposite direction.
+ */
+void RoomExit::makeExits(Room *r1, Room *r2, QString name, int keyobj,
+												 unsigned int flagval, int dir)
+{
 	/* Make sure we have both room pointers */
 	if (!r1 || !r2)
 	{
@@ -527,7 +665,7 @@ void RoomExit::makeExits(int r1zone, int r1lat, int r1long, int r1elev,
 		twoway = true;
 	}
 
-	Room::directions direction = Roomstringtodirmap[dir.upper()];
+	Room::directions direction = (Room::directions)dir;
 	Room::directions odir = Roomdiroppositemap[direction];
 
 	r1->attachExit(new RoomExit(r2, flagval, name, keyobj), direction);
@@ -644,8 +782,10 @@ void RoomOLC::save(void)
 	{
 		thisroom->load();
 	} else {
-		new Room(ezone, elat, elong, eelev);
+		ZoneManager::instance()->adopt(new Room(ezone, elat, elong, eelev));
 	}
+
+	WorldSnapshot::instance()->changed();
 }
 
 /** Load a room from the database for OLC */
@@ -733,6 +873,17 @@ class Move : public Command
 				return false;
 			}
 
+			/* Resolve the other end once - with zone paging this may load it */
+			Room *dest = exit->getDest();
+			if (!dest)
+			{
+				QString out;
+				QTextOStream os(&out);
+				os << endl << "You cannot move in that direction." << endl;
+				_ch->sendtochar(out);
+				return false;
+			}
+
 			/** If we get to here, then we have a good exit.
 			 * Go ahead and send out a string to the room we are leaving.
 			 */
@@ -754,15 +905,15 @@ class Move : public Command
 																		fromtmpl, NULL, roomtmpl);
 
 				_ch->getRoom()->leaveRoom(_ch);
-				exit->getDest()->enterRoom(_ch);
-				_ch->setRoom(exit->getDest());
+				dest->enterRoom(_ch);
+				_ch->setRoom(dest);
 				_ch->sendtochar(_ch->getRoom()->displayRoom(_ch, false));
 
 				/** Prepare and send message to new room */
 				QString roomtmpl2;
 				QTextOStream os3(&roomtmpl2);
 				os3 << endl << "|W%sender% arrives from the %message%.|x" << endl;
-				exit->getDest()->sendToRoom(_ch, NULL, odirString,
+				dest->sendToRoom(_ch, NULL, odirString,
 																		NULL, NULL, roomtmpl2);
 			}
 
@@ -947,6 +1098,92 @@ class RoomEdit : public Move
 		}
 };
 
+/** RoomsNear command class
+ * Builder tool listing the rooms around the character's room.
+ * roomsnear [radius] [elevations]
+ */
+class RoomsNear : public Command
+{
+	public:
+		/** Most rooms we list */
+		static const unsigned int maxlisted = 50;
+		/** Largest radius we search */
+		static const int maxradius = 100;
+		/** Most elevations we search above and below */
+		static const int maxelevrange = 10;
+
+	public:
+		/** Pass through constructor */
+		RoomsNear(Char *ch) : Command(ch) {}
+		/** Run RoomsNear command */
+		virtual unsigned int run(QString args)
+		{
+			QString str;
+			QTextOStream os(&str);
+			Room *here = _ch->getRoom();
+
+			if (here == NULL)
+			{
+				os << "You aren't in a room." << endl;
+				_ch->sendtochar(str);
+				return 1;
+			}
+
+			int radius = args.section(' ', 0, 0).toInt();
+			int elevrange = args.section(' ', 1, 1).toInt();
+			if (radius <= 0)
+				radius = 5;
+			if (elevrange < 0)
+				elevrange = 0;
+			if (radius > maxradius)
+			{
+				os << "Radius limited to " << maxradius << "." << endl;
+				radius = maxradius;
+			}
+			if (elevrange > maxelevrange)
+			{
+				os << "Elevation range limited to " << maxelevrange << "." << endl;
+				elevrange = maxelevrange;
+			}
+
+			QPtrList<Room> rooms = WorldGrid.inRadius(here->getZone(),
+							here->getElev(), here->getLat(), here->getLong(), radius,
+							elevrange);
+
+			os << "|G" << rooms.count() << "|x rooms within " << radius
+				 << " of " << Room::getRef(here->getZone(), here->getLat(),
+																	 here->getLong(), here->getElev())
+				 << ":" << endl;
+			unsigned int listed = 0;
+			QPtrListIterator<Room> room(rooms);
+			for (; *room && listed < maxlisted; ++room, ++listed)
+			{
+				os << "|B" << Room::getRef((*room)->getZone(), (*room)->getLat(),
+																	 (*room)->getLong(), (*room)->getElev())
+					 << "|x " << (*room)->getTitle() << endl;
+			}
+			if (rooms.count() > listed)
+				os << "(" << rooms.count() - listed << " more not shown)" << endl;
+
+			_ch->sendtochar(str);
+			return 0;
+		}
+
+		/** Restricted access command. */
+		virtual bool isRestricted(void) const { return true;}
+
+		/** Command Groups */
+		virtual QStringList getCmdGroups(void) const
+		{
+			QStringList gl;
+			gl << "Implementor" << "Builder";
+			return gl;
+		}
+
+		/** Get command name for individual granting */
+		virtual QString getCmdName(void) const { return QString("roomsnear"); }
+};
+
 }; /* end commands namespace */
 
 /** Command Factory for cmd.cpp */
@@ -978,6 +1215,7 @@ class Room_CPP_CommandFactory : public CommandFactory
 			maincmdtree->addcmd("down", this, 11);
 			maincmdtree->addcmd("d", this, 11);
 			olccmdtree->addcmd("room", this, 12);
+			immcmdtree->addcmd("roomsnear", this, 14);
 		}
 
 		/** Handle command object creations */
@@ -1009,6 +1247,8 @@ class Room_CPP_CommandFactory : public CommandFactory
 					return new koalamud::commands::Down(ch);
 				case 12:
 					return new koalamud::commands::RoomEdit(ch);
+				case 14:
+					return new koalamud::commands::RoomsNear(ch);
 			}
 			return NULL;
 		}
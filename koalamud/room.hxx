@@ -22,6 +22,9 @@
 #include <zthread/FastRecursiveMutex.h>
 
 #include "memory.hxx"
+#include "roomindex.hxx"
+#include "roomgrid.hxx"
+#include "zonemgr.hxx"
 
 /* Predefine classes */
 namespace koalamud {
@@ -70,31 +73,35 @@ class RoomExit
 		} flag_t;
 
 	public:
-		/** Initialize a room exit */
 		RoomExit(Room *destroom, int exitflags, QString name=NULL,
+							unsigned int keyobj=0);
+		/** Initialize a room exit to a room that may not be loaded yet */
+		RoomExit(RoomIndex::roomkey_t destkey, int exitflags, QString name=NULL,
 							unsigned int keyobj=0)
-			: _name(name), dest(destroom), flags(exitflags), keynum(keyobj)
+			: _name(name), dest(destkey), flags(exitflags), keynum(keyobj)
 		{}
 		static void makeExits(int, int, int, int,
 													int, int, int, int,
 													QString, int, unsigned int, QString);
+		static void makeExits(Room *, Room *, QString, int, unsigned int,
+													QString);
+		static void makeExits(Room *, Room *, QString, int, unsigned int, int);
 		static void initializeMaps(void);
 		
 	public: /* Operators */
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_EXIT); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_EXIT); }
 
 	public:
 		/** Is the exit visible */
 		bool isVisible(void) const { return (!(flags[FLAG_HIDDEN]));}
 		/** Return true if a flag is set */
 		bool isSet(flag_t flag) const { return (flags[flag]);}
-		/** Return pointer to destination room or NULL if the door is closed */
-		Room *getDest(void) { if (flags[FLAG_CLOSED]) return NULL; return dest;}
+		Room *getDest(void);
 		/** Toggle flag and return new state */
 		bool toggleFlag(flag_t flag)
 			{ flags[flag] = !flags[flag];
@@ -102,7 +109,9 @@ class RoomExit
 
 	protected:
 		QString _name; /**< Exit name (used in the case of doors */
-		Room *dest; /**< Other end of this link */
+		/** Coordinates of the other end of this link.  The room is looked up
+		 * when the exit is used so it can be paged out in the meantime. */
+		RoomIndex::roomkey_t dest;
 		bitset<FLAG_ENDLIST> flags; /**< Exit flags */
 		unsigned int keynum; /**< Object ID that is key */
 };
@@ -117,6 +126,9 @@ class RoomExit
  */
 class Room
 {
+	friend class WorldSnapshot;
+	friend class ZoneManager;
+
 	public:
 		/** Room Flags.
 		 * The list of all flags possible to be set on a room
@@ -192,28 +204,37 @@ class Room
 						unsigned int plrlimit=0);
 		virtual ~Room();
 
+	protected:
+		Room(int, int, int, int, QString, QString,
+						unsigned int, type_t, unsigned int);
+		void indexRoom(void);
+		void unindexRoom(void);
+
+	public:
 		virtual bool load(void);
 		virtual bool save(void);
 
 	public: /* Operators */
 		/** Operator new overload */
 		void * operator new(size_t obj_size)
-			{ return koalamud::PoolAllocator::alloc(obj_size); }
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_ROOM); }
 		/** Operator delete overload */
 		void operator delete(void *ptr)
-			{ koalamud::PoolAllocator::free(ptr); }
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_ROOM); }
 
 	public:
 		/** Call to add a character to a room */
 		void enterRoom(Char *ch)
 			{ lock.acquire();
 				charsinroom.append(ch);
-				lock.release(); }
+				lock.release();
+				if (_zoneinfo) _zoneinfo->enter(); }
 		/** Call to remove a character from a room */
 		void leaveRoom(Char *ch)
 			{ lock.acquire();
-				charsinroom.remove(ch);
-				lock.release(); }
+				bool removed = charsinroom.remove(ch);
+				lock.release();
+				if (removed && _zoneinfo) _zoneinfo->leave(); }
 		void moveRoom(int, int, int, int);
 		QString displayRoom(Char *ch, bool brief=false);
 		void sendToRoom(Char *from, Char *to, QString msg, QString fromtmpl,
@@ -228,6 +249,8 @@ class Room
 		static Room *findRoom(int zone, int lat, int longi, int elev);
 		static void loadWorldRooms(void);
 		static void initializeMaps(void);
+		static directions stringToDir(QString dir);
+		static directions oppositeDir(directions dir);
 		/** Return a string representing a room location */
 		static QString getRef(int zone, int lat, int longi, int elev)
 			{ QString ref; QTextOStream os(&ref);
@@ -235,6 +258,8 @@ class Room
 				return ref; }
 
 	public:  /* Property gets */
+		/** Return room title */
+		QString getTitle(void) const { return _title; }
 		/** Return room zone */
 		int getZone(void) const { return _zone; }
 		/** Return room lat */
@@ -264,15 +289,22 @@ class Room
 		RoomExit *exits[DIR_DOWN+1];
 		/** List of chars in room */
 		QPtrList<Char> charsinroom;
+		/** Residency record of the zone that paged us in, NULL if the room
+		 * isn't managed by ZoneManager */
+		ResidentZone *_zoneinfo;
 };
 
 
 #ifdef KOALA_ROOM_CXX
-/** Map room references to Room pointers */
-QDict<Room> RoomMap(8388607);
+/** Map room coordinates to Room pointers */
+RoomIndex RoomMap;
+/** Spatial index of rooms for area queries */
+RoomGrid WorldGrid;
 #else
-/** Map room references to Room pointers */
-extern QDict<Room> RoomMap;
+/** Map room coordinates to Room pointers */
+extern RoomIndex RoomMap;
+/** Spatial index of rooms for area queries */
+extern RoomGrid WorldGrid;
 #endif
 
 }; /* end koalamud namespace */
@@ -0,0 +1,266 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/RoomGrid
+* Description:
+* 	Spatial index over room coordinates.  Rooms are grouped into
+* 	fixed size latitude/longitude chunks per zone and elevation so
+* 	area queries only look at the chunks they overlap.
+* Classes:
+* 	RoomGrid
+\***************************************************************/
+
+#define KOALA_ROOMGRID_CXX "%A%"
+
+#include <zthread/Guard.h>
+
+#include "roomgrid.hxx"
+#include "room.hxx"
+
+namespace koalamud {
+
+/** Build an empty grid */
+RoomGrid::RoomGrid(void)
+	: zones(101)
+{
+	zones.setAutoDelete(true);
+}
+
+/** Free the chunks.  The rooms themselves belong to someone else. */
+RoomGrid::~RoomGrid(void)
+{
+	QMap<RoomIndex::roomkey_t, Chunk *>::Iterator it;
+	for (it = chunks.begin(); it != chunks.end(); ++it)
+		delete it.data();
+}
+
+/** Work out the key for a chunk
+ * @return false if the chunk can't be keyed */
+bool RoomGrid::chunkKey(int zone, int elev, int latchunk, int longchunk,
+												RoomIndex::roomkey_t &key)
+{
+	return RoomIndex::packKey(zone, latchunk, longchunk, elev, key);
+}
+
+/** Find a chunk
+ * @return The chunk, or NULL if it holds no rooms
+ * @note gridlock must be held by the caller
+ */
+RoomGrid::Chunk *RoomGrid::findChunk(int zone, int elev, int latchunk,
+																		 int longchunk)
+{
+	RoomIndex::roomkey_t key;
+	if (!chunkKey(zone, elev, latchunk, longchunk, key))
+		return NULL;
+
+	QMap<RoomIndex::roomkey_t, Chunk *>::Iterator it = chunks.find(key);
+	if (it == chunks.end())
+		return NULL;
+	return it.data();
+}
+
+/** Add a room under its current coordinates */
+void RoomGrid::add(Room *room)
+{
+	RoomIndex::roomkey_t key;
+	if (!chunkKey(room->getZone(), room->getElev(), chunkOf(room->getLat()),
+								chunkOf(room->getLong()), key))
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(gridlock);
+
+	Chunk *chunk;
+	QMap<RoomIndex::roomkey_t, Chunk *>::Iterator it = chunks.find(key);
+	if (it == chunks.end())
+	{
+		chunk = new Chunk(key);
+		chunks.insert(key, chunk);
+
+		QPtrList<Chunk> *zonelist = zones.find(room->getZone());
+		if (zonelist == NULL)
+		{
+			zonelist = new QPtrList<Chunk>;
+			zones.insert(room->getZone(), zonelist);
+		}
+		zonelist->append(chunk);
+	} else {
+		chunk = it.data();
+	}
+
+	chunk->rooms.append(room);
+}
+
+/** Remove a room
+ * This must be called before the room's coordinates change. */
+void RoomGrid::remove(Room *room)
+{
+	RoomIndex::roomkey_t key;
+	if (!chunkKey(room->getZone(), room->getElev(), chunkOf(room->getLat()),
+								chunkOf(room->getLong()), key))
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(gridlock);
+
+	QMap<RoomIndex::roomkey_t, Chunk *>::Iterator it = chunks.find(key);
+	if (it == chunks.end())
+		return;
+
+	Chunk *chunk = it.data();
+	chunk->rooms.removeRef(room);
+	if (!chunk->rooms.isEmpty())
+		return;
+
+	/* Last room gone, drop the chunk */
+	chunks.remove(it);
+	QPtrList<Chunk> *zonelist = zones.find(room->getZone());
+	if (zonelist)
+	{
+		zonelist->removeRef(chunk);
+		if (zonelist->isEmpty())
+			zones.remove(room->getZone());
+	}
+	delete chunk;
+}
+
+/** Append the rooms of a chunk that fall inside a rectangle
+ * @note gridlock must be held by the caller
+ */
+void RoomGrid::collect(Chunk *chunk, int lat1, int long1, int lat2,
+											 int long2, QPtrList<Room> &out)
+{
+	QPtrListIterator<Room> room(chunk->rooms);
+	for (; *room; ++room)
+	{
+		int lat = (*room)->getLat();
+		int longi = (*room)->getLong();
+		if (lat >= lat1 && lat <= lat2 && longi >= long1 && longi <= long2)
+			out.append(*room);
+	}
+}
+
+/** Find the rooms in a latitude/longitude rectangle
+ * Corners are inclusive and may be given in either order.  If the rectangle
+ * covers more chunks than the zone has, the zone's chunk list is walked
+ * instead, so huge rectangles cost no more than inZone().
+ */
+QPtrList<Room> RoomGrid::inRect(int zone, int elev, int lat1, int long1,
+																int lat2, int long2)
+{
+	QPtrList<Room> out;
+
+	if (lat1 > lat2)
+	{
+		int tmp = lat1; lat1 = lat2; lat2 = tmp;
+	}
+	if (long1 > long2)
+	{
+		int tmp = long1; long1 = long2; long2 = tmp;
+	}
+
+	/* Nothing outside this can be in a chunk, and it keeps the chunk
+	 * loops short */
+	lat1 = clampCoord(lat1, maxlatlong);
+	lat2 = clampCoord(lat2, maxlatlong);
+	long1 = clampCoord(long1, maxlatlong);
+	long2 = clampCoord(long2, maxlatlong);
+
+	int latc1 = chunkOf(lat1), latc2 = chunkOf(lat2);
+	int longc1 = chunkOf(long1), longc2 = chunkOf(long2);
+	unsigned long long span = (unsigned long long)(latc2 - latc1 + 1) *
+														(longc2 - longc1 + 1);
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(gridlock);
+
+	QPtrList<Chunk> *zonelist = zones.find(zone);
+	if (zonelist == NULL)
+		return out;
+
+	if (span > zonelist->count())
+	{
+		QPtrListIterator<Chunk> chunk(*zonelist);
+		for (; *chunk; ++chunk)
+		{
+			int czone, clat, clong, celev;
+			RoomIndex::unpackKey((*chunk)->_key, czone, clat, clong, celev);
+			if (celev == elev && clat >= latc1 && clat <= latc2 &&
+					clong >= longc1 && clong <= longc2)
+				collect(*chunk, lat1, long1, lat2, long2, out);
+		}
+		return out;
+	}
+
+	for (int lc = latc1; lc <= latc2; lc++)
+	{
+		for (int oc = longc1; oc <= longc2; oc++)
+		{
+			Chunk *chunk = findChunk(zone, elev, lc, oc);
+			if (chunk)
+				collect(chunk, lat1, long1, lat2, long2, out);
+		}
+	}
+	return out;
+}
+
+/** Find the rooms within @a radius cells of a point
+ * Distance is measured in the latitude/longitude plane.  The search is
+ * limited to coordinates rooms can be indexed at, so huge arguments cost no
+ * more than the whole zone.
+ * @param elevrange Also search this many elevations above and below
+ */
+QPtrList<Room> RoomGrid::inRadius(int zone, int elev, int lat, int longi,
+																	int radius, int elevrange = 0)
+{
+	QPtrList<Room> out;
+	if (radius < 0 || elevrange < 0)
+		return out;
+
+	long long r2 = (long long)radius * radius;
+	int lat1 = clampCoord((long long)lat - radius, maxlatlong);
+	int lat2 = clampCoord((long long)lat + radius, maxlatlong);
+	int long1 = clampCoord((long long)longi - radius, maxlatlong);
+	int long2 = clampCoord((long long)longi + radius, maxlatlong);
+	int elev1 = clampCoord((long long)elev - elevrange, RoomIndex::maxcoord);
+	int elev2 = clampCoord((long long)elev + elevrange, RoomIndex::maxcoord);
+
+	for (int e = elev1; e <= elev2; e++)
+	{
+		QPtrList<Room> box = inRect(zone, e, lat1, long1, lat2, long2);
+		QPtrListIterator<Room> room(box);
+		for (; *room; ++room)
+		{
+			long long dlat = (long long)(*room)->getLat() - lat;
+			long long dlong = (long long)(*room)->getLong() - longi;
+			if (dlat * dlat + dlong * dlong <= r2)
+				out.append(*room);
+		}
+	}
+	return out;
+}
+
+/** Find every room in a zone */
+QPtrList<Room> RoomGrid::inZone(int zone)
+{
+	QPtrList<Room> out;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(gridlock);
+
+	QPtrList<Chunk> *zonelist = zones.find(zone);
+	if (zonelist == NULL)
+		return out;
+
+	QPtrListIterator<Chunk> chunk(*zonelist);
+	for (; *chunk; ++chunk)
+	{
+		QPtrListIterator<Room> room((*chunk)->rooms);
+		for (; *room; ++room)
+			out.append(*room);
+	}
+	return out;
+}
+
+}; /* end koalamud namespace */
@@ -0,0 +1,114 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/RoomGrid
+* Description:
+* 	Spatial index over room coordinates.  Rooms are grouped into
+* 	fixed size latitude/longitude chunks per zone and elevation so
+* 	area queries only look at the chunks they overlap.
+* Classes:
+* 	RoomGrid
+\***************************************************************/
+
+#ifndef KOALA_ROOMGRID_HXX
+#define KOALA_ROOMGRID_HXX "%A%"
+
+#include <qintdict.h>
+#include <qmap.h>
+#include <qptrlist.h>
+#include <zthread/FastRecursiveMutex.h>
+
+#include "memory.hxx"
+#include "roomindex.hxx"
+
+namespace koalamud {
+
+class Room;
+
+/** Spatial room index
+ * Each chunk covers chunksize x chunksize latitude/longitude cells of a
+ * single zone and elevation.  Chunks are created when their first room is
+ * added and dropped with their last one, and every zone keeps a list of its
+ * chunks, so the cost of a query depends on the area asked for and not on the
+ * size of the world.
+ *
+ * Queries return a list of room pointers that is only good until the rooms
+ * change, the same as Room::findRoom.
+ */
+class RoomGrid
+{
+	public:
+		/** log2 of the chunk width */
+		static const int chunkbits = 4;
+		/** Chunk width in latitude/longitude cells */
+		static const int chunksize = 1 << chunkbits;
+		/** Largest latitude/longitude magnitude a chunk can be keyed for */
+		static const int maxlatlong = ((RoomIndex::maxcoord + 1) << chunkbits) - 1;
+
+	protected:
+		/** Rooms in one chunk */
+		class Chunk
+		{
+			public:
+				/** Build an empty chunk */
+				Chunk(RoomIndex::roomkey_t key) : _key(key) {}
+
+				/** Chunk key */
+				RoomIndex::roomkey_t _key;
+				/** Rooms in the chunk */
+				QPtrList<Room> rooms;
+
+			public:
+				/** Operator new overload */
+				void * operator new(size_t obj_size)
+					{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_WORLD); }
+				/** Operator delete overload */
+				void operator delete(void *ptr)
+					{ koalamud::PoolAllocator::free(ptr, MEMTAG_WORLD); }
+		};
+
+	public:
+		RoomGrid(void);
+		~RoomGrid(void);
+
+		void add(Room *room);
+		void remove(Room *room);
+
+		QPtrList<Room> inRect(int zone, int elev, int lat1, int long1,
+													int lat2, int long2);
+		QPtrList<Room> inRadius(int zone, int elev, int lat, int longi,
+														int radius, int elevrange = 0);
+		QPtrList<Room> inZone(int zone);
+
+		/** Return the number of chunks holding rooms */
+		unsigned int chunkCount(void) const { return chunks.count(); }
+
+	protected:
+		/** Clamp @a c to +/- @a limit */
+		static int clampCoord(long long c, int limit)
+			{ return (c < -limit) ? -limit : ((c > limit) ? limit : (int)c); }
+		/** Chunk coordinate holding @a c (rounds toward negative infinity) */
+		static int chunkOf(int c) { return c >> chunkbits; }
+		static bool chunkKey(int zone, int elev, int latchunk, int longchunk,
+												 RoomIndex::roomkey_t &key);
+		Chunk *findChunk(int zone, int elev, int latchunk, int longchunk);
+		void collect(Chunk *chunk, int lat1, int long1, int lat2, int long2,
+								 QPtrList<Room> &out);
+
+	protected:
+		/** Chunks by chunk key */
+		QMap<RoomIndex::roomkey_t, Chunk *> chunks;
+		/** Chunks of each zone */
+		QIntDict<QPtrList<Chunk> > zones;
+		/** Protects everything above */
+		ZThread::FastRecursiveMutex gridlock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_ROOMGRID_HXX
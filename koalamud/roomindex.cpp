@@ -0,0 +1,251 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/RoomIndex
+* Description:
+* 	Coordinate to room lookup.  The four room coordinates are
+* 	packed into a single 64 bit key and kept in an open addressed
+* 	hash table that grows with the world and can be read without
+* 	taking a lock.
+* Classes:
+* 	RoomIndex
+\***************************************************************/
+
+#define KOALA_ROOMINDEX_CXX "%A%"
+
+#include <stdlib.h>
+#include <zthread/Guard.h>
+
+#include "roomindex.hxx"
+
+namespace koalamud {
+
+/** Build an empty index
+ * @param capacity Initial number of slots, rounded up to a power of two
+ */
+RoomIndex::RoomIndex(unsigned long capacity)
+	: _count(0)
+{
+	_table = newTable(capacity);
+}
+
+/** Free the current and retired tables */
+RoomIndex::~RoomIndex(void)
+{
+	table_t *t = _table;
+	while (t)
+	{
+		table_t *older = t->retired;
+		free(t);
+		t = older;
+	}
+}
+
+/** Allocate an empty table
+ * Tables are far bigger than anything PoolAllocator hands out, so they come
+ * straight from malloc. */
+RoomIndex::table_t *RoomIndex::newTable(unsigned long capacity)
+{
+	unsigned long cap = mincapacity;
+	unsigned int shift = 64;
+	for (unsigned long c = cap; c > 1; c >>= 1)
+		shift--;
+	while (cap < capacity)
+	{
+		cap <<= 1;
+		shift--;
+	}
+
+	table_t *t = (table_t *)malloc(sizeof(table_t) + (cap - 1) * sizeof(slot_t));
+	t->mask = cap - 1;
+	t->shift = shift;
+	t->keyed = 0;
+	t->retired = NULL;
+	for (unsigned long i = 0; i < cap; i++)
+	{
+		t->slots[i].key = emptykey;
+		t->slots[i].room = NULL;
+	}
+	return t;
+}
+
+/** Add a room to the index, replacing any room already at its coordinates
+ * @return false if the coordinates are out of range
+ */
+bool RoomIndex::insert(int zone, int lat, int longi, int elev, Room *room)
+{
+	roomkey_t key;
+	if (!packKey(zone, lat, longi, elev, key))
+		return false;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(writelock);
+
+	for (;;)
+	{
+		table_t *t = _table;
+		unsigned long pos = hash(t, key);
+		slot_t *s = &t->slots[pos];
+		while (s->key != emptykey && s->key != key)
+		{
+			pos = (pos + 1) & t->mask;
+			s = &t->slots[pos];
+		}
+
+		if (s->key == key)
+		{
+			if (s->room == NULL)
+				_count++;
+			__atomic_store_n(&s->room, room, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		/* Keep probe chains short - no more than 3/4 of the slots keyed */
+		if ((t->keyed + 1) * 4 > (t->mask + 1) * 3)
+		{
+			rebuild((_count + 1) * 2);
+			continue;
+		}
+
+		/* Publish the room before the key so a reader that sees the key always
+		 * sees the room too */
+		__atomic_store_n(&s->room, room, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->key, key, __ATOMIC_RELEASE);
+		t->keyed++;
+		_count++;
+		return true;
+	}
+}
+
+/** Remove a room from the index
+ * The slot keeps its key so lock free readers can't be confused by it being
+ * reused; the room pointer is just cleared.
+ * @param room Only remove the entry if it still points at this room
+ */
+void RoomIndex::remove(int zone, int lat, int longi, int elev, Room *room)
+{
+	roomkey_t key;
+	if (!packKey(zone, lat, longi, elev, key))
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(writelock);
+
+	table_t *t = _table;
+	unsigned long pos = hash(t, key);
+	slot_t *s = &t->slots[pos];
+	while (s->key != emptykey)
+	{
+		if (s->key == key)
+		{
+			if (s->room && s->room == room)
+			{
+				__atomic_store_n(&s->room, (Room *)NULL, __ATOMIC_RELEASE);
+				_count--;
+			}
+			return;
+		}
+		pos = (pos + 1) & t->mask;
+		s = &t->slots[pos];
+	}
+}
+
+/** Make room for @a rooms more rooms without growing the table again
+ * Bulk loaders call this first so the table is built once at the right size
+ * instead of doubling its way up. */
+void RoomIndex::reserve(unsigned long rooms)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(writelock);
+
+	if ((_table->keyed + rooms) * 4 > (_table->mask + 1) * 3)
+		rebuild((_count + rooms) * 2);
+}
+
+/** Copy the live rooms into a fresh table and swap it in
+ * @param capacity Slots wanted in the new table
+ * @note writelock must be held by the caller
+ */
+void RoomIndex::rebuild(unsigned long capacity)
+{
+	table_t *old = _table;
+	table_t *t = newTable(capacity);
+
+	for (unsigned long i = 0; i <= old->mask; i++)
+	{
+		slot_t *from = &old->slots[i];
+		if (from->key == emptykey || from->room == NULL)
+			continue;
+
+		unsigned long pos = hash(t, from->key);
+		while (t->slots[pos].key != emptykey)
+			pos = (pos + 1) & t->mask;
+		t->slots[pos] = *from;
+		t->keyed++;
+	}
+
+	t->retired = old;
+	__atomic_store_n(&_table, t, __ATOMIC_RELEASE);
+}
+
+/** Return the bytes used by the current and retired tables */
+unsigned long RoomIndex::memoryUsed(void) const
+{
+	unsigned long total = 0;
+	for (const table_t *t = _table; t; t = t->retired)
+		total += sizeof(table_t) + t->mask * sizeof(slot_t);
+	return total;
+}
+
+/** Start walking every room in the index */
+RoomIndex::Iterator::Iterator(const RoomIndex &index)
+	: _pos(0), _zone(0), _onezone(false), _room(NULL), _key(emptykey)
+{
+	_table = __atomic_load_n(&index._table, __ATOMIC_ACQUIRE);
+	next();
+}
+
+/** Start walking the rooms of one zone */
+RoomIndex::Iterator::Iterator(const RoomIndex &index, int zone)
+	: _pos(0), _zone(zone), _onezone(true), _room(NULL), _key(emptykey)
+{
+	_table = __atomic_load_n(&index._table, __ATOMIC_ACQUIRE);
+	next();
+}
+
+/** Advance to the next room
+ * @return The new current room, or NULL at the end
+ */
+Room *RoomIndex::Iterator::next(void)
+{
+	roomkey_t zonebits = (roomkey_t)(_zone + maxcoord) << 48;
+
+	if (_onezone && !inRange(_zone))
+		_pos = _table->mask + 1;
+
+	while (_pos <= _table->mask)
+	{
+		const slot_t *s = &_table->slots[_pos++];
+		roomkey_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+		if (k == emptykey)
+			continue;
+		if (_onezone && (k & 0xffff000000000000ULL) != zonebits)
+			continue;
+
+		Room *room = __atomic_load_n(&s->room, __ATOMIC_ACQUIRE);
+		if (room == NULL)
+			continue;
+
+		_room = room;
+		_key = k;
+		return room;
+	}
+
+	_room = NULL;
+	_key = emptykey;
+	return NULL;
+}
+
+}; /* end koalamud namespace */
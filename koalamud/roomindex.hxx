@@ -0,0 +1,180 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/RoomIndex
+* Description:
+* 	Coordinate to room lookup.  The four room coordinates are
+* 	packed into a single 64 bit key and kept in an open addressed
+* 	hash table that grows with the world and can be read without
+* 	taking a lock.
+* Classes:
+* 	RoomIndex
+\***************************************************************/
+
+#ifndef KOALA_ROOMINDEX_HXX
+#define KOALA_ROOMINDEX_HXX "%A%"
+
+#include <qglobal.h>
+#include <zthread/FastRecursiveMutex.h>
+
+namespace koalamud {
+
+class Room;
+
+/** Room coordinate index
+ * Each coordinate is stored in 16 bits, so zone, latitude, longitude and
+ * elevation must be within +/- maxcoord.  Rooms outside that range can't be
+ * indexed.
+ *
+ * Lookups never lock.  A slot's key never changes once it is set, so a reader
+ * that finds its key knows the room pointer next to it belongs to that key
+ * (or is NULL if the room has been removed).  Writers are serialized with a
+ * lock.  When the table fills up a new one is built and swapped in; the old
+ * table is kept until the index is destroyed because a reader may still be
+ * walking it.  Tables double in size, so the retired ones never add up to
+ * more than the current table unless rooms are constantly created at new
+ * coordinates.
+ */
+class RoomIndex
+{
+	public:
+		/** Packed coordinates */
+		typedef Q_UINT64 roomkey_t;
+
+		/** Largest coordinate magnitude that can be packed */
+		static const int maxcoord = 32767;
+		/** Key that never matches real coordinates, marks empty slots */
+		static const roomkey_t emptykey = ~(roomkey_t)0;
+		/** Smallest table we build */
+		static const unsigned long mincapacity = 1024;
+
+	protected:
+		/** Table slot */
+		typedef struct {
+			roomkey_t key; /**< Packed coordinates, emptykey if unused */
+			Room *room; /**< Room at these coordinates, NULL if removed */
+		} slot_t;
+
+		/** Hash table */
+		typedef struct table_s {
+			unsigned long mask; /**< Capacity - 1 */
+			unsigned int shift; /**< 64 - log2(capacity) */
+			unsigned long keyed; /**< Slots with a key set */
+			struct table_s *retired; /**< Next older table */
+			slot_t slots[1]; /**< mask + 1 slots */
+		} table_t;
+
+	public:
+		/** Walk every room in the index
+		 * An iterator sees the table that was current when it was created.
+		 * Rooms added after that may be missed. */
+		class Iterator
+		{
+			public:
+				Iterator(const RoomIndex &index);
+				Iterator(const RoomIndex &index, int zone);
+
+				/** Return the current room, NULL once we're past the end */
+				Room *current(void) const { return _room; }
+				/** Return the current room's key */
+				roomkey_t currentKey(void) const { return _key; }
+				Room *next(void);
+
+			protected:
+				/** Table we are walking */
+				const table_t *_table;
+				/** Next slot to look at */
+				unsigned long _pos;
+				/** Only return rooms in this zone when _onezone is set */
+				int _zone;
+				/** True if we're limited to one zone */
+				bool _onezone;
+				/** Current room */
+				Room *_room;
+				/** Current key */
+				roomkey_t _key;
+		};
+		friend class Iterator;
+
+	public:
+		RoomIndex(unsigned long capacity = mincapacity);
+		~RoomIndex(void);
+
+		/** Pack coordinates into a key
+		 * @return false if a coordinate is out of range */
+		static bool packKey(int zone, int lat, int longi, int elev, roomkey_t &key)
+			{ if (!inRange(zone) || !inRange(lat) || !inRange(longi) ||
+						!inRange(elev))
+					return false;
+				key = ((roomkey_t)(zone + maxcoord) << 48) |
+							((roomkey_t)(lat + maxcoord) << 32) |
+							((roomkey_t)(longi + maxcoord) << 16) |
+							(roomkey_t)(elev + maxcoord);
+				return true; }
+		/** Unpack a key into coordinates */
+		static void unpackKey(roomkey_t key, int &zone, int &lat, int &longi,
+													int &elev)
+			{ zone = (int)((key >> 48) & 0xffff) - maxcoord;
+				lat = (int)((key >> 32) & 0xffff) - maxcoord;
+				longi = (int)((key >> 16) & 0xffff) - maxcoord;
+				elev = (int)(key & 0xffff) - maxcoord; }
+
+		/** Look up a room by key without locking */
+		Room *find(roomkey_t key) const
+			{ const table_t *t = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+				unsigned long pos = hash(t, key);
+				for (;;)
+				{
+					const slot_t *s = &t->slots[pos];
+					roomkey_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+					if (k == key)
+						return __atomic_load_n(&s->room, __ATOMIC_ACQUIRE);
+					if (k == emptykey)
+						return NULL;
+					pos = (pos + 1) & t->mask;
+				} }
+		/** Look up a room by coordinates without locking */
+		Room *find(int zone, int lat, int longi, int elev) const
+			{ roomkey_t key;
+				if (!packKey(zone, lat, longi, elev, key))
+					return NULL;
+				return find(key); }
+
+		bool insert(int zone, int lat, int longi, int elev, Room *room);
+		void remove(int zone, int lat, int longi, int elev, Room *room);
+		void reserve(unsigned long rooms);
+
+		/** Return the number of rooms in the index */
+		unsigned long count(void) const { return _count; }
+		/** Return the number of slots in the current table */
+		unsigned long capacity(void) const { return _table->mask + 1; }
+		/** Return the bytes used by the current and retired tables */
+		unsigned long memoryUsed(void) const;
+
+	protected:
+		/** Check that a coordinate fits in a key */
+		static bool inRange(int c) { return (c >= -maxcoord && c <= maxcoord); }
+		/** Home slot for a key (Fibonacci hashing) */
+		static unsigned long hash(const table_t *t, roomkey_t key)
+			{ return (unsigned long)((key * 0x9e3779b97f4a7c15ULL) >> t->shift); }
+
+		static table_t *newTable(unsigned long capacity);
+		void rebuild(unsigned long capacity);
+
+	protected:
+		/** Current table */
+		table_t *_table;
+		/** Number of rooms in the index */
+		unsigned long _count;
+		/** Serializes writers */
+		ZThread::FastRecursiveMutex writelock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_ROOMINDEX_HXX
@@ -0,0 +1,620 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/Snapshot
+* Description:
+* 	Binary image of the static world (rooms, exits and languages)
+* 	so a restart can rebuild the world from a memory mapped file
+* 	instead of pulling every row out of the database.
+* Classes:
+* 	WorldSnapshot
+\***************************************************************/
+
+#define KOALA_WORLDSNAP_CXX "%A%"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <qcstring.h>
+#include <qdeepcopy.h>
+#include <qfile.h>
+#include <qmap.h>
+#include <qsqlquery.h>
+#include <zthread/Guard.h>
+
+#include "main.hxx"
+#include "worldsnap.hxx"
+#include "room.hxx"
+#include "language.hxx"
+#include "dbpool.hxx"
+#include "logging.hxx"
+#include "cmd.hxx"
+#include "cmdtree.hxx"
+
+namespace koalamud {
+
+/** Magic at the start of every snapshot */
+static const char snapmagic[8] = "KMWORLD";
+/** FNV-1a offset basis */
+static const Q_UINT64 fnvbasis = 14695981039346656037ULL;
+
+/** Continue an FNV-1a hash over @a len bytes */
+static Q_UINT64 fnv(Q_UINT64 hash, const char *data, unsigned long len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (unsigned long i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/** Fetch a string from the string table
+ * @return The string, or QString::null for a NULL or out of range offset
+ */
+static QString snapString(const char *strings, Q_UINT32 strsize, Q_UINT32 off)
+{
+	Q_UINT32 len;
+
+	if (off == WorldSnapshot::nullstring || off >= strsize ||
+			strsize - off < sizeof(len))
+		return QString::null;
+
+	memcpy(&len, strings + off, sizeof(len));
+	if (len > strsize - off - sizeof(len))
+		return QString::null;
+
+	return QString::fromUtf8(strings + off + sizeof(len), len);
+}
+
+/** Growable byte buffer holding one section of a snapshot being written */
+class SnapSection
+{
+	public:
+		/** Start out empty */
+		SnapSection(void) : _data(NULL), _used(0), _size(0) {}
+		/** Free the buffer */
+		~SnapSection(void) { free(_data); }
+
+		Q_UINT32 append(const void *data, unsigned long len);
+		Q_UINT32 addString(QString str);
+
+		/** Return the section contents */
+		const char *data(void) const { return _data; }
+		/** Return the number of bytes in the section */
+		unsigned long used(void) const { return _used; }
+
+	protected:
+		/** Section contents */
+		char *_data;
+		/** Bytes used */
+		unsigned long _used;
+		/** Bytes allocated */
+		unsigned long _size;
+};
+
+/** Append bytes to the section
+ * @return Offset of the bytes within the section
+ */
+Q_UINT32 SnapSection::append(const void *data, unsigned long len)
+{
+	if (_used + len > _size)
+	{
+		unsigned long newsize = _size ? _size : 65536;
+		while (_used + len > newsize)
+			newsize *= 2;
+		_data = (char *)realloc(_data, newsize);
+		_size = newsize;
+	}
+
+	Q_UINT32 off = _used;
+	memcpy(_data + _used, data, len);
+	_used += len;
+	return off;
+}
+
+/** Add a string to a string table section
+ * Strings are stored as a 32 bit length followed by UTF-8 text, padded to
+ * keep the next length aligned.
+ * @return Offset of the string, or WorldSnapshot::nullstring for NULL
+ */
+Q_UINT32 SnapSection::addString(QString str)
+{
+	static const char zeros[sizeof(Q_UINT32)] = { 0 };
+
+	if (str.isNull())
+		return WorldSnapshot::nullstring;
+
+	QCString utf = str.utf8();
+	Q_UINT32 len = utf.length();
+	Q_UINT32 off = append(&len, sizeof(len));
+	append(utf.data(), len);
+	if (len % sizeof(Q_UINT32))
+		append(zeros, sizeof(Q_UINT32) - (len % sizeof(Q_UINT32)));
+	return off;
+}
+
+/** Background snapshot writer
+ * The tables are read on a database worker connection so regenerating the
+ * snapshot never holds up the game. */
+class SnapshotRequest : public DBRequest
+{
+	public:
+		/** Write a snapshot to @a file */
+		SnapshotRequest(QString file)
+			: _file(QDeepCopy<QString>(file)), _ok(false) {}
+
+		/** Dump the world tables */
+		virtual void query(QSqlDatabase *db)
+			{ _ok = WorldSnapshot::write(db, _file); }
+		/** Let the snapshot manager know we're done */
+		virtual void complete(void)
+			{ WorldSnapshot::instance()->written(_ok); }
+
+	protected:
+		/** File to write */
+		QString _file;
+		/** True if the snapshot was written */
+		bool _ok;
+};
+
+/** Rebuild the world from the snapshot file
+ * The snapshot is only used if it was written for the current database
+ * schema and world version and its checksum matches.  Nothing is created
+ * unless the whole file checks out, so on failure the caller can load the
+ * world from the database as usual.
+ * @return true if the world was loaded
+ */
+bool WorldSnapshot::load(void)
+{
+	Q_UINT32 schema, worldver;
+	QString str;
+	QTextOStream os(&str);
+
+	if (!readVersions(NULL, schema, worldver))
+	{
+		Logger::msg("Unable to read world version, not using world snapshot",
+								Logger::LOG_WARNING);
+		return false;
+	}
+
+	int fd = ::open(QFile::encodeName(_file), O_RDONLY);
+	if (fd < 0)
+	{
+		os << "No world snapshot at " << _file;
+		Logger::msg(str, Logger::LOG_NOTICE);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (unsigned long)st.st_size < sizeof(snaphdr_t))
+	{
+		::close(fd);
+		os << "World snapshot " << _file << " is truncated";
+		Logger::msg(str, Logger::LOG_WARNING);
+		return false;
+	}
+
+	unsigned long size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		os << "Unable to map world snapshot " << _file;
+		Logger::msg(str, Logger::LOG_WARNING);
+		return false;
+	}
+
+	const snaphdr_t *hdr = (const snaphdr_t *)map;
+	const char *body = (const char *)map + sizeof(snaphdr_t);
+	unsigned long expected = sizeof(snaphdr_t) +
+							(unsigned long)hdr->rooms * sizeof(snaproom_t) +
+							(unsigned long)hdr->exits * sizeof(snapexit_t) +
+							(unsigned long)hdr->languages * sizeof(snaplang_t) +
+							hdr->strsize;
+	const char *why = NULL;
+
+	if (memcmp(hdr->magic, snapmagic, sizeof(snapmagic)) ||
+			hdr->format != snapformat)
+		why = "unknown format";
+	else if (hdr->schema != schema || hdr->worldver != worldver)
+		why = "out of date";
+	else if (size != expected)
+		why = "wrong size";
+	else if (fnv(fnvbasis, body, size - sizeof(snaphdr_t)) != hdr->checksum)
+		why = "bad checksum";
+
+	bool ok = false;
+	if (why)
+	{
+		os << "World snapshot " << _file << " not used: " << why;
+		Logger::msg(str, Logger::LOG_NOTICE);
+	} else {
+		ok = rebuild((const char *)map, size);
+	}
+
+	munmap(map, size);
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(snaplock);
+	_current = ok;
+	return ok;
+}
+
+/** Create the languages, rooms and exits in a validated snapshot */
+bool WorldSnapshot::rebuild(const char *map, unsigned long size)
+{
+	const snaphdr_t *hdr = (const snaphdr_t *)map;
+	const snaproom_t *rooms = (const snaproom_t *)(map + sizeof(snaphdr_t));
+	const snapexit_t *exits = (const snapexit_t *)(rooms + hdr->rooms);
+	const snaplang_t *langs = (const snaplang_t *)(exits + hdr->exits);
+	const char *strings = (const char *)(langs + hdr->languages);
+	Q_UINT32 strsize = hdr->strsize;
+
+	Room::initializeMaps();
+	RoomExit::initializeMaps();
+
+	for (Q_UINT32 i = 0; i < hdr->languages; i++)
+	{
+		const snaplang_t *l = &langs[i];
+		new Language(snapString(strings, strsize, l->langid),
+								 snapString(strings, strsize, l->name),
+								 snapString(strings, strsize, l->parent),
+								 snapString(strings, strsize, l->charset),
+								 l->difficulty,
+								 snapString(strings, strsize, l->shortname));
+	}
+
+	RoomMap.reserve(hdr->rooms);
+	Room **built = new Room *[hdr->rooms];
+	for (Q_UINT32 i = 0; i < hdr->rooms; i++)
+	{
+		const snaproom_t *r = &rooms[i];
+		built[i] = new Room(r->zone, r->lat, r->longi, r->elev,
+												snapString(strings, strsize, r->title),
+												snapString(strings, strsize, r->description),
+												r->flags, (Room::type_t)r->type, r->plrlimit);
+	}
+
+	unsigned int exitcount = 0;
+	for (Q_UINT32 i = 0; i < hdr->exits; i++)
+	{
+		const snapexit_t *e = &exits[i];
+		if (e->from >= hdr->rooms || e->to >= hdr->rooms ||
+				e->dir > Room::DIR_DOWN)
+			continue;
+
+		RoomExit::makeExits(built[e->from], built[e->to],
+												snapString(strings, strsize, e->name), e->keyobj,
+												e->flags, (int)e->dir);
+		exitcount++;
+	}
+	delete [] built;
+
+	QString str;
+	QTextOStream os(&str);
+	os << "Loaded " << hdr->rooms << " rooms, " << exitcount << " exits and "
+		 << hdr->languages << " languages from world snapshot " << _file
+		 << " (" << size << " bytes)";
+	Logger::msg(str, Logger::LOG_INFO);
+	return true;
+}
+
+/** Write a new snapshot in the background
+ * Requests made while a snapshot is being written are folded into a single
+ * rewrite once it finishes. */
+void WorldSnapshot::regenerate(void)
+{
+	{
+		ZThread::Guard<ZThread::FastRecursiveMutex> guard(snaplock);
+		_current = false;
+		if (_writing)
+		{
+			_again = true;
+			return;
+		}
+		_writing = true;
+	}
+
+	srv->db()->submit(new SnapshotRequest(_file));
+}
+
+/** Note a change to the world tables
+ * Bumps WorldVersion so older snapshots are no longer used and writes a new
+ * one. */
+void WorldSnapshot::changed(void)
+{
+	QSqlQuery q;
+	if (!q.exec("update config set vval = vval + 1\n"
+							"where vname = 'WorldVersion';"))
+	{
+		Logger::msg("Unable to update world version", Logger::LOG_ERROR);
+	}
+
+	regenerate();
+}
+
+/** Called on the game executor when a background write finishes */
+void WorldSnapshot::written(bool ok)
+{
+	bool again;
+	{
+		ZThread::Guard<ZThread::FastRecursiveMutex> guard(snaplock);
+		_writing = false;
+		again = _again;
+		_again = false;
+		if (ok && !again)
+			_current = true;
+	}
+
+	if (again)
+		regenerate();
+}
+
+/** Read the schema and world versions from the config table
+ * @param db Connection to use, NULL for the default connection
+ * @return true if both were found
+ */
+bool WorldSnapshot::readVersions(QSqlDatabase *db, Q_UINT32 &schema,
+																 Q_UINT32 &worldver)
+{
+	QSqlQuery q(QString::null, db);
+	bool gotschema = false, gotworld = false;
+
+	if (!q.exec("select vname, vval from config\n"
+							"where vname in ('SchemaVersion', 'WorldVersion');"))
+		return false;
+
+	while (q.next())
+	{
+		if (q.value(0).toString() == "SchemaVersion")
+		{
+			schema = q.value(1).toUInt();
+			gotschema = true;
+		} else {
+			worldver = q.value(1).toUInt();
+			gotworld = true;
+		}
+	}
+
+	return gotschema && gotworld;
+}
+
+/** Dump the world tables to a snapshot file
+ * The versions are read before the tables, so a change made while we are
+ * dumping bumps WorldVersion past the one we record and the snapshot is
+ * simply rewritten.  The file is written under a temporary name and renamed
+ * into place so a crash never leaves a partial snapshot behind.
+ * @param db Connection to read the tables with
+ * @param file Snapshot file to write
+ * @return true if the snapshot was written
+ */
+bool WorldSnapshot::write(QSqlDatabase *db, QString file)
+{
+	snaphdr_t hdr;
+	SnapSection rooms, exits, langs, strings;
+	QMap<RoomIndex::roomkey_t, Q_UINT32> index;
+	QMap<RoomIndex::roomkey_t, Q_UINT32>::Iterator r1, r2;
+	RoomIndex::roomkey_t key;
+	QSqlQuery q(QString::null, db);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, snapmagic, sizeof(snapmagic));
+	hdr.format = snapformat;
+	if (!readVersions(db, hdr.schema, hdr.worldver))
+	{
+		Logger::msg("Unable to read world version for snapshot",
+								Logger::LOG_ERROR);
+		return false;
+	}
+
+	/* Rooms */
+	q.setForwardOnly(true);
+	if (!q.exec("select zone, latitude, longitude, elevation, title,\n"
+							"description, flags+0, type+0, plrlimit from room;"))
+	{
+		Logger::msg("Unable to read rooms for world snapshot", Logger::LOG_ERROR);
+		return false;
+	}
+	while (q.next())
+	{
+		snaproom_t r;
+		r.zone = q.value(0).toInt();
+		r.lat = q.value(1).toInt();
+		r.longi = q.value(2).toInt();
+		r.elev = q.value(3).toInt();
+		r.title = strings.addString(q.value(4).toString());
+		r.description = strings.addString(q.value(5).toString());
+		r.flags = q.value(6).toUInt();
+		r.type = q.value(7).toUInt();
+		r.plrlimit = q.value(8).toUInt();
+
+		if (RoomIndex::packKey(r.zone, r.lat, r.longi, r.elev, key))
+			index.insert(key, hdr.rooms);
+		hdr.rooms++;
+		rooms.append(&r, sizeof(r));
+	}
+
+	/* Exits */
+	q.setForwardOnly(true);
+	if (!q.exec("select r1zone, r1lat, r1long, r1elev,\n"
+							"r2zone, r2lat, r2long, r2elev, name, keyobj, flags+0,\n"
+							"direction from roomexits;"))
+	{
+		Logger::msg("Unable to read room exits for world snapshot",
+								Logger::LOG_ERROR);
+		return false;
+	}
+	while (q.next())
+	{
+		if (!RoomIndex::packKey(q.value(0).toInt(), q.value(1).toInt(),
+														q.value(2).toInt(), q.value(3).toInt(), key))
+			continue;
+		r1 = index.find(key);
+		if (!RoomIndex::packKey(q.value(4).toInt(), q.value(5).toInt(),
+														q.value(6).toInt(), q.value(7).toInt(), key))
+			continue;
+		r2 = index.find(key);
+		if (r1 == index.end() || r2 == index.end())
+			continue;
+
+		snapexit_t e;
+		e.from = r1.data();
+		e.to = r2.data();
+		e.name = strings.addString(q.value(8).toString());
+		e.keyobj = q.value(9).toInt();
+		e.flags = q.value(10).toUInt();
+		e.dir = Room::stringToDir(q.value(11).toString());
+
+		hdr.exits++;
+		exits.append(&e, sizeof(e));
+	}
+
+	/* Languages */
+	q.setForwardOnly(true);
+	if (!q.exec("select langid, name, parentid, charset, difficulty, shortname\n"
+							"from languages;"))
+	{
+		Logger::msg("Unable to read languages for world snapshot",
+								Logger::LOG_ERROR);
+		return false;
+	}
+	while (q.next())
+	{
+		snaplang_t l;
+		l.langid = strings.addString(q.value(0).toString());
+		l.name = strings.addString(q.value(1).toString());
+		l.parent = strings.addString(q.value(2).toString());
+		l.charset = strings.addString(q.value(3).toString());
+		l.difficulty = q.value(4).toUInt();
+		l.shortname = strings.addString(q.value(5).toString());
+
+		hdr.languages++;
+		langs.append(&l, sizeof(l));
+	}
+
+	hdr.strsize = strings.used();
+	hdr.checksum = fnvbasis;
+	hdr.checksum = fnv(hdr.checksum, rooms.data(), rooms.used());
+	hdr.checksum = fnv(hdr.checksum, exits.data(), exits.used());
+	hdr.checksum = fnv(hdr.checksum, langs.data(), langs.used());
+	hdr.checksum = fnv(hdr.checksum, strings.data(), strings.used());
+
+	/* Write it out */
+	QString tmpname = file + ".tmp";
+	QFile out(tmpname);
+	if (!out.open(IO_WriteOnly | IO_Truncate))
+	{
+		QString str;
+		QTextOStream os(&str);
+		os << "Unable to create world snapshot " << tmpname;
+		Logger::msg(str, Logger::LOG_ERROR);
+		return false;
+	}
+
+	bool ok = (out.writeBlock((const char *)&hdr, sizeof(hdr)) ==
+																							(Q_LONG)sizeof(hdr));
+	SnapSection *sections[] = { &rooms, &exits, &langs, &strings };
+	for (unsigned int i = 0; ok && i < sizeof(sections)/sizeof(sections[0]); i++)
+	{
+		if (sections[i]->used() == 0)
+			continue;
+		ok = (out.writeBlock(sections[i]->data(), sections[i]->used()) ==
+					(Q_LONG)sections[i]->used());
+	}
+	out.close();
+
+	if (!ok || out.status() != IO_Ok ||
+			::rename(QFile::encodeName(tmpname), QFile::encodeName(file)) < 0)
+	{
+		QFile::remove(tmpname);
+		QString str;
+		QTextOStream os(&str);
+		os << "Unable to write world snapshot " << file;
+		Logger::msg(str, Logger::LOG_ERROR);
+		return false;
+	}
+
+	QString str;
+	QTextOStream os(&str);
+	os << "Wrote world snapshot " << file << " at world version "
+		 << hdr.worldver << ": " << hdr.rooms << " rooms, " << hdr.exits
+		 << " exits, " << hdr.languages << " languages";
+	Logger::msg(str, Logger::LOG_INFO);
+	return true;
+}
+
+namespace commands {
+
+/** World snapshot command class */
+class WorldSnap : public Command
+{
+	public:
+		/** Pass through constructor */
+		WorldSnap(Char *ch) : Command(ch) {}
+		/** Run worldsnap command - write a new world snapshot */
+		virtual unsigned int run(QString args)
+		{
+			QString str;
+			QTextOStream os(&str);
+
+			WorldSnapshot::instance()->regenerate();
+
+			os << "Writing a new world snapshot." << endl;
+			_ch->sendtochar(str);
+			return 0;
+		}
+
+		/** Restricted access command. */
+		virtual bool isRestricted(void) const { return true;}
+
+		/** Command Groups */
+		virtual QStringList getCmdGroups(void) const
+		{
+			QStringList gl;
+			gl << "Implementor" << "Coder";
+			return gl;
+		}
+
+		/** Get command name for individual granting */
+		virtual QString getCmdName(void) const { return QString("worldsnap"); }
+};
+
+}; /* end commands namespace */
+
+/** Command Factory for worldsnap.cpp */
+class WorldSnap_CPP_CommandFactory : public CommandFactory
+{
+	public:
+		/** Register our commands */
+		WorldSnap_CPP_CommandFactory(void)
+			: CommandFactory()
+		{
+			immcmdtree->addcmd("worldsnap", this, 1);
+		}
+
+		/** Handle command object creations */
+		virtual Command *create(unsigned int id, Char *ch)
+		{
+			switch (id)
+			{
+				case 1:
+					return new koalamud::commands::WorldSnap(ch);
+			}
+			return NULL;
+		}
+};
+
+/** Command factory for worldsnap.cpp module.  */
+WorldSnap_CPP_CommandFactory WorldSnap_CPP_CommandFactoryInstance;
+
+}; /* end koalamud namespace */
@@ -0,0 +1,133 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/Snapshot
+* Description:
+* 	Binary image of the static world (rooms, exits and languages)
+* 	so a restart can rebuild the world from a memory mapped file
+* 	instead of pulling every row out of the database.
+* Classes:
+* 	WorldSnapshot
+\***************************************************************/
+
+#ifndef KOALA_WORLDSNAP_HXX
+#define KOALA_WORLDSNAP_HXX "%A%"
+
+#include <qstring.h>
+#include <qsqldatabase.h>
+#include <zthread/FastRecursiveMutex.h>
+
+#include "memory.hxx"
+
+namespace koalamud {
+
+/** World snapshot file
+ * The file starts with a snaphdr_t, followed by the room, exit and language
+ * records and finally a string table.  Records refer to strings by their
+ * offset in the string table and exits refer to rooms by their position in
+ * the room records, so rebuilding needs no lookups at all.
+ *
+ * A snapshot is only used if its format, the database schema version and the
+ * 'WorldVersion' config value all match, and its checksum is good.  Anything
+ * that changes the room, roomexits or languages tables must call changed(),
+ * which bumps WorldVersion and writes a new snapshot in the background.
+ */
+class WorldSnapshot
+{
+	public:
+		/** Version of the file layout below */
+		static const Q_UINT32 snapformat = 1;
+		/** String offset for a NULL string */
+		static const Q_UINT32 nullstring = 0xffffffff;
+
+		/** File header */
+		typedef struct {
+			char magic[8]; /**< "KMWORLD" */
+			Q_UINT32 format; /**< snapformat when written */
+			Q_UINT32 schema; /**< Database SchemaVersion */
+			Q_UINT32 worldver; /**< Database WorldVersion */
+			Q_UINT32 rooms; /**< Number of room records */
+			Q_UINT32 exits; /**< Number of exit records */
+			Q_UINT32 languages; /**< Number of language records */
+			Q_UINT32 strsize; /**< Size of the string table in bytes */
+			Q_UINT32 pad; /**< Keeps the checksum aligned */
+			Q_UINT64 checksum; /**< FNV-1a of everything after the header */
+		} snaphdr_t;
+
+		/** Room record */
+		typedef struct {
+			Q_INT32 zone, lat, longi, elev; /**< Coordinates */
+			Q_UINT32 title; /**< Title string */
+			Q_UINT32 description; /**< Description string */
+			Q_UINT32 flags; /**< Room flag bits */
+			Q_UINT32 type; /**< Room::type_t */
+			Q_UINT32 plrlimit; /**< Player limit */
+		} snaproom_t;
+
+		/** Exit record */
+		typedef struct {
+			Q_UINT32 from; /**< Room record the exit leads from */
+			Q_UINT32 to; /**< Room record the exit leads to */
+			Q_UINT32 name; /**< Exit name string */
+			Q_INT32 keyobj; /**< Key object */
+			Q_UINT32 flags; /**< RoomExit flag bits */
+			Q_UINT32 dir; /**< Room::directions */
+		} snapexit_t;
+
+		/** Language record */
+		typedef struct {
+			Q_UINT32 langid, name, parent, charset, shortname; /**< Strings */
+			Q_UINT32 difficulty; /**< Learning difficulty */
+		} snaplang_t;
+
+	protected:
+		WorldSnapshot(void) : _current(false), _writing(false), _again(false) {}
+
+	public:
+		/** Set the snapshot file name.  Call before load() */
+		void setFile(QString file) { _file = file; }
+		/** Return true if the snapshot on disk matches the loaded world */
+		bool isCurrent(void) const { return _current; }
+
+		bool load(void);
+		void regenerate(void);
+		void changed(void);
+		void written(bool ok);
+
+		static bool write(QSqlDatabase *db, QString file);
+		static bool readVersions(QSqlDatabase *db, Q_UINT32 &schema,
+														 Q_UINT32 &worldver);
+
+		/** Get a pointer to the singleton instance */
+		static WorldSnapshot *instance(void)
+			{
+				static WorldSnapshot *_instance = NULL;
+				if (_instance == NULL)
+					_instance = new WorldSnapshot;
+				return _instance;
+			}
+
+	protected:
+		bool rebuild(const char *map, unsigned long size);
+
+	protected:
+		/** Snapshot file name */
+		QString _file;
+		/** True while the file matches the database */
+		bool _current;
+		/** True while a regeneration is queued or running */
+		bool _writing;
+		/** Set if the world changed again while we were writing */
+		bool _again;
+		/** Protects the flags above */
+		ZThread::FastRecursiveMutex snaplock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_WORLDSNAP_HXX
@@ -0,0 +1,446 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/ZoneManager
+* Description:
+* 	On demand zone residency.  A zone's rooms and exits are loaded
+* 	the first time something looks for one of its rooms, occupied
+* 	zones stay pinned, and zones that have been idle too long or
+* 	that push us over the memory budget are paged back out.
+* Classes:
+* 	ResidentZone
+* 	ZoneManager
+\***************************************************************/
+
+#define KOALA_ZONEMGR_CXX "%A%"
+
+#include <qptrdict.h>
+#include <qsqlquery.h>
+#include <zthread/Guard.h>
+
+#include "zonemgr.hxx"
+#include "room.hxx"
+#include "main.hxx"
+#include "logging.hxx"
+
+namespace koalamud {
+
+/** Note a character entering one of the zone's rooms */
+void ResidentZone::enter(void)
+{
+	__atomic_add_fetch(&occupants, 1, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&lastused, Reactor::now(), __ATOMIC_RELEASE);
+}
+
+/** Note a character leaving one of the zone's rooms */
+void ResidentZone::leave(void)
+{
+	__atomic_sub_fetch(&occupants, 1, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&lastused, Reactor::now(), __ATOMIC_RELEASE);
+}
+
+/** Build a manager with paging turned off */
+ZoneManager::ZoneManager(void)
+	: _paging(false), _ttl((unsigned long long)defaultttl * 1000), _budget(0),
+		zones(101), _resident(0), _bytes(0)
+{
+	zones.setAutoDelete(true);
+	retired.setAutoDelete(true);
+}
+
+/** Set up paging
+ * @param paging Turn on demand paging on
+ * @param ttl Seconds a zone can sit idle before it is evicted
+ * @param budget Kilobytes of rooms to keep resident, 0 for no limit
+ */
+void ZoneManager::configure(bool paging, unsigned int ttl, unsigned long budget)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(zonelock);
+
+	_paging = paging;
+	_ttl = (unsigned long long)(ttl ? ttl : defaultttl) * 1000;
+	_budget = budget * 1024;
+}
+
+/** Start the eviction sweep on the main reactor */
+void ZoneManager::start(void)
+{
+	if (!_paging)
+		return;
+
+	srv->reactor()->addTimer(&sweeper, sweepinterval, true);
+}
+
+/** Find a room, paging its zone in if it isn't resident
+ * Called by Room::findRoom when RoomMap doesn't have the room.  The zone is
+ * read from the database without zonelock held; if another thread pages it
+ * in first, our rows are thrown away.
+ * @return The room, or NULL if there is no such room
+ */
+Room *ZoneManager::page(int zone, int lat, int longi, int elev)
+{
+	if (!_paging)
+		return NULL;
+
+	ResidentZone *z;
+	{
+		ZThread::Guard<ZThread::FastRecursiveMutex> guard(zonelock);
+
+		z = zones.find(zone);
+		if (z == NULL)
+		{
+			z = new ResidentZone(zone);
+			zones.insert(zone, z);
+		}
+
+		if (z->resident)
+		{
+			__atomic_store_n(&z->lastused, Reactor::now(), __ATOMIC_RELEASE);
+			return RoomMap.find(zone, lat, longi, elev);
+		}
+	}
+
+	ZoneRows rows;
+	bool fetched = fetchZone(zone, rows);
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(zonelock);
+
+	if (z->resident)
+	{
+		__atomic_store_n(&z->lastused, Reactor::now(), __ATOMIC_RELEASE);
+	} else {
+		if (!fetched)
+			return NULL;
+		loadZone(z, rows);
+		evictForBudget(z);
+	}
+
+	return RoomMap.find(zone, lat, longi, elev);
+}
+
+/** Put a room created after its zone was paged in under our management */
+void ZoneManager::adopt(Room *room)
+{
+	if (!_paging || room->_zoneinfo)
+		return;
+
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(zonelock);
+
+	ResidentZone *z = zones.find(room->getZone());
+	if (z == NULL || !z->resident)
+		return;
+
+	unsigned long bytes = roomBytes(room);
+	room->_zoneinfo = z;
+	z->rooms.append(room);
+	z->bytes += bytes;
+	_bytes += bytes;
+}
+
+/** Read a zone's rooms and exits from the database
+ * This touches no game state, so it runs without zonelock held.
+ * @return false if the rooms couldn't be read
+ */
+bool ZoneManager::fetchZone(int zone, ZoneRows &rows)
+{
+	QString query;
+	QTextOStream qos(&query);
+	QSqlQuery q;
+
+	q.setForwardOnly(true);
+	qos << "select zone, latitude, longitude, elevation, title," << endl
+			<< "description, flags+0, type+0, plrlimit from room" << endl
+			<< "where zone = " << zone << ";";
+	if (!q.exec(query))
+	{
+		QString log;
+		QTextOStream out(&log);
+		out << "Unable to page in zone " << zone;
+		Logger::msg(log, Logger::LOG_ERROR);
+		return false;
+	}
+	while (q.next())
+	{
+		roomrow_t *r = new roomrow_t;
+		r->zone = q.value(0).toInt();
+		r->lat = q.value(1).toInt();
+		r->longi = q.value(2).toInt();
+		r->elev = q.value(3).toInt();
+		r->title = q.value(4).toString();
+		r->description = q.value(5).toString();
+		r->flags = q.value(6).toUInt();
+		r->type = q.value(7).toInt();
+		r->plrlimit = q.value(8).toUInt();
+		rows.rooms.append(r);
+	}
+
+	/* Exits leaving the zone, and two way exits coming into it */
+	QString exitquery;
+	QTextOStream eqos(&exitquery);
+	eqos << "select r1zone, r1lat, r1long, r1elev," << endl
+			 << "r2zone, r2lat, r2long, r2elev, name, keyobj, flags+0," << endl
+			 << "direction from roomexits where r1zone = " << zone << endl
+			 << "or (r2zone = " << zone
+			 << " and find_in_set('TWOWAY', flags));";
+	q.setForwardOnly(true);
+	if (!q.exec(exitquery))
+	{
+		QString log;
+		QTextOStream out(&log);
+		out << "Unable to page in exits for zone " << zone;
+		Logger::msg(log, Logger::LOG_ERROR);
+	}
+	while (q.isActive() && q.next())
+	{
+		exitrow_t *e = new exitrow_t;
+		e->zone1 = q.value(0).toInt();
+		e->lat1 = q.value(1).toInt();
+		e->long1 = q.value(2).toInt();
+		e->elev1 = q.value(3).toInt();
+		e->zone2 = q.value(4).toInt();
+		e->lat2 = q.value(5).toInt();
+		e->long2 = q.value(6).toInt();
+		e->elev2 = q.value(7).toInt();
+		e->name = q.value(8).toString();
+		e->keyobj = q.value(9).toUInt();
+		e->flags = q.value(10).toUInt();
+		e->direction = q.value(11).toString();
+		rows.exits.append(e);
+	}
+
+	return true;
+}
+
+/** Build a zone's rooms and exits from rows read by fetchZone
+ * Rooms from an earlier residency that are still waiting to be deleted are
+ * put back instead of being built again, so anyone still in one stays in the
+ * live copy.  They keep the exits they already have.
+ * A zone with no rooms is still marked resident so repeated misses in it
+ * don't go back to the database until it is evicted.
+ * @note zonelock must be held by the caller
+ */
+void ZoneManager::loadZone(ResidentZone *z, ZoneRows &rows)
+{
+	unsigned int roomcount = 0, exitcount = 0, reused = 0;
+
+	/* Take back our retired rooms, unless their spot has been filled */
+	QPtrList<retired_t> back;
+	QPtrListIterator<retired_t> r(retired);
+	for (; *r; ++r)
+	{
+		Room *room = (*r)->room;
+		if (room->_zoneinfo != z ||
+				RoomMap.find(room->_zone, room->_lat, room->_long, room->_elev))
+			continue;
+		room->indexRoom();
+		z->rooms.append(room);
+		back.append(*r);
+		reused++;
+	}
+	QPtrListIterator<retired_t> b(back);
+	for (; *b; ++b)
+		retired.removeRef(*b);
+
+	/* Rooms we build now, the only ones that get exits from the rows */
+	QPtrDict<Room> built;
+	QPtrListIterator<roomrow_t> row(rows.rooms);
+	for (; *row; ++row)
+	{
+		/* Leave rooms that were made some other way, or taken back, alone */
+		if (RoomMap.find((*row)->zone, (*row)->lat, (*row)->longi,
+										 (*row)->elev))
+			continue;
+
+		Room *room = new Room((*row)->zone, (*row)->lat, (*row)->longi,
+						(*row)->elev, (*row)->title, (*row)->description, (*row)->flags,
+						(Room::type_t)(*row)->type, (*row)->plrlimit);
+		room->_zoneinfo = z;
+		z->rooms.append(room);
+		built.insert(room, room);
+		roomcount++;
+	}
+
+	QPtrListIterator<exitrow_t> e(rows.exits);
+	for (; *e; ++e)
+	{
+		RoomIndex::roomkey_t k1, k2;
+		if (!RoomIndex::packKey((*e)->zone1, (*e)->lat1, (*e)->long1,
+														(*e)->elev1, k1) ||
+				!RoomIndex::packKey((*e)->zone2, (*e)->lat2, (*e)->long2,
+														(*e)->elev2, k2))
+			continue;
+
+		Room::directions dir = Room::stringToDir((*e)->direction);
+
+		Room *r1 = ((*e)->zone1 == z->zoneid) ? RoomMap.find(k1) : NULL;
+		if (r1 && built.find(r1))
+		{
+			r1->attachExit(new RoomExit(k2, (*e)->flags, (*e)->name, (*e)->keyobj),
+										 dir);
+			exitcount++;
+		}
+
+		if (!((*e)->flags & (1 << RoomExit::FLAG_TWOWAY)))
+			continue;
+
+		Room *r2 = ((*e)->zone2 == z->zoneid) ? RoomMap.find(k2) : NULL;
+		if (r2 && built.find(r2))
+		{
+			r2->attachExit(new RoomExit(k1, (*e)->flags, (*e)->name, (*e)->keyobj),
+										 Room::oppositeDir(dir));
+			exitcount++;
+		}
+	}
+
+	QPtrListIterator<Room> room(z->rooms);
+	for (; *room; ++room)
+		z->bytes += roomBytes(*room);
+
+	z->resident = true;
+	__atomic_store_n(&z->lastused, Reactor::now(), __ATOMIC_RELEASE);
+	_resident++;
+	_bytes += z->bytes;
+
+	QString log;
+	QTextOStream out(&log);
+	out << "Paged in zone " << z->zoneid << ": " << roomcount << " rooms, "
+			<< reused << " reused, " << exitcount << " exits, "
+			<< z->bytes / 1024 << "k";
+	Logger::msg(log, Logger::LOG_DEBUG);
+}
+
+/** Page a zone out
+ * Its rooms leave RoomMap and WorldGrid now, so nobody new can find them,
+ * and are deleted by a later sweep.
+ * @note zonelock must be held by the caller
+ */
+void ZoneManager::evictZone(ResidentZone *z)
+{
+	unsigned long long now = Reactor::now();
+
+	QPtrListIterator<Room> room(z->rooms);
+	for (; *room; ++room)
+	{
+		(*room)->unindexRoom();
+		retired_t *r = new retired_t;
+		r->room = *room;
+		r->evicted = now;
+		retired.append(r);
+	}
+	z->rooms.clear();
+
+	z->resident = false;
+	_resident--;
+	_bytes -= z->bytes;
+	z->bytes = 0;
+}
+
+/** Evict the least recently used idle zones until we are under budget
+ * @param keep Zone that must stay, usually the one just paged in
+ * @note zonelock must be held by the caller
+ */
+void ZoneManager::evictForBudget(ResidentZone *keep)
+{
+	if (_budget == 0)
+		return;
+
+	while (_bytes > _budget)
+	{
+		ResidentZone *oldest = NULL;
+		QIntDictIterator<ResidentZone> it(zones);
+		for (; it.current(); ++it)
+		{
+			ResidentZone *z = it.current();
+			if (!z->resident || z == keep ||
+					__atomic_load_n(&z->occupants, __ATOMIC_ACQUIRE))
+				continue;
+			if (oldest == NULL || z->lastused < oldest->lastused)
+				oldest = z;
+		}
+
+		/* Everything left is occupied */
+		if (oldest == NULL)
+			return;
+		evictZone(oldest);
+	}
+}
+
+/** Evict idle zones and delete rooms evicted on an earlier sweep
+ * Run from the main reactor every sweepinterval milliseconds.
+ */
+void ZoneManager::sweep(void)
+{
+	ZThread::Guard<ZThread::FastRecursiveMutex> guard(zonelock);
+
+	unsigned long long now = Reactor::now();
+	unsigned int deleted = 0, evicted = 0;
+
+	/* Rooms get at least one full sweep interval between leaving the index and
+	 * being deleted.  Any that picked up a character in that time wait until
+	 * it leaves. */
+	QPtrList<retired_t> done;
+	QPtrListIterator<retired_t> r(retired);
+	for (; *r; ++r)
+	{
+		if (now - (*r)->evicted < sweepinterval)
+			continue;
+
+		Room *room = (*r)->room;
+		room->lock.acquire();
+		bool empty = room->charsinroom.isEmpty();
+		room->lock.release();
+		if (empty)
+			done.append(*r);
+	}
+	QPtrListIterator<retired_t> d(done);
+	for (; *d; ++d)
+	{
+		delete (*d)->room;
+		retired.removeRef(*d);
+		deleted++;
+	}
+
+	QIntDictIterator<ResidentZone> it(zones);
+	for (; it.current(); ++it)
+	{
+		ResidentZone *z = it.current();
+		if (!z->resident || __atomic_load_n(&z->occupants, __ATOMIC_ACQUIRE))
+			continue;
+		if (now - __atomic_load_n(&z->lastused, __ATOMIC_ACQUIRE) < _ttl)
+			continue;
+
+		evictZone(z);
+		evicted++;
+	}
+
+	evictForBudget(NULL);
+
+	if (!deleted && !evicted)
+		return;
+
+	QString log;
+	QTextOStream out(&log);
+	out << "Zone sweep: evicted " << evicted << " zones, freed " << deleted
+			<< " rooms, " << _resident << " zones resident ("
+			<< _bytes / 1024 << "k)";
+	Logger::msg(log, Logger::LOG_DEBUG);
+}
+
+/** Rough memory used by a room, its text and its exits */
+unsigned long ZoneManager::roomBytes(Room *room)
+{
+	unsigned long bytes = sizeof(Room);
+	bytes += (room->_title.length() + room->_description.length()) *
+					 sizeof(QChar);
+	for (int d = Room::DIR_NORTH; d <= Room::DIR_DOWN; d++)
+		if (room->exits[d])
+			bytes += sizeof(RoomExit);
+	return bytes;
+}
+
+}; /* end koalamud namespace */
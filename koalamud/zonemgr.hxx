@@ -0,0 +1,201 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: WORLD/ZoneManager
+* Description:
+* 	On demand zone residency.  A zone's rooms and exits are loaded
+* 	the first time something looks for one of its rooms, occupied
+* 	zones stay pinned, and zones that have been idle too long or
+* 	that push us over the memory budget are paged back out.
+* Classes:
+* 	ResidentZone
+* 	ZoneManager
+\***************************************************************/
+
+#ifndef KOALA_ZONEMGR_HXX
+#define KOALA_ZONEMGR_HXX "%A%"
+
+#include <qintdict.h>
+#include <qstring.h>
+#include <qptrlist.h>
+#include <zthread/FastRecursiveMutex.h>
+#include <zthread/Runnable.h>
+
+#include "memory.hxx"
+
+namespace koalamud {
+
+class Room;
+
+/** Residency record for one zone
+ * Records live as long as the manager so rooms can keep a pointer to theirs.
+ */
+class ResidentZone
+{
+	public:
+		/** Build a record for a zone that isn't loaded */
+		ResidentZone(int zone)
+			: zoneid(zone), resident(false), occupants(0), lastused(0), bytes(0)
+			{}
+
+		void enter(void);
+		void leave(void);
+
+		/** Zone number */
+		int zoneid;
+		/** True while the zone's rooms are loaded */
+		bool resident;
+		/** Characters in the zone's rooms, the zone is pinned while nonzero */
+		unsigned long occupants;
+		/** Reactor::now() when the zone was last loaded, looked up, entered or
+		 * left */
+		unsigned long long lastused;
+		/** Rough memory used by the zone's rooms and exits */
+		unsigned long bytes;
+		/** Rooms we loaded for the zone */
+		QPtrList<Room> rooms;
+
+	public:
+		/** Operator new overload */
+		void * operator new(size_t obj_size)
+			{ return koalamud::PoolAllocator::alloc(obj_size, MEMTAG_WORLD); }
+		/** Operator delete overload */
+		void operator delete(void *ptr)
+			{ koalamud::PoolAllocator::free(ptr, MEMTAG_WORLD); }
+};
+
+/** Zone residency manager
+ * When paging is off (the default) the whole world is loaded at boot as
+ * before and this class does nothing.  With '<profile>-zonepaging' set to
+ * 'yes' boot loads no rooms at all; Room::findRoom pages a zone in the first
+ * time one of its rooms is wanted.
+ *
+ * Exits refer to their destination by coordinates, so zones can come and go
+ * independently.  Evicting a zone takes its rooms out of RoomMap and
+ * WorldGrid straight away but only deletes them on a later sweep, after
+ * anyone who looked one up just before has finished with it.  A room that
+ * picked up a character in that window is kept until it empties.
+ */
+class ZoneManager
+{
+	public:
+		/** Milliseconds between eviction sweeps */
+		static const unsigned int sweepinterval = 60000;
+		/** Zone idle time before eviction when the config doesn't say, in
+		 * seconds */
+		static const unsigned int defaultttl = 1800;
+
+	protected:
+		/** Timer task that runs sweep() */
+		class SweepTask : public ZThread::Runnable
+		{
+			public:
+				/** Empty virtual destructor */
+				virtual ~SweepTask(void) {}
+				/** Run a sweep */
+				virtual void run(void) { ZoneManager::instance()->sweep(); }
+		};
+
+		/** A room waiting to be deleted */
+		typedef struct {
+			Room *room; /**< Evicted room */
+			unsigned long long evicted; /**< Reactor::now() at eviction */
+		} retired_t;
+
+		/** A room row read from the database */
+		typedef struct {
+			int zone, lat, longi, elev; /**< Coordinates */
+			QString title; /**< Room title */
+			QString description; /**< Room description */
+			unsigned int flags; /**< Room flags */
+			int type; /**< Room type */
+			unsigned int plrlimit; /**< Player limit */
+		} roomrow_t;
+
+		/** An exit row read from the database */
+		typedef struct {
+			int zone1, lat1, long1, elev1; /**< Room the exit leaves */
+			int zone2, lat2, long2, elev2; /**< Room the exit leads to */
+			QString name; /**< Exit name */
+			unsigned int keyobj; /**< Key object */
+			unsigned int flags; /**< Exit flags */
+			QString direction; /**< Direction from the first room */
+		} exitrow_t;
+
+		/** Everything fetchZone read for one zone */
+		class ZoneRows
+		{
+			public:
+				/** Build an empty set of rows */
+				ZoneRows(void)
+					{ rooms.setAutoDelete(true); exits.setAutoDelete(true); }
+
+				/** Room rows */
+				QPtrList<roomrow_t> rooms;
+				/** Exit rows */
+				QPtrList<exitrow_t> exits;
+		};
+
+	protected:
+		ZoneManager(void);
+
+	public:
+		void configure(bool paging, unsigned int ttl, unsigned long budget);
+		/** Return true if zones are paged in on demand */
+		bool isPaging(void) const { return _paging; }
+
+		Room *page(int zone, int lat, int longi, int elev);
+		void adopt(Room *room);
+		void start(void);
+		void sweep(void);
+
+		/** Return the number of resident zones */
+		unsigned int residentCount(void) const { return _resident; }
+		/** Return the rough memory used by resident zones */
+		unsigned long residentBytes(void) const { return _bytes; }
+
+		/** Get a pointer to the singleton instance */
+		static ZoneManager *instance(void)
+			{
+				static ZoneManager *_instance = NULL;
+				if (_instance == NULL)
+					_instance = new ZoneManager;
+				return _instance;
+			}
+
+	protected:
+		static bool fetchZone(int zone, ZoneRows &rows);
+		void loadZone(ResidentZone *z, ZoneRows &rows);
+		void evictZone(ResidentZone *z);
+		void evictForBudget(ResidentZone *keep);
+		static unsigned long roomBytes(Room *room);
+
+	protected:
+		/** True if zones are paged in on demand */
+		bool _paging;
+		/** Idle time before eviction in milliseconds */
+		unsigned long long _ttl;
+		/** Memory budget in bytes, 0 for none */
+		unsigned long _budget;
+		/** Residency records by zone */
+		QIntDict<ResidentZone> zones;
+		/** Evicted rooms waiting to be deleted */
+		QPtrList<retired_t> retired;
+		/** Number of resident zones */
+		unsigned int _resident;
+		/** Rough memory used by resident zones */
+		unsigned long _bytes;
+		/** Sweep timer task */
+		SweepTask sweeper;
+		/** Protects everything above */
+		ZThread::FastRecursiveMutex zonelock;
+};
+
+}; /* end koalamud namespace */
+
+#endif  // KOALA_ZONEMGR_HXX
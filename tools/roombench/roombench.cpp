@@ -0,0 +1,116 @@
+/***************************************************************\
+*                        KoalaMud Gen 2                         *
+*    Copyright (c) 2002 First Step Internet Services, Inc.      *
+*                     All Rights Reserved                       *
+*        Distributed under the terms of the FSI License         *
+* See file LICENSE in the root of this package for information  *
+\***************************************************************/
+/***************************************************************\
+*	Module: TOOLS/RoomBench
+* Description:
+* 	Times RoomIndex lookups on a synthetic world against the
+* 	string keyed QDict lookup that RoomMap used to be.  This runs
+* 	outside the server so it never competes with game threads.
+* 	roombench [rooms] [passes]
+* Classes:
+\***************************************************************/
+
+#define KOALA_ROOMBENCH_CXX "%A%"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <qdict.h>
+#include <qmemarray.h>
+#include <qstring.h>
+#include <qtextstream.h>
+
+#include "roomindex.hxx"
+
+using koalamud::Room;
+using koalamud::RoomIndex;
+
+/** Rooms along each side of a zone in the synthetic world */
+static const int zonewidth = 100;
+
+/** Monotonic clock in nanoseconds */
+static unsigned long long nanoTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/** Room reference string, as Room::getRef builds it */
+static QString getRef(int zone, int lat, int longi, int elev)
+{
+	QString ref;
+	QTextOStream os(&ref);
+	os << "(" << zone << "," << lat << "," << longi << "," << elev << ")";
+	return ref;
+}
+
+/** Build the world, then look every room up in both maps */
+int main(int argc, char **argv)
+{
+	unsigned int count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+	unsigned int passes = (argc > 2) ? strtoul(argv[2], NULL, 10) : 10;
+	if (count == 0 || passes == 0)
+	{
+		fprintf(stderr, "usage: %s [rooms] [passes]\n", argv[0]);
+		return 1;
+	}
+
+	/* The index never looks inside a room, so any distinct addresses do */
+	char *rooms = (char *)malloc(count);
+	QMemArray<RoomIndex::roomkey_t> keys(count);
+	RoomIndex index;
+	QDict<char> bydict(count * 2 + 1);
+	int zone, lat, longi, elev;
+
+	index.reserve(count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		zone = i / (zonewidth * zonewidth);
+		lat = (i / zonewidth) % zonewidth;
+		longi = i % zonewidth;
+		elev = 0;
+		RoomIndex::packKey(zone, lat, longi, elev, keys[i]);
+		index.insert(zone, lat, longi, elev, (Room *)(rooms + i));
+		bydict.insert(getRef(zone, lat, longi, elev), rooms + i);
+	}
+
+	unsigned long found = 0;
+	unsigned long long start = nanoTime();
+	for (unsigned int p = 0; p < passes; p++)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			RoomIndex::unpackKey(keys[i], zone, lat, longi, elev);
+			if (index.find(zone, lat, longi, elev))
+				found++;
+		}
+	}
+	unsigned long long indextime = nanoTime() - start;
+
+	start = nanoTime();
+	for (unsigned int p = 0; p < passes; p++)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			RoomIndex::unpackKey(keys[i], zone, lat, longi, elev);
+			if (bydict[getRef(zone, lat, longi, elev)])
+				found++;
+		}
+	}
+	unsigned long long dicttime = nanoTime() - start;
+
+	unsigned long long lookups = (unsigned long long)count * passes;
+	printf("Looked up %u rooms %u times (%lu found)\n", count, passes, found);
+	printf("RoomIndex:  %llu ns per lookup, %luk in %lu slots\n",
+				 indextime / lookups, index.memoryUsed() / 1024, index.capacity());
+	printf("QDict:      %llu ns per lookup\n", dicttime / lookups);
+
+	free(rooms);
+	return 0;
+}
@@ -0,0 +1,13 @@
+TARGET = roombench
+DESTDIR = ../../bin
+TEMPLATE = app
+INCLUDEPATH += ../../koalamud
+OBJECTS_DIR = .obj
+LIBS += -lZThread -lrt
+CONFIG += release \
+          warn_on \
+          qt \
+          thread
+
+SOURCES += roombench.cpp ../../koalamud/roomindex.cpp
+HEADERS += ../../koalamud/roomindex.hxx
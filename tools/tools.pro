@@ -0,0 +1,2 @@
+SUBDIRS = roombench
+TEMPLATE = subdirs